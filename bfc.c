@@ -24,36 +24,90 @@
 #include <unistd.h>
 #include <string.h>
 
-#define STACK_SIZE          1024  /* Default loop stack size */
-#define STACK_GROWTH_FACTOR 1.1   /* Increase stack by 10% if it is full */
+#include "bfc.h"
 
 static const char bfc_usage[] = "bfc [options] ... <file>\n"
                                 "Options:\n"
                                 " -S       " "   " "Compile only; do not assemble or link\n"
                                 " -c       " "   " "Compile and assemble, but do not link\n"
+                                " -g       " "   " "Emit DWARF line information for the BF source\n"
                                 " -o <file>" "   " "Write output to file\n"
                                 " -s <size>" "   " "Allocate specified number of bytes\n"
+                                " -O<level>" "   " "Set optimisation level; 0 disables optimisation,\n"
+                                "          " "   " "2 also unrolls loops\n"
+                                " -mtune=<cpu>"    "Tune code layout for the processor, e.g. generic,\n"
+                                "             "    "core2, sandybridge, haswell, skylake or zen\n"
+                                " -march=<cpu>"    "Generate code for the processor, e.g. i686,\n"
+                                "             "    "pentium4, nehalem, haswell, skylake-avx512 or native\n"
+                                " -m<ext>     "    "Use the extension sse2, sse4.1, avx2, avx512f, bmi\n"
+                                "             "    "or bmi2; -mno-<ext> disables it\n"
+                                " -mdispatch  "    "Also generate code for newer processors and select\n"
+                                "             "    "the best variant at run time\n"
+                                " -r       " "   " "Run the program in process instead of writing it\n"
+                                " -b <list>" "   " "Run the program over each input file named in the\n"
+                                "          " "   " "list, writing its output to <input>.out\n"
+                                " -j <n>   " "   " "With -b, run n inputs at a time; by default one\n"
+                                "          " "   " "per processor\n"
+                                " -flockstep  "    "With -b, interpret the program on 16 inputs at a\n"
+                                "             "    "time in SIMD lanes (experimental)\n"
+                                " -p <kind>" "   " "With -r, describe the code to perf in a map file\n"
+                                "          " "   " "(-p map) or a jitdump file (-p jitdump)\n"
+                                " -fprofile-generate[=<file>]\n"
+                                "             "    "Count the iterations of the loops and append them\n"
+                                "             "    "to the profile file, by default <name>.prof\n"
+                                " -fprofile-use[=<file>]\n"
+                                "             "    "Optimise unrolling and the layout of the loops\n"
+                                "             "    "for the counts in the profile file\n"
+                                " -fcount-steps"   "Count the executed operations and write the total\n"
+                                "             "    "at exit\n"
+                                " -fstep-budget=<n>\n"
+                                "             "    "Also end the program with status 3 once it has\n"
+                                "             "    "executed more than n operations\n"
+                                " -fsparse-tape"   "Map the pages of the tape when they are first\n"
+                                "             "    "touched; the default for tapes of 64 MiB up to\n"
+                                "             "    "1 GiB, which is the largest sparse tape\n"
+                                " -ftape-load=<file>\n"
+                                "             "    "Start with the cells of the tape image in the file,\n"
+                                "             "    "mapped copy-on-write into a sparse tape\n"
+                                " -ftape-dump=<file>\n"
+                                "             "    "Write the tape up to its last nonzero cell to the\n"
+                                "             "    "file at exit; images hold 32-bit little-endian cells\n"
+                                " -fcpu-limit=<s>"  "End the program with status 4 once it has used\n"
+                                "             "    "s seconds of processor time\n"
+                                " -ftime-limit=<s>" "End the program with status 5 once it has run\n"
+                                "             "    "for s seconds\n"
+                                " -fmemory-limit=<n>[k|m|g]\n"
+                                "             "    "Limit the address space of the program to n bytes\n"
+                                " -fcheckpoint[=<file>]\n"
+                                "             "    "Write the state of the program to the file, by\n"
+                                "             "    "default <name>.ckpt, on SIGUSR1 and on SIGTERM,\n"
+                                "             "    "which ends it with status 6; the program continues\n"
+                                "             "    "from the file when run with --restore\n"
+                                " -fcheckpoint-steps=<n>\n"
+                                "             "    "Also write the state every n operations\n"
+                                " -fspecialise-input=<file>\n"
+                                "             "    "Run the program on the input in the file at compile\n"
+                                "             "    "time and compile what is left; the program then\n"
+                                "             "    "reads the input that follows the file\n"
+                                " -ftrap-endless-loops\n"
+                                "             "    "End the program with status 7 when it enters a\n"
+                                "             "    "loop that never terminates and writes no output\n"
+                                "             "    "instead of spinning\n"
+                                " -fmemoise-loops\n"
+                                "             "    "Cache the results of loops with inner loops that\n"
+                                "             "    "only compute on a few cells\n"
+                                " -fparallel-phases\n"
+                                "             "    "Run top-level loops that touch separate cells and\n"
+                                "             "    "read no input in concurrent processes\n"
+                                " -fprofile-sample" "Sample the running program and print a profile of\n"
+                                "             "    "its loops at exit\n"
                                 " -h       " "   " "Display this help and exit\n";
 
-enum stage
-{
-  COMPILE,   /* Compile only */
-  ASSEMBLE,  /* Compile and assemble only */
-  LINK       /* Compile, assemble and link */
-};
-
-typedef struct info_t info_t;
-struct info_t
-{
-  char *in_filename;       /* BF source code file name */
-  char *out_filename;      /* Object code file name */
-  enum stage target;       /* Final stage that generates the object code */
-  unsigned int cells_size; /* Number of bytes allocated as memory */
-};
-
 int setup_info(info_t *info, int argc, char **argv);
 void compile(const info_t *info, const char *asm_filename, const char *src_filename);
 char *replace_extension(const char *name, char ext);
+char *default_name(const char *name, const char *ext);
+int parse_limit(const char *arg, unsigned long *limit, int scaled);
 void usage(const char *msg);
 void error(const char *err, ...);
 
@@ -70,15 +124,60 @@ int main(int argc, char **argv)
   char *command;                 /* Pointer for external commands */
   size_t len;                    /* Stores string lengths */
   int ok;                        /* Boolean status flag */
+  int fd;                        /* Temporary executable code file */
+  int status;                    /* Exit status of external commands */
+  profile_t profile;             /* Loop counts for -fprofile-use */
   info_t info;                   /* Compilation information */
 
   info.in_filename = NULL;
   info.out_filename = NULL;
   info.target = LINK; 
   info.cells_size = cells_size;
+  info.sparse_tape = -1;
+  info.tape_load = NULL;
+  info.specialise_input = NULL;
+  info.tape_dump = NULL;
+  info.opt_level = 1;
+  info.tune = NULL;
+  info.arch_tune = default_tune;
+  info.features = 0;
+  info.dispatch = 0;
+  info.debug = 0;
+  info.run = 0;
+  info.perf = 0;
+  info.batch = NULL;
+  info.jobs = 0;
+  info.lockstep = 0;
+  info.parallel = 0;
+  info.trap_loops = 0;
+  info.memo_loops = 0;
+  info.sample = 0;
+  info.profile_generate = NULL;
+  info.profile_use = NULL;
+  info.profile = NULL;
+  info.count_steps = 0;
+  info.step_budget = STEP_UNLIMITED;
+  info.cpu_limit = 0;
+  info.time_limit = 0;
+  info.memory_limit = 0;
+  info.checkpoint = NULL;
+  info.checkpoint_steps = 0;
 
   ok = setup_info(&info, argc, argv);
 
+  /* Running in process needs the linked program */
+  if (info.batch != NULL) {
+    info.run = 1;
+  }
+  if (info.run) {
+    info.target = LINK;
+  }
+
+  /* Without -mtune, tune for the processor that -march selects */
+  if (info.tune == NULL) {
+    info.tune = info.arch_tune;
+  }
+
   if (!ok) {
     error("Invalid command line arguments; see 'bfc -h'");
   }
@@ -88,6 +187,88 @@ int main(int argc, char **argv)
     error("Missing input file; see 'bfc -h'");
   }
 
+  /* The copies of a batch run share files and are reset between inputs */
+  if (info.batch != NULL) {
+    if (info.checkpoint != NULL || info.tape_dump != NULL || info.perf != 0) {
+      error("Batch runs do not support checkpoints, tape dumps or perf files");
+    }
+    if (info.sparse_tape > 0 || info.tape_load != NULL) {
+      error("Batch runs do not support sparse tapes");
+    }
+    info.sparse_tape = 0;
+  }
+
+  /* The tape is allocated when the program is loaded */
+  if (info.memory_limit != 0 && info.cells_size + 2 * TAPE_GUARD > info.memory_limit) {
+    error("Memory of %u bytes exceeds the memory limit of %lu bytes",
+          info.cells_size, info.memory_limit);
+  }
+
+  /*
+   * Large tapes are mostly untouched, so map them on demand unless a
+   * checkpoint, which saves the BSS, must include them
+   */
+  if (info.tape_load != NULL) {
+    if (info.sparse_tape == 0) {
+      error("Tape images are mapped into a sparse tape");
+    }
+    info.sparse_tape = 1;
+  }
+  if (info.sparse_tape < 0) {
+    info.sparse_tape = info.cells_size >= SPARSE_TAPE_MIN && info.cells_size <= SPARSE_TAPE_MAX &&
+                       info.checkpoint == NULL;
+  } else if (info.sparse_tape && info.checkpoint != NULL) {
+    error("Checkpoints do not support sparse tapes");
+  } else if (info.sparse_tape && info.cells_size > SPARSE_TAPE_MAX) {
+    error("Sparse tapes and tape images hold at most %u bytes", SPARSE_TAPE_MAX);
+  }
+
+  /* Profiles and checkpoints are named after the source file unless given */
+  if (info.checkpoint != NULL && *info.checkpoint == '\0') {
+    info.checkpoint = default_name(info.in_filename, ".ckpt");
+  }
+  if (info.profile_generate != NULL && *info.profile_generate == '\0') {
+    info.profile_generate = default_name(info.in_filename, ".prof");
+  }
+  if (info.profile_use != NULL) {
+    if (*info.profile_use == '\0') {
+      info.profile_use = default_name(info.in_filename, ".prof");
+    }
+    read_profile(&profile, info.profile_use);
+    info.profile = &profile;
+  }
+
+  /*
+   * Phases run in processes of their own, which neither count steps
+   * together nor share signals, profiles or a tape to save
+   */
+  if (info.parallel) {
+    if (info.run || info.count_steps || info.sample || info.profile_generate != NULL ||
+        info.checkpoint != NULL || info.tape_dump != NULL || info.cpu_limit != 0 ||
+        info.time_limit != 0) {
+      error("-fparallel-phases does not support in process runs, step counts, "
+            "profiles, limits, checkpoints or tape dumps");
+    }
+  }
+
+  /*
+   * Specialised programs start from the state the input left, which they
+   * cannot count the steps to, with a tape they set themselves
+   */
+  if (info.specialise_input != NULL) {
+    if (info.count_steps || info.tape_load != NULL || info.lockstep) {
+      error("-fspecialise-input does not support step counts, tape images or lockstep runs");
+    }
+  }
+
+  /* The lockstep engine interprets the program instead of compiling it */
+  if (info.lockstep) {
+    if (info.batch == NULL) {
+      error("-flockstep needs a batch run with -b");
+    }
+    exit(run_lockstep(&info) ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
   /*
    * Phase 1: Compile
    */
@@ -101,6 +282,9 @@ int main(int argc, char **argv)
 
   /* Compile the source file into IA-32 assembly code */
   compile(&info, asm_filename, info.in_filename);
+  if (info.profile != NULL) {
+    profile_free(&profile);
+  }
 
   /* If compile only option was specified, exit */
   if (info.target == COMPILE) {
@@ -127,12 +311,15 @@ int main(int argc, char **argv)
   sprintf(command, "as -o %s %s", obj_filename, asm_filename);
 
   /* Assemble the assembly code into object code */
-  system(command);
+  status = system(command);
   free(command);
 
   /* Assembly code file is not required after assembling */
   unlink(asm_filename);
   free(asm_filename);
+  if (status != 0) {
+    error("Could not assemble %s", info.in_filename);
+  }
 
   /* If compile and assemble only option was specified, exit */
   if (info.target == ASSEMBLE) {
@@ -149,6 +336,15 @@ int main(int argc, char **argv)
     bin_filename = info.out_filename;
   }
 
+  /* A program to run in process is linked to a temporary file */
+  if (info.run) {
+    bin_filename = strdup("/tmp/bfcXXXXXX");
+    if (bin_filename == NULL || (fd = mkstemp(bin_filename)) < 0) {
+      error("Could not create a temporary file to link to");
+    }
+    close(fd);
+  }
+
   /* Prepare command line for GNU ld */
   len = strlen("ld -o") + strlen(obj_filename) + strlen(bin_filename) + 3;
   if ((command = malloc(len)) == NULL) {
@@ -157,13 +353,31 @@ int main(int argc, char **argv)
   sprintf(command, "ld -o %s %s", bin_filename, obj_filename);
 
   /* Link the object code to executable code */
-  system(command);
+  status = system(command);
   free(command);
+  if (status != 0) {
+    unlink(obj_filename);
+    error("Could not link %s", info.in_filename);
+  }
+
+  /* A batch run loads the program into each of its workers */
+  if (info.batch != NULL) {
+    ok = run_batch(&info, bin_filename);
+  }
 
   /* Object code file is not required after linking */
   unlink(obj_filename);
   free(obj_filename);
 
+  if (info.batch != NULL) {
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  /* Load the executable code and run it; the program ends the process */
+  if (info.run) {
+    run_jit(&info, bin_filename);
+  }
+
   exit(EXIT_SUCCESS);
 }
 
@@ -175,11 +389,12 @@ void compile(const info_t *info, const char *asm_filename, const char *src_filen
 {
   FILE *src;                      /* Source code file */
   FILE *as;                       /* Assembly code file */
-  size_t *stack;                  /* Loop stack */
-  size_t top = 0;                 /* Next free location in stack */
-  size_t stack_size = STACK_SIZE; /* Stack size */
-  size_t loop = 0;                /* Used to generate loop labels */
-  int c;                          /* Character in BF source code */
+  program_t prog;                 /* Intermediate representation */
+  code_t code;                    /* Instruction stream */
+  unsigned int levels[8];         /* Features of the code variants */
+  size_t nlevels = 1;             /* Number of code variants */
+  char prefix[16];                /* Label prefix of a code variant */
+  size_t i;
 
   /* Open BF code file */
   src = fopen(src_filename, "r");
@@ -193,103 +408,127 @@ void compile(const info_t *info, const char *asm_filename, const char *src_filen
     error("Could not write file %s", asm_filename);
   }
 
-  /* Create loop stack */
-  stack = malloc(stack_size * sizeof(*stack));
-  if (stack == NULL) {
-    error("Out of memory while creating loop stack of size %zu", stack_size);
+  program_init(&prog);
+  parse(&prog, src);
+  if (info->specialise_input != NULL) {
+    specialise(&prog, info);
+  }
+  if (info->opt_level > 0) {
+    /* Instrumented programs count the iterations of the loops as written */
+    optimise(&prog, info->opt_level, info->profile_generate == NULL ? info->profile : NULL);
   }
+  check_loops(&prog, info);
 
   /* Write IA-32 assembly code */
   fprintf(as, ".intel_syntax noprefix\n");
 
-  /* Allocate info->cells_size zeroed bytes */
+  /* Checkpoints save the data and BSS from here to _end */
+  fprintf(as, ".section .data\n");
+  fprintf(as, "bf_data:\n");
+
+  /* Name the source file for the line information */
+  if (info->debug) {
+    fprintf(as, ".file 1 \"");
+    for (i = 0; src_filename[i] != '\0'; i++) {
+      if (src_filename[i] == '"' || src_filename[i] == '\\') {
+        fputc('\\', as);
+      }
+      fputc(src_filename[i], as);
+    }
+    fprintf(as, "\"\n");
+  }
+
+  /*
+   * Allocate info->cells_size zeroed bytes. Vector code may read and
+   * write a few cells beyond either end, which the guards absorb.
+   */
   fprintf(as, ".section .bss\n");
-  fprintf(as, "\t.lcomm cells, %u\n", info->cells_size);
+  if (!info->sparse_tape) {
+    fprintf(as, "\t.balign 64\n");
+    fprintf(as, "\t.skip %d\n", TAPE_GUARD);
+    fprintf(as, "cells:\n");
+    fprintf(as, "\t.skip %u\n", info->cells_size);
+    fprintf(as, "\t.skip %d\n", TAPE_GUARD);
+  }
 
   /* Start instructions */
   fprintf(as, ".section .text\n");
   fprintf(as, ".globl _start\n");
   fprintf(as, "_start:\n");
 
-  /* Assign BSS address to EDI register */
-  fprintf(as, "\tlea edi, cells\n");
-  while ((c = fgetc(src)) != EOF) {
-    switch (c) {
-    case '>':
-      /* Advance pointer by four bytes (i.e. 32 bits) */
-      fprintf(as, "\tadd edi, 4\n"); 
-      break;
-    case '<':
-      /* Rewind pointer by four bytes (i.e. 32 bits) */
-      fprintf(as, "\tsub edi, 4\n");
-      break;
-    case '+':
-      /* Increment 32-bit byte pointed to by EDI register */
-      fprintf(as, "\tinc DWORD PTR [edi]\n");
-      break;
-    case '-':
-      /* Decrement 32-bit byte pointed to by EDI register */
-      fprintf(as, "\tdec DWORD PTR [edi]\n");
-      break;
-    case ',':
-      /*
-       * Tell kernel via interrupt (0x80) to write (EAX=3)
-       * one byte (EDX=1) to standard output (EBX=0).
-       * See also OS vector table.
-       */
-      fprintf(as, "\tmov eax, 3\n");
-      fprintf(as, "\tmov ebx, 0\n");
-      fprintf(as, "\tmov ecx, edi\n");
-      fprintf(as, "\tmov edx, 1\n");
-      fprintf(as, "\tint 0x80\n");
-      break;
-    case '.':
-      /*
-       * Tell kernel via interrupt (0x80) to read (EAX=4)
-       * one byte (EDX=1) from standard input (EBX=1).
-       * See also OS vector table.
-       */
-      fprintf(as, "\tmov eax, 4\n");
-      fprintf(as, "\tmov ebx, 1\n");
-      fprintf(as, "\tmov ecx, edi\n");
-      fprintf(as, "\tmov edx, 1\n");
-      fprintf(as, "\tint 0x80\n");
-      break;
-    case '[':
-      if (top == stack_size) {
-        /* Resize stack */
-        stack_size *= STACK_GROWTH_FACTOR;
-        stack = realloc(stack, sizeof(*stack) * stack_size);
-        if (stack == NULL) {
-          error("Out of memory while increasing loop stack to size: %zu\n", stack_size);
-        }
-      }
-      /* Push new loop label on stack */
-      stack[top++] = ++loop;
+  if (info->sample) {
+    begin_sample_regions(as);
+    fprintf(as, "\tcall bf_prof_start\n");
+  }
+  if (info->count_steps) {
+    fprintf(as, "\tmov r15, %lu\n", first_steps(info));
+  }
+  /* The memory limit applies to the sparse tape, which is mapped at run time */
+  if (info->cpu_limit != 0 || info->time_limit != 0 || info->memory_limit != 0) {
+    fprintf(as, "\tcall bf_limit_start\n");
+  }
+  if (info->sparse_tape) {
+    fprintf(as, "\tcall bf_tape_map\n");
+  }
+  /* Restoring a checkpoint continues in the code that wrote it */
+  if (info->checkpoint != NULL) {
+    fprintf(as, "\tcall bf_ckpt_start\n");
+  }
 
-      fprintf(as, "\tcmp DWORD PTR [edi], 0\n");
-      fprintf(as, "\tjz .LE%u\n", loop);
-      fprintf(as, ".LB%u:\n", loop);
-      break;
-    case ']':
-      /* Find matching label by popping the stack */
-      fprintf(as, "\tcmp DWORD PTR [edi], 0\n");
-      fprintf(as, "\tjnz .LB%u\n", stack[--top]);
-      fprintf(as, ".LE%u:\n", stack[top]);
-      break;
+  /* Jump to the best code variant that the processor supports */
+  levels[0] = info->features;
+  if (info->dispatch) {
+    nlevels = dispatch_levels(info->features, levels);
+    fprintf(as, "\tcall bf_cpu_features\n");
+    for (i = 0; i + 1 < nlevels; i++) {
+      fprintf(as, "\tmov ecx, eax\n");
+      fprintf(as, "\tand ecx, %u\n", levels[i]);
+      fprintf(as, "\tcmp ecx, %u\n", levels[i]);
+      fprintf(as, "\tje bf_main_%s\n", level_name(levels[i]));
     }
   }
 
-  /* Specify sys_exit function code (from OS vector table) */
-  fprintf(as, "mov eax, 1\n");
+  for (i = 0; i < nlevels; i++) {
+    code_init(&code);
+    if (info->dispatch) {
+      snprintf(prefix, sizeof(prefix), "%s_", level_name(levels[i]));
+      code.prefix = prefix;
+      fprintf(as, "bf_main_%s:\n", level_name(levels[i]));
+    }
+
+    /* Assign tape address to EDI register and output buffer to ESI */
+    if (info->sparse_tape) {
+      fprintf(as, "\tmov edi, DWORD PTR bf_tape\n");
+    } else {
+      fprintf(as, "\tlea edi, cells\n");
+    }
+    fprintf(as, "\tmov esi, OFFSET bf_out_buf\n");
+
+    generate(&code, &prog, info, levels[i]);
+
+    /* Remove redundant compares and branches; the tape is zeroed on entry unless loaded */
+    place_cold_code(&code);
+    if (info->opt_level > 0) {
+      peephole(&code, info->tape_load == NULL);
+    }
 
-  /* Specify successful return code for OS */
-  fprintf(as, "mov ebx, 0\n");
+    write_code(as, &code);
+    if (info->sample) {
+      write_sample_regions(as, &code, &prog);
+    }
+    code_free(&code);
+  }
 
-  /* Tell kernel to perform system call */
-  fprintf(as, "int 0x80\n");
+  write_runtime(as, info);
+  if (info->sample) {
+    write_profiler(as, &prog);
+  }
+  if (info->profile_generate != NULL) {
+    write_pgo_runtime(as, &prog, info->profile_generate);
+  }
 
   /* Release allocated streams */
+  program_free(&prog);
   fclose(as);
   fclose(src);
 }
@@ -300,11 +539,14 @@ int setup_info(info_t *info, int argc, char **argv)
   char *tail;
   int c;
   int long cells_size;
+  int long opt_level;
+  unsigned long step_budget;
+  int long jobs;
 
   /* print bfc_usage instead of getopt diagnostic message */
   opterr = 0;
 
-  while ((c = getopt (argc, argv, "Scho:s:")) != -1) {
+  while ((c = getopt (argc, argv, "Scghrb:j:p:o:s:O::m:f:")) != -1) {
     switch (c) {
     case 'S':
       if(info->target > COMPILE) {
@@ -316,6 +558,32 @@ int setup_info(info_t *info, int argc, char **argv)
         info->target = ASSEMBLE;
       }
       break;
+    case 'g':
+      info->debug = 1;
+      break;
+    case 'r':
+      info->run = 1;
+      break;
+    case 'b':
+      info->batch = optarg;
+      break;
+    case 'j':
+      errno = 0;
+      jobs = strtol(optarg, &tail, 10);
+      if (errno || *tail != '\0' || jobs <= 0 || jobs > 4096) {
+        return 0;
+      }
+      info->jobs = jobs;
+      break;
+    case 'p':
+      if (strcmp(optarg, "map") == 0) {
+        info->perf |= PERF_MAP;
+      } else if (strcmp(optarg, "jitdump") == 0) {
+        info->perf |= PERF_JITDUMP;
+      } else {
+        return 0;
+      }
+      break;
     case 'o':
       info->out_filename = optarg;
       break;
@@ -328,6 +596,92 @@ int setup_info(info_t *info, int argc, char **argv)
 
       info->cells_size = cells_size;
       break;
+    case 'O':
+      /* A bare -O selects the default level */
+      if (optarg == NULL) {
+        info->opt_level = 1;
+        break;
+      }
+      errno = 0;
+      opt_level = strtol(optarg, &tail, 10);
+      if(errno || *tail != '\0' || opt_level < 0) {
+        return 0;
+      }
+
+      info->opt_level = opt_level;
+      break;
+    case 'm':
+      if (!set_machine_option(info, optarg)) {
+        return 0;
+      }
+      break;
+    case 'f':
+      if (strcmp(optarg, "profile-sample") == 0) {
+        info->sample = 1;
+      } else if (strcmp(optarg, "profile-generate") == 0) {
+        info->profile_generate = "";
+      } else if (strncmp(optarg, "profile-generate=", 17) == 0) {
+        info->profile_generate = optarg + 17;
+      } else if (strcmp(optarg, "count-steps") == 0) {
+        info->count_steps = 1;
+      } else if (strncmp(optarg, "step-budget=", 12) == 0) {
+        errno = 0;
+        step_budget = strtoul(optarg + 12, &tail, 0);
+        if (errno || *tail != '\0' || optarg[12] == '-' || step_budget > STEP_UNLIMITED) {
+          return 0;
+        }
+        info->count_steps = 1;
+        info->step_budget = step_budget;
+      } else if (strncmp(optarg, "cpu-limit=", 10) == 0) {
+        if (!parse_limit(optarg + 10, &info->cpu_limit, 0)) {
+          return 0;
+        }
+      } else if (strncmp(optarg, "time-limit=", 11) == 0) {
+        if (!parse_limit(optarg + 11, &info->time_limit, 0)) {
+          return 0;
+        }
+      } else if (strncmp(optarg, "memory-limit=", 13) == 0) {
+        if (!parse_limit(optarg + 13, &info->memory_limit, 1)) {
+          return 0;
+        }
+      } else if (strcmp(optarg, "lockstep") == 0) {
+        info->lockstep = 1;
+      } else if (strcmp(optarg, "parallel-phases") == 0) {
+        info->parallel = 1;
+      } else if (strcmp(optarg, "trap-endless-loops") == 0) {
+        info->trap_loops = 1;
+      } else if (strcmp(optarg, "memoise-loops") == 0) {
+        info->memo_loops = 1;
+      } else if (strcmp(optarg, "sparse-tape") == 0) {
+        info->sparse_tape = 1;
+      } else if (strcmp(optarg, "no-sparse-tape") == 0) {
+        info->sparse_tape = 0;
+      } else if (strncmp(optarg, "specialise-input=", 17) == 0) {
+        info->specialise_input = optarg + 17;
+      } else if (strncmp(optarg, "tape-load=", 10) == 0) {
+        info->tape_load = optarg + 10;
+      } else if (strncmp(optarg, "tape-dump=", 10) == 0) {
+        info->tape_dump = optarg + 10;
+      } else if (strcmp(optarg, "checkpoint") == 0) {
+        info->checkpoint = "";
+      } else if (strncmp(optarg, "checkpoint=", 11) == 0) {
+        info->checkpoint = optarg + 11;
+      } else if (strncmp(optarg, "checkpoint-steps=", 17) == 0) {
+        if (!parse_limit(optarg + 17, &info->checkpoint_steps, 0)) {
+          return 0;
+        }
+        if (info->checkpoint == NULL) {
+          info->checkpoint = "";
+        }
+        info->count_steps = 1;
+      } else if (strcmp(optarg, "profile-use") == 0) {
+        info->profile_use = "";
+      } else if (strncmp(optarg, "profile-use=", 12) == 0) {
+        info->profile_use = optarg + 12;
+      } else {
+        return 0;
+      }
+      break;
     default:
       return 0;
     }
@@ -341,6 +695,44 @@ int setup_info(info_t *info, int argc, char **argv)
   return 0;
 }
 
+/*
+ * Parses a positive limit, which may be scaled by a suffix k, m or g
+ * for 2^10, 2^20 or 2^30. Returns 0 if the limit is malformed.
+ */
+int parse_limit(const char *arg, unsigned long *limit, int scaled)
+{
+  char *tail;
+  unsigned long value;
+  int shift = 0;
+
+  errno = 0;
+  value = strtoul(arg, &tail, 10);
+  if (errno || tail == arg || *arg == '-' || value == 0) {
+    return 0;
+  }
+  if (scaled && *tail != '\0' && tail[1] == '\0') {
+    switch (*tail++) {
+    case 'k': case 'K':
+      shift = 10;
+      break;
+    case 'm': case 'M':
+      shift = 20;
+      break;
+    case 'g': case 'G':
+      shift = 30;
+      break;
+    default:
+      return 0;
+    }
+  }
+  if (*tail != '\0' || value > (~0UL >> 2) >> shift) {
+    return 0;
+  }
+
+  *limit = value << shift;
+  return 1;
+}
+
 /*
  * Constructs a new string by replacing the file extension with the
  * specified extension. If the filename has no extension, the extension
@@ -366,6 +758,24 @@ char *replace_extension(const char *name, char ext)
   return new_name;
 }
 
+/* Returns the name of the source file with the extension replaced by ext */
+char *default_name(const char *name, const char *ext)
+{
+  char *new_name;
+  const char *dot = strrchr(name, '.');
+  const size_t len = (dot == NULL ? strlen(name) : dot - name);
+
+  new_name = malloc(len + strlen(ext) + 1);
+  if (new_name == NULL) {
+    error("Out of memory while naming the %s file of %s", ext, name);
+  }
+
+  memcpy(new_name, name, len);
+  strcpy(new_name + len, ext);
+
+  return new_name;
+}
+
 void error(const char *err, ...)
 {
   va_list params;
@@ -0,0 +1,376 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BFC_H
+#define BFC_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define TAPE_GUARD   64    /* Bytes before and after the tape that vector code may touch */
+#define OUT_BUF_SIZE 4096  /* Size of the output buffer of compiled programs */
+#define IN_BUF_SIZE  4096  /* Size of the input buffer of compiled programs */
+#define SAMPLE_USEC  1000  /* Interval of the sampling profiler in microseconds */
+#define STEP_EXIT    3     /* Exit status of programs that exceed their step budget */
+#define CPU_LIMIT_EXIT  4  /* Exit status of programs that exceed their processor time */
+#define TIME_LIMIT_EXIT 5  /* Exit status of programs that exceed their real time */
+#define CHECKPOINT_EXIT 6  /* Exit status of programs stopped by SIGTERM after a checkpoint */
+#define ENDLESS_EXIT 7     /* Exit status of programs trapped in a loop that never terminates */
+#define SPARSE_TAPE_MIN 0x4000000  /* Size of tapes mapped on demand by default */
+#define SPARSE_TAPE_MAX 0x3fe00000 /* Largest tape that MAP_32BIT can place, which is in the second GiB */
+#define PHASE_MAX    64    /* Maximum number of phases run concurrently */
+#define DIVMOD_CELLS 24    /* Cells around a division loop that are examined */
+#define MEMO_CELLS   (TAPE_GUARD / 4)  /* Maximum number of cells of a memoised loop */
+#define MEMO_SLOTS   4096  /* Entries of the cache of memoised loops, a power of two */
+#define STEP_UNLIMITED 0x4000000000000000UL  /* Step budget of programs without one */
+
+enum stage
+{
+  COMPILE,   /* Compile only */
+  ASSEMBLE,  /* Compile and assemble only */
+  LINK       /* Compile, assemble and link */
+};
+
+/* Instruction set extensions that code may be generated for */
+#define FEATURE_SSE2    0x01
+#define FEATURE_SSE4_1  0x02
+#define FEATURE_AVX2    0x04
+#define FEATURE_AVX512F 0x08
+#define FEATURE_BMI     0x10
+#define FEATURE_BMI2    0x20
+
+/* Files for perf that describe the code of programs run in process */
+#define PERF_MAP     0x01  /* /tmp/perf-<pid>.map */
+#define PERF_JITDUMP 0x02  /* jit-<pid>.dump */
+
+/* Code generation preferences of a processor family */
+typedef struct tune_t tune_t;
+struct tune_t
+{
+  const char *name;
+  unsigned int loop_align;  /* Alignment of innermost loop heads in bytes */
+  unsigned int loop_skip;   /* Maximum number of padding bytes for it */
+};
+
+/* Counts of a loop from runs of a program compiled with -fprofile-generate */
+typedef struct loop_count_t loop_count_t;
+struct loop_count_t
+{
+  unsigned int line;        /* Position of the '[' of the loop */
+  unsigned int column;
+  unsigned long entries;    /* Number of times the body was entered */
+  unsigned long iterations; /* Number of times the body ran */
+};
+
+typedef struct profile_t profile_t;
+struct profile_t
+{
+  loop_count_t *loops;      /* Sorted by position */
+  size_t len;
+  unsigned long total;      /* Iterations of all loops */
+};
+
+typedef struct info_t info_t;
+struct info_t
+{
+  char *in_filename;       /* BF source code file name */
+  char *out_filename;      /* Object code file name */
+  enum stage target;       /* Final stage that generates the object code */
+  unsigned int cells_size; /* Number of bytes allocated as memory */
+  int sparse_tape;         /* Map the tape on demand instead of placing it in the BSS */
+  const char *tape_load;   /* Tape image the program starts from, or NULL */
+  const char *tape_dump;   /* File the program writes its tape to at exit, or NULL */
+  const char *specialise_input; /* Start of the input the program is specialised for, or NULL */
+  int opt_level;           /* Optimisation level, zero disables optimisation */
+  const tune_t *tune;      /* Processor to tune the code for */
+  const tune_t *arch_tune; /* Default tuning of the selected architecture */
+  unsigned int features;   /* Instruction set extensions that may be used */
+  int dispatch;            /* Select code for the processor at run time */
+  int debug;               /* Emit DWARF line information */
+  int run;                 /* Run the program in the compiler process */
+  int perf;                /* PERF_* files that describe the code when run */
+  const char *batch;       /* File listing the inputs of a batch run, or NULL */
+  unsigned int jobs;       /* Inputs run at once in a batch run, 0 for one per processor */
+  int lockstep;            /* Interpret batch runs on several inputs in lockstep */
+  int parallel;            /* Run independent phases of the program concurrently */
+  int trap_loops;          /* End the program in loops that never terminate */
+  int memo_loops;          /* Cache the results of loops that only compute */
+  int sample;              /* Sample the program counter and print a profile */
+  const char *profile_generate; /* Profile file the program writes loop counts to */
+  const char *profile_use;      /* Profile file of loop counts to optimise for */
+  const profile_t *profile;     /* Profile read from profile_use, or NULL */
+  int count_steps;         /* Count the executed operations */
+  unsigned long step_budget; /* Maximum number of operations to execute */
+  unsigned long cpu_limit;    /* Processor time limit in seconds, 0 if none */
+  unsigned long time_limit;   /* Real time limit in seconds, 0 if none */
+  unsigned long memory_limit; /* Address space limit in bytes, 0 if none */
+  const char *checkpoint;     /* File the program writes checkpoints to, or NULL */
+  unsigned long checkpoint_steps; /* Steps between checkpoints, 0 if none */
+};
+
+enum ir_op
+{
+  IR_ADD,    /* Add value to cell at offset */
+  IR_MOVE,   /* Move pointer by value cells */
+  IR_SET,    /* Set cell at offset to value */
+  IR_MUL,    /* Add value times cell at src to cell at offset */
+  IR_SCAN,   /* Move pointer by value cells until cell is zero */
+  IR_CLEAR,  /* Clear cell and move pointer by value cells until cell is zero */
+  IR_IN,     /* Read byte into cell at offset */
+  IR_OUT,    /* Write byte from cell at offset */
+  IR_LOOP,   /* Begin of loop that runs while cell is nonzero, at most once if value is set */
+  IR_END,    /* End of loop */
+  IR_BREAK,  /* Leave the enclosing loop if cell at offset is zero */
+  IR_COUNT,  /* Begin of loop that runs cell times value times */
+  IR_REPEAT, /* End of single copies of the body, begin of value copies */
+  IR_NEXT,   /* End of loop running value copies of the body at a time */
+  IR_TRAP    /* End the program if cell at offset and value is nonzero */
+};
+
+typedef struct ir_t ir_t;
+struct ir_t
+{
+  enum ir_op op;
+  long offset;             /* Cell relative to the pointer */
+  long value;              /* Constant operand */
+  long src;                /* Source cell of IR_MUL relative to the pointer */
+  size_t match;            /* Index of the matching IR_LOOP or IR_END */
+  unsigned int line;       /* Position in the BF source code */
+  unsigned int column;
+};
+
+typedef struct program_t program_t;
+struct program_t
+{
+  ir_t *ops;
+  size_t len;
+  size_t size;
+  unsigned int line;       /* Source position of appended operations */
+  unsigned int column;
+};
+
+typedef struct divmod_t divmod_t;
+struct divmod_t
+{
+  long divisor;            /* Cell of the divisor, which ends as divisor - remainder */
+  long remainder;          /* Cell of the remainder */
+  long quotient;           /* Cell the quotient is added to */
+  long min_divisor;        /* Smallest divisor the loop divides by */
+  long zero[DIVMOD_CELLS]; /* Other cells of the loop, which must be zero */
+  size_t nzero;
+};
+
+typedef struct phase_t phase_t;
+struct phase_t
+{
+  size_t begin;            /* Index of the first operation */
+  long pos;                /* Pointer on entry relative to the first cell */
+};
+
+/* IA-32 general purpose registers in encoding order */
+enum reg
+{
+  EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI
+};
+
+enum operand_kind
+{
+  OPND_NONE,   /* No operand */
+  OPND_REG,    /* Register */
+  OPND_MEM,    /* DWORD in memory at base register plus displacement */
+  OPND_IMM,    /* Immediate value */
+  OPND_LABEL   /* Jump target */
+};
+
+typedef struct operand_t operand_t;
+struct operand_t
+{
+  enum operand_kind kind;
+  enum reg reg;            /* Register or base register of memory operand */
+  long value;              /* Immediate, displacement or label number */
+};
+
+enum opcode
+{
+  OP_LABEL,  /* Definition of the label in the first operand */
+  OP_ADD,
+  OP_SUB,
+  OP_INC,
+  OP_DEC,
+  OP_MOV,
+  OP_CMP,
+  OP_TEST,
+  OP_JMP,
+  OP_JZ,
+  OP_JNZ,
+  OP_INT,
+  OP_RAW,    /* Verbatim assembly code the optimiser must not look into */
+  OP_SYMBOL  /* Named symbol in text, which marks the start of a code region */
+};
+
+/*
+ * The immediate dst operand of an OP_SYMBOL is the index of the loop
+ * operation whose code region the symbol starts, or one of these
+ */
+#define REGION_MAIN    -1  /* Code outside of all loops */
+#define REGION_RUNTIME -2  /* Cold code and run-time routines */
+
+typedef struct insn_t insn_t;
+struct insn_t
+{
+  enum opcode op;
+  operand_t dst;           /* First operand */
+  operand_t src;           /* Second operand */
+  char *text;              /* Assembly code of OP_RAW, name of OP_SYMBOL */
+  int cold;                /* Rarely executed; placed after the hot code */
+  unsigned int line;       /* Position in the BF source code, 0 if none */
+  unsigned int column;
+};
+
+typedef struct label_t label_t;
+struct label_t
+{
+  char kind;               /* Distinguishes label families, e.g. 'B' and 'E' */
+  size_t n;                /* Number within the family */
+  unsigned int align;      /* Alignment of the labelled code, 0 if none */
+  unsigned int skip;       /* Maximum number of padding bytes for alignment */
+};
+
+/* Vector of 32-bit constants in read-only data */
+typedef struct constant_t constant_t;
+struct constant_t
+{
+  size_t label;
+  long values[16];
+  unsigned int n;
+};
+
+/* Instruction stream of the compiled program */
+typedef struct code_t code_t;
+struct code_t
+{
+  insn_t *insns;
+  size_t len;
+  size_t size;
+  label_t *labels;         /* Label names indexed by label number */
+  size_t nlabels;
+  size_t labels_size;
+  int cold;                /* Emit instructions into the cold code */
+  unsigned int line;       /* Source position of emitted instructions */
+  unsigned int column;
+  const char *prefix;      /* Prepended to label names to keep them unique */
+  constant_t *consts;
+  size_t nconsts;
+  size_t consts_size;
+};
+
+/* insn.c */
+extern const operand_t no_operand;
+operand_t reg_operand(enum reg reg);
+operand_t mem_operand(enum reg base, long disp);
+operand_t imm_operand(long value);
+operand_t label_operand(size_t label);
+int same_operand(operand_t a, operand_t b);
+void code_init(code_t *code);
+void code_free(code_t *code);
+size_t new_label(code_t *code, char kind, size_t n);
+void emit(code_t *code, enum opcode op, operand_t dst, operand_t src);
+void emit_raw(code_t *code, const char *fmt, ...);
+void emit_symbol(code_t *code, const char *fmt, ...);
+size_t add_constant(code_t *code, const long *values, unsigned int n);
+const char *label_name(const code_t *code, size_t label);
+void remove_insns(code_t *code, char *dead);
+void place_cold_code(code_t *code);
+void write_code(FILE *as, const code_t *code);
+
+/* ir.c */
+void program_init(program_t *prog);
+void program_free(program_t *prog);
+ir_t *append_op(program_t *prog, enum ir_op op, long offset, long value);
+long cell_value(long value);
+void widen_window(long *lo, long *hi, long cell);
+int find_window(const program_t *prog, size_t begin, size_t end, long *pos, long *lo, long *hi);
+void match_loops(program_t *prog);
+void parse(program_t *prog, FILE *src);
+void optimise(program_t *prog, int opt_level, const profile_t *profile);
+
+/* codegen.c */
+void generate(code_t *code, const program_t *prog, const info_t *info, unsigned int features);
+
+/* peephole.c */
+void peephole(code_t *code, int tape_zeroed);
+
+/* target.c */
+extern const tune_t *default_tune;
+const tune_t *find_tune(const char *name);
+int set_machine_option(info_t *info, const char *option);
+size_t dispatch_levels(unsigned int features, unsigned int *levels);
+const char *level_name(unsigned int features);
+
+/* runtime.c */
+void write_asciz(FILE *as, const char *s, const char *suffix);
+unsigned long first_steps(const info_t *info);
+int use_copy_loops(const info_t *info);
+int use_memo_loops(const info_t *info);
+void write_runtime(FILE *as, const info_t *info);
+
+/* checkpoint.c */
+void write_checkpoint_runtime(FILE *as, const char *filename);
+
+/* profile.c */
+void begin_sample_regions(FILE *as);
+void write_sample_regions(FILE *as, const code_t *code, const program_t *prog);
+void write_profiler(FILE *as, const program_t *prog);
+
+/* pgo.c */
+void read_profile(profile_t *profile, const char *filename);
+void profile_free(profile_t *profile);
+const loop_count_t *find_loop_count(const profile_t *profile, unsigned int line,
+                                    unsigned int column);
+int is_hot_loop(const profile_t *profile, const loop_count_t *count);
+void write_pgo_runtime(FILE *as, const program_t *prog, const char *filename);
+
+/* jit.c */
+unsigned char *read_file(const char *filename, size_t *size);
+void run_jit(const info_t *info, const char *filename);
+char **read_inputs(const char *filename, size_t *n);
+int run_batch(const info_t *info, const char *filename);
+
+/* lockstep.c */
+int run_lockstep(const info_t *info);
+
+/* phases.c */
+size_t split_phases(const program_t *prog, phase_t *phases);
+
+/* divmod.c */
+int find_divmod(const program_t *prog, size_t loop, divmod_t *div);
+
+/* memo.c */
+size_t find_memo_window(const program_t *prog, size_t loop, const info_t *info, long *lo);
+
+/* specialise.c */
+void specialise(program_t *prog, const info_t *info);
+
+/* termination.c */
+void check_loops(program_t *prog, const info_t *info);
+
+/* bfc.c */
+void error(const char *err, ...);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checkpoints of running programs. Programs compiled with -fcheckpoint
+ * write their state to the checkpoint file on SIGUSR1, and on SIGTERM
+ * before they end with CHECKPOINT_EXIT. Started with the argument
+ * --restore, they read the file back and continue where it was written.
+ *
+ * The state is everything the program can change: the data and BSS,
+ * which hold the tape and the I/O buffers, the registers and the used
+ * part of the stack. The signal handler takes the registers from the
+ * ucontext, so the program may be interrupted anywhere. The file is
+ *
+ *   magic, stamp, data size, vector state size, stack size
+ *   data and BSS
+ *   general purpose registers as in the mcontext
+ *   vector state as saved by the kernel (FXSAVE or XSAVE layout)
+ *   stack from the interrupted RSP up to the RSP at _start
+ *
+ * The stamp identifies the compilation, since the file only makes sense
+ * to the same binary. The stack holds nothing but return addresses, so
+ * it may be restored below a different stack top. The file is written
+ * under a temporary name and renamed, so a checkpoint that fails halfway
+ * leaves the previous one intact.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "bfc.h"
+
+#define CKPT_HEADER_SIZE 40
+#define CKPT_REGS_SIZE   184    /* gregs of the mcontext */
+#define CKPT_FP_SIZE     16384  /* Largest vector state that is saved */
+
+/* Offsets in the ucontext at RDX of the handler */
+#define UC_GREGS  40
+#define UC_RSP    (UC_GREGS + 15 * 8)
+#define UC_FPREGS (UC_GREGS + 23 * 8)
+
+/* Offsets of the registers in the saved gregs */
+static const char *const gregs[] = {
+  "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+  "rdi", "rsi", "rbp", "rbx", "rdx", "rax", "rcx"
+};
+
+/* Writes the routines that move RDX bytes between RSI and the file in EBP */
+static void write_transfer(FILE *as, const char *name, int nr)
+{
+  fprintf(as, "%s:\n", name);
+  fprintf(as, "1:\n");
+  fprintf(as, "\ttest rdx, rdx\n");
+  fprintf(as, "\tjz 2f\n");
+  fprintf(as, "\tmov eax, %d\n", nr);
+  fprintf(as, "\tmov edi, ebp\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tcmp rax, -4\n");
+  fprintf(as, "\tje 1b\n");
+  fprintf(as, "\ttest rax, rax\n");
+  fprintf(as, "\tjle 3f\n");
+  fprintf(as, "\tadd rsi, rax\n");
+  fprintf(as, "\tsub rdx, rax\n");
+  fprintf(as, "\tjmp 1b\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\tclc\n");
+  fprintf(as, "\tret\n");
+  fprintf(as, "3:\n");
+  fprintf(as, "\tstc\n");
+  fprintf(as, "\tret\n");
+}
+
+/*
+ * Writes bf_ckpt_start, which installs the handlers and restores the
+ * checkpoint if asked to, the handler and bf_ckpt_now, which takes a
+ * checkpoint from the running program
+ */
+void write_checkpoint_runtime(FILE *as, const char *filename)
+{
+  unsigned long stamp = (unsigned long)time(NULL) << 20 ^ (unsigned long)getpid();
+  size_t i;
+
+  fprintf(as, ".section .rodata\n");
+  fprintf(as, "bf_ckpt_file:\n");
+  write_asciz(as, filename, "");
+  fprintf(as, "bf_ckpt_tmp:\n");
+  write_asciz(as, filename, ".tmp");
+  fprintf(as, "bf_ckpt_option:\n");
+  fprintf(as, "\t.asciz \"--restore\"\n");
+  fprintf(as, "bf_ckpt_error:\n");
+  fprintf(as, "\t.ascii \"Could not restore checkpoint \"\n");
+  write_asciz(as, filename, "\\n");
+  fprintf(as, "\t.set bf_ckpt_error_len, . - bf_ckpt_error - 1\n");
+
+  fprintf(as, ".section .data\n");
+  fprintf(as, "\t.balign 8\n");
+  fprintf(as, "bf_ckpt_header:\n");
+  fprintf(as, "\t.ascii \"BFCKPT01\"\n");
+  fprintf(as, "\t.quad %lu, 0, 0, 0\n", stamp);
+  /* struct sigaction with SA_SIGINFO, SA_RESTART and SA_RESTORER, all signals blocked */
+  fprintf(as, "bf_ckpt_action:\n");
+  fprintf(as, "\t.quad bf_ckpt_handler, 0x14000004, bf_ckpt_restorer, -1\n");
+
+  fprintf(as, ".section .bss\n");
+  fprintf(as, "\t.balign 64\n");
+  fprintf(as, "bf_ckpt_fp:\n");
+  fprintf(as, "\t.skip %d\n", CKPT_FP_SIZE);
+  fprintf(as, "\t.lcomm bf_ckpt_regs, %d\n", CKPT_REGS_SIZE);
+  fprintf(as, "\t.lcomm bf_ckpt_input, %d\n", CKPT_HEADER_SIZE);
+  fprintf(as, "\t.lcomm bf_ckpt_top, 8\n");
+  fprintf(as, "\t.lcomm bf_ckpt_sp, 8\n");
+  fprintf(as, "\t.lcomm bf_ckpt_failed, 1\n");
+
+  fprintf(as, ".section .text\n");
+
+  /* rt_sigaction(SIGUSR1 and SIGTERM, &bf_ckpt_action, NULL, 8) */
+  fprintf(as, "bf_ckpt_start:\n");
+  fprintf(as, "\tlea r12, [rsp+8]\n");
+  fprintf(as, "\tmov QWORD PTR bf_ckpt_top, r12\n");
+  fprintf(as, "\tmov eax, 13\n");
+  fprintf(as, "\tmov edi, 10\n");
+  fprintf(as, "\tmov esi, OFFSET bf_ckpt_action\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\tmov r10d, 8\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tmov eax, 13\n");
+  fprintf(as, "\tmov edi, 15\n");
+  fprintf(as, "\tmov esi, OFFSET bf_ckpt_action\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\tmov r10d, 8\n");
+  fprintf(as, "\tsyscall\n");
+
+  /* Restore if argv[1] is --restore */
+  fprintf(as, "\tcmp QWORD PTR [r12], 2\n");
+  fprintf(as, "\tjb 1f\n");
+  fprintf(as, "\tmov rsi, QWORD PTR [r12+16]\n");
+  fprintf(as, "\tmov edi, OFFSET bf_ckpt_option\n");
+  fprintf(as, "\tmov ecx, 10\n");
+  fprintf(as, "\trepe cmpsb\n");
+  fprintf(as, "\tje bf_ckpt_restore\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\tret\n");
+
+  /*
+   * R12 holds the stack top of this process, R13 the size of the vector
+   * state and R14 the size of the stack while the data is overwritten
+   */
+  fprintf(as, "bf_ckpt_restore:\n");
+  fprintf(as, "\tmov eax, 2\n");
+  fprintf(as, "\tmov edi, OFFSET bf_ckpt_file\n");
+  fprintf(as, "\txor esi, esi\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjs 9f\n");
+  fprintf(as, "\tmov ebp, eax\n");
+  fprintf(as, "\tmov esi, OFFSET bf_ckpt_input\n");
+  fprintf(as, "\tmov edx, %d\n", CKPT_HEADER_SIZE);
+  fprintf(as, "\tcall bf_ckpt_read\n");
+  fprintf(as, "\tjc 9f\n");
+  fprintf(as, "\tmov rax, QWORD PTR bf_ckpt_input\n");
+  fprintf(as, "\tcmp rax, QWORD PTR bf_ckpt_header\n");
+  fprintf(as, "\tjne 9f\n");
+  fprintf(as, "\tmov rax, QWORD PTR bf_ckpt_input+8\n");
+  fprintf(as, "\tcmp rax, QWORD PTR bf_ckpt_header+8\n");
+  fprintf(as, "\tjne 9f\n");
+  fprintf(as, "\tmov eax, OFFSET _end\n");
+  fprintf(as, "\tsub eax, OFFSET bf_data\n");
+  fprintf(as, "\tcmp rax, QWORD PTR bf_ckpt_input+16\n");
+  fprintf(as, "\tjne 9f\n");
+  fprintf(as, "\tmov r13, QWORD PTR bf_ckpt_input+24\n");
+  fprintf(as, "\tmov r14, QWORD PTR bf_ckpt_input+32\n");
+  fprintf(as, "\tcmp r13, %d\n", CKPT_FP_SIZE);
+  fprintf(as, "\tja 9f\n");
+  fprintf(as, "\tcmp r14, 0x100000\n");
+  fprintf(as, "\tja 9f\n");
+  /* Keep the return addresses of the reads below the restored stack */
+  fprintf(as, "\tmov rsp, r12\n");
+  fprintf(as, "\tsub rsp, r14\n");
+  fprintf(as, "\tsub rsp, 64\n");
+  fprintf(as, "\tmov esi, OFFSET bf_data\n");
+  fprintf(as, "\tmov edx, eax\n");
+  fprintf(as, "\tcall bf_ckpt_read\n");
+  fprintf(as, "\tjc 9f\n");
+  fprintf(as, "\tmov esi, OFFSET bf_ckpt_regs\n");
+  fprintf(as, "\tmov edx, %d\n", CKPT_REGS_SIZE);
+  fprintf(as, "\tcall bf_ckpt_read\n");
+  fprintf(as, "\tjc 9f\n");
+  fprintf(as, "\tmov esi, OFFSET bf_ckpt_fp\n");
+  fprintf(as, "\tmov rdx, r13\n");
+  fprintf(as, "\tcall bf_ckpt_read\n");
+  fprintf(as, "\tjc 9f\n");
+  fprintf(as, "\tmov rsi, r12\n");
+  fprintf(as, "\tsub rsi, r14\n");
+  fprintf(as, "\tmov rdx, r14\n");
+  fprintf(as, "\tcall bf_ckpt_read\n");
+  fprintf(as, "\tjc 9f\n");
+  fprintf(as, "\tmov eax, 3\n");
+  fprintf(as, "\tmov edi, ebp\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tmov QWORD PTR bf_ckpt_top, r12\n");
+
+  /* Restore the state the processor supports of an XSAVE area, else FXRSTOR */
+  fprintf(as, "\tcmp r13, 512\n");
+  fprintf(as, "\tjbe 1f\n");
+  fprintf(as, "\txor ecx, ecx\n");
+  fprintf(as, "\txgetbv\n");
+  fprintf(as, "\tand DWORD PTR bf_ckpt_fp+512, eax\n");
+  fprintf(as, "\tand DWORD PTR bf_ckpt_fp+516, edx\n");
+  fprintf(as, "\txrstor bf_ckpt_fp\n");
+  fprintf(as, "\tjmp 2f\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\tfxrstor bf_ckpt_fp\n");
+  fprintf(as, "2:\n");
+
+  /* Return to the saved RIP with the saved flags below the restored stack */
+  fprintf(as, "\tmov rax, r12\n");
+  fprintf(as, "\tsub rax, r14\n");
+  fprintf(as, "\tsub rax, 16\n");
+  fprintf(as, "\tmov rcx, QWORD PTR bf_ckpt_regs+%d\n", 17 * 8);
+  fprintf(as, "\tmov QWORD PTR [rax], rcx\n");
+  fprintf(as, "\tmov rcx, QWORD PTR bf_ckpt_regs+%d\n", 16 * 8);
+  fprintf(as, "\tmov QWORD PTR [rax+8], rcx\n");
+  fprintf(as, "\tmov QWORD PTR bf_ckpt_sp, rax\n");
+  for (i = 0; i < sizeof(gregs) / sizeof(*gregs); i++) {
+    fprintf(as, "\tmov %s, QWORD PTR bf_ckpt_regs+%zu\n", gregs[i], 8 * i);
+  }
+  fprintf(as, "\tmov rsp, QWORD PTR bf_ckpt_sp\n");
+  fprintf(as, "\tpopfq\n");
+  fprintf(as, "\tret\n");
+
+  fprintf(as, "9:\n");
+  fprintf(as, "\tmov eax, 4\n");
+  fprintf(as, "\tmov ebx, 2\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_ckpt_error\n");
+  fprintf(as, "\tmov edx, OFFSET bf_ckpt_error_len\n");
+  fprintf(as, "\tint 0x80\n");
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\tmov ebx, 1\n");
+  fprintf(as, "\tint 0x80\n");
+
+  /* Takes a checkpoint at the call by sending SIGUSR1 to the process */
+  fprintf(as, "bf_ckpt_now:\n");
+  fprintf(as, "\tpush rdi\n");
+  fprintf(as, "\tpush rsi\n");
+  fprintf(as, "\tmov eax, 39\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tmov edi, eax\n");
+  fprintf(as, "\tmov esi, 10\n");
+  fprintf(as, "\tmov eax, 62\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tpop rsi\n");
+  fprintf(as, "\tpop rdi\n");
+  fprintf(as, "\tret\n");
+
+  /*
+   * The handler keeps the ucontext in R12, the signal in R13, the vector
+   * state in RBX and its size in R14
+   */
+  fprintf(as, "bf_ckpt_handler:\n");
+  fprintf(as, "\tmov r12, rdx\n");
+  fprintf(as, "\tmov r13d, edi\n");
+  fprintf(as, "\tmov BYTE PTR bf_ckpt_failed, 0\n");
+  fprintf(as, "\tmov rbx, QWORD PTR [r12+%d]\n", UC_FPREGS);
+  fprintf(as, "\tmov r14d, 512\n");
+  fprintf(as, "\tcmp DWORD PTR [rbx+464], 0x46505853\n");
+  fprintf(as, "\tjne 1f\n");
+  fprintf(as, "\tmov r14d, DWORD PTR [rbx+480]\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\tcmp r14d, %d\n", CKPT_FP_SIZE);
+  fprintf(as, "\tja 8f\n");
+  fprintf(as, "\tmov eax, OFFSET _end\n");
+  fprintf(as, "\tsub eax, OFFSET bf_data\n");
+  fprintf(as, "\tmov QWORD PTR bf_ckpt_header+16, rax\n");
+  fprintf(as, "\tmov QWORD PTR bf_ckpt_header+24, r14\n");
+  fprintf(as, "\tmov rax, QWORD PTR bf_ckpt_top\n");
+  fprintf(as, "\tsub rax, QWORD PTR [r12+%d]\n", UC_RSP);
+  fprintf(as, "\tmov QWORD PTR bf_ckpt_header+32, rax\n");
+
+  /* open(bf_ckpt_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644) */
+  fprintf(as, "\tmov eax, 2\n");
+  fprintf(as, "\tmov edi, OFFSET bf_ckpt_tmp\n");
+  fprintf(as, "\tmov esi, 0x241\n");
+  fprintf(as, "\tmov edx, 0644\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjs 8f\n");
+  fprintf(as, "\tmov ebp, eax\n");
+  fprintf(as, "\tmov esi, OFFSET bf_ckpt_header\n");
+  fprintf(as, "\tmov edx, %d\n", CKPT_HEADER_SIZE);
+  fprintf(as, "\tcall bf_ckpt_write\n");
+  fprintf(as, "\tmov esi, OFFSET bf_data\n");
+  fprintf(as, "\tmov edx, OFFSET _end\n");
+  fprintf(as, "\tsub edx, esi\n");
+  fprintf(as, "\tcall bf_ckpt_write\n");
+  fprintf(as, "\tlea rsi, [r12+%d]\n", UC_GREGS);
+  fprintf(as, "\tmov edx, %d\n", CKPT_REGS_SIZE);
+  fprintf(as, "\tcall bf_ckpt_write\n");
+  fprintf(as, "\tmov rsi, rbx\n");
+  fprintf(as, "\tmov edx, r14d\n");
+  fprintf(as, "\tcall bf_ckpt_write\n");
+  fprintf(as, "\tmov rsi, QWORD PTR [r12+%d]\n", UC_RSP);
+  fprintf(as, "\tmov rdx, QWORD PTR bf_ckpt_header+32\n");
+  fprintf(as, "\tcall bf_ckpt_write\n");
+
+  /* fsync, close and rename over the previous checkpoint */
+  fprintf(as, "\tmov eax, 74\n");
+  fprintf(as, "\tmov edi, ebp\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjz 2f\n");
+  fprintf(as, "\tmov BYTE PTR bf_ckpt_failed, 1\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\tmov eax, 3\n");
+  fprintf(as, "\tmov edi, ebp\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tcmp BYTE PTR bf_ckpt_failed, 0\n");
+  fprintf(as, "\tjne 8f\n");
+  fprintf(as, "\tmov eax, 82\n");
+  fprintf(as, "\tmov edi, OFFSET bf_ckpt_tmp\n");
+  fprintf(as, "\tmov esi, OFFSET bf_ckpt_file\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "8:\n");
+  fprintf(as, "\tcmp r13d, 15\n");
+  fprintf(as, "\tje 1f\n");
+  fprintf(as, "\tret\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\tmov ebx, %d\n", CHECKPOINT_EXIT);
+  fprintf(as, "\tint 0x80\n");
+
+  write_transfer(as, "bf_ckpt_read", 0);
+
+  /* Writes and records a failure */
+  fprintf(as, "bf_ckpt_write:\n");
+  fprintf(as, "\tcall bf_ckpt_write_all\n");
+  fprintf(as, "\tjnc 1f\n");
+  fprintf(as, "\tmov BYTE PTR bf_ckpt_failed, 1\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\tret\n");
+  write_transfer(as, "bf_ckpt_write_all", 1);
+
+  fprintf(as, "bf_ckpt_restorer:\n");
+  fprintf(as, "\tmov eax, 15\n");
+  fprintf(as, "\tsyscall\n");
+}
@@ -0,0 +1,1126 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Lowers the intermediate representation to IA-32 instructions. EDI
+ * points to the current cell and ESI to the next free byte of the output
+ * buffer. Cells are 32 bits wide, so the cell at offset k is the DWORD
+ * at [edi+4*k]. Scan, multiply and assignment operations use SSE2, SSE4.1,
+ * AVX2 or AVX-512 instructions when the selected features allow.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "bfc.h"
+
+#define CELL_BYTES     4    /* Size of a cell in bytes */
+#define MUL_VECTOR_MIN 3    /* Minimum number of multiply targets worth a vector */
+#define ADD_VECTOR_MIN 3    /* Minimum number of additions worth a vector */
+#define REP_STOS_MIN   128  /* Minimum number of assigned cells worth rep stosd */
+
+/* Vector registers of one width */
+typedef struct vector_t vector_t;
+struct vector_t
+{
+  unsigned int lanes;      /* Number of cells in a register */
+  const char *reg;         /* Register name without its number */
+  const char *ptr;         /* Size of a memory operand */
+};
+
+static const vector_t xmm = { 4, "xmm", "XMMWORD" };
+static const vector_t ymm = { 8, "ymm", "YMMWORD" };
+static const vector_t zmm = { 16, "zmm", "ZMMWORD" };
+
+/* State of code generation for one code variant */
+typedef struct gen_t gen_t;
+struct gen_t
+{
+  code_t *code;
+  const info_t *info;
+  unsigned int features;
+  size_t loop;             /* Used to generate loop labels */
+  size_t io;               /* Used to generate I/O labels */
+  size_t scan;             /* Used to generate scan labels */
+  size_t regions;          /* Used to generate region symbols */
+  size_t counters;         /* Used to number the loop counters of -fprofile-generate */
+};
+
+#define NO_LOOP ((size_t)-1)  /* Region outside of all loops */
+
+/* Formats the address of the cell at offset into buf */
+static const char *cell_addr(char *buf, size_t size, long offset)
+{
+  if (offset == 0) {
+    snprintf(buf, size, "[edi]");
+  } else {
+    snprintf(buf, size, "[edi%+ld]", offset * CELL_BYTES);
+  }
+  return buf;
+}
+
+static operand_t cell_operand(long offset)
+{
+  return mem_operand(EDI, offset * CELL_BYTES);
+}
+
+/* Returns the widest vector registers that the features provide */
+static const vector_t *widest_vector(unsigned int features)
+{
+  if (features & FEATURE_AVX512F) {
+    return &zmm;
+  }
+  if (features & FEATURE_AVX2) {
+    return &ymm;
+  }
+  if (features & FEATURE_SSE2) {
+    return &xmm;
+  }
+  return NULL;
+}
+
+/* Checks whether vector code must use VEX or EVEX encoded instructions */
+static int use_vex(unsigned int features)
+{
+  return (features & FEATURE_AVX2) != 0;
+}
+
+/* Clears vector register number reg */
+static void gen_zero_vector(gen_t *gen, const vector_t *vec, int reg)
+{
+  if (vec == &zmm) {
+    emit_raw(gen->code, "vpxord zmm%d, zmm%d, zmm%d", reg, reg, reg);
+  } else if (use_vex(gen->features)) {
+    emit_raw(gen->code, "vpxor xmm%d, xmm%d, xmm%d", reg, reg, reg);
+  } else {
+    emit_raw(gen->code, "pxor xmm%d, xmm%d", reg, reg);
+  }
+}
+
+/* Stores vector register number reg at addr */
+static void gen_store_vector(gen_t *gen, const vector_t *vec, const char *addr, int reg)
+{
+  if (vec == &zmm) {
+    emit_raw(gen->code, "vmovdqu32 ZMMWORD PTR %s, zmm%d", addr, reg);
+  } else if (use_vex(gen->features)) {
+    emit_raw(gen->code, "vmovdqu %s PTR %s, %s%d", vec->ptr, addr, vec->reg, reg);
+  } else {
+    emit_raw(gen->code, "movdqu XMMWORD PTR %s, xmm%d", addr, reg);
+  }
+}
+
+/*
+ * Compares the cells at addr with register 0, which must be zero, and
+ * leaves a mask of the zero cells in EAX: one bit per cell for AVX-512,
+ * four bits per cell otherwise.
+ */
+static void gen_zero_mask(gen_t *gen, const vector_t *vec, const char *addr)
+{
+  if (vec == &zmm) {
+    emit_raw(gen->code, "vpcmpeqd k1, zmm0, ZMMWORD PTR %s", addr);
+    emit_raw(gen->code, "kmovw eax, k1");
+  } else if (use_vex(gen->features)) {
+    emit_raw(gen->code, "vpcmpeqd %s1, %s0, %s PTR %s", vec->reg, vec->reg, vec->ptr, addr);
+    emit_raw(gen->code, "vpmovmskb eax, %s1", vec->reg);
+  } else {
+    emit_raw(gen->code, "movdqu xmm1, XMMWORD PTR %s", addr);
+    emit_raw(gen->code, "pcmpeqd xmm1, xmm0");
+    emit_raw(gen->code, "pmovmskb eax, xmm1");
+  }
+}
+
+/* Adds value to the cell at offset */
+static void gen_add(gen_t *gen, long offset, long value)
+{
+  if (value == 1) {
+    emit(gen->code, OP_INC, cell_operand(offset), no_operand);
+  } else if (value == -1) {
+    emit(gen->code, OP_DEC, cell_operand(offset), no_operand);
+  } else if (value < 0 && -value <= INT32_MAX) {
+    emit(gen->code, OP_SUB, cell_operand(offset), imm_operand(-value));
+  } else {
+    emit(gen->code, OP_ADD, cell_operand(offset), imm_operand(value));
+  }
+}
+
+/*
+ * Generates n additions to cells in ascending order. Three or more
+ * additions that fall into one vector of adjacent cells become a single
+ * packed addition of a constant vector, which has zeros for the cells
+ * in between.
+ */
+static void gen_add_run(gen_t *gen, const ir_t *ops, size_t n)
+{
+  const vector_t *widest = widest_vector(gen->features);
+  const vector_t *vec;
+  long values[16];
+  char addr[32];
+  const char *constant;
+  size_t i, j, k;
+  long lo;
+
+  for (i = 0; i < n; i = j) {
+    lo = ops[i].offset;
+    for (j = i + 1; widest != NULL && j < n && ops[j].offset > ops[j - 1].offset &&
+                    ops[j].offset - lo < (long)widest->lanes; j++) {
+    }
+    if (j - i < ADD_VECTOR_MIN) {
+      gen_add(gen, ops[i].offset, ops[i].value);
+      j = i + 1;
+      continue;
+    }
+
+    /* Use the narrowest vector that covers the cells */
+    vec = ops[j - 1].offset - lo < 4 ? &xmm : ops[j - 1].offset - lo < 8 ? &ymm : &zmm;
+    for (k = 0; k < vec->lanes; k++) {
+      values[k] = 0;
+    }
+    for (k = i; k < j; k++) {
+      values[ops[k].offset - lo] = ops[k].value;
+    }
+    constant = label_name(gen->code, add_constant(gen->code, values, vec->lanes));
+    cell_addr(addr, sizeof(addr), lo);
+
+    if (vec == &zmm) {
+      emit_raw(gen->code, "vmovdqu32 zmm0, ZMMWORD PTR %s", addr);
+      emit_raw(gen->code, "vpaddd zmm0, zmm0, ZMMWORD PTR %s", constant);
+    } else if (use_vex(gen->features)) {
+      emit_raw(gen->code, "vmovdqu %s0, %s PTR %s", vec->reg, vec->ptr, addr);
+      emit_raw(gen->code, "vpaddd %s0, %s0, %s PTR %s", vec->reg, vec->reg, vec->ptr, constant);
+    } else {
+      emit_raw(gen->code, "movdqu xmm0, XMMWORD PTR %s", addr);
+      emit_raw(gen->code, "paddd xmm0, XMMWORD PTR %s", constant);
+    }
+    gen_store_vector(gen, vec, addr, 0);
+  }
+}
+
+static void gen_move(gen_t *gen, long cells)
+{
+  if (cells > 0) {
+    emit(gen->code, OP_ADD, reg_operand(EDI), imm_operand(cells * CELL_BYTES));
+  } else if (cells < 0) {
+    emit(gen->code, OP_SUB, reg_operand(EDI), imm_operand(-cells * CELL_BYTES));
+  }
+}
+
+/*
+ * Sets n consecutive cells from offset lo to value. Runs are stored with
+ * the widest vectors that fit; the last store of a run overlaps the
+ * previous one instead of falling back to narrower stores.
+ */
+static void gen_set_run(gen_t *gen, long lo, size_t n, long value)
+{
+  const vector_t *vec = widest_vector(gen->features);
+  char addr[32];
+  size_t i;
+
+  /* Long runs are stored by rep stosd, which needs the pointer in EDI */
+  if (n >= REP_STOS_MIN) {
+    emit(gen->code, OP_MOV, reg_operand(EDX), reg_operand(EDI));
+    emit_raw(gen->code, "lea edi, %s", cell_addr(addr, sizeof(addr), lo));
+    emit(gen->code, OP_MOV, reg_operand(ECX), imm_operand(n));
+    emit(gen->code, OP_MOV, reg_operand(EAX), imm_operand(value));
+    emit_raw(gen->code, "rep stosd");
+    emit(gen->code, OP_MOV, reg_operand(EDI), reg_operand(EDX));
+    return;
+  }
+
+  while (vec != NULL && vec->lanes > n) {
+    vec = vec == &zmm ? &ymm : vec == &ymm ? &xmm : NULL;
+  }
+
+  if (vec == NULL) {
+    for (i = 0; i < n; i++) {
+      emit(gen->code, OP_MOV, cell_operand(lo + i), imm_operand(value));
+    }
+    return;
+  }
+
+  /* Fill register 7 with the value */
+  if (value == 0) {
+    gen_zero_vector(gen, vec, 7);
+  } else {
+    emit(gen->code, OP_MOV, reg_operand(EAX), imm_operand(value));
+    if (vec == &zmm) {
+      emit_raw(gen->code, "vpbroadcastd zmm7, eax");
+    } else if (use_vex(gen->features)) {
+      emit_raw(gen->code, "vmovd xmm7, eax");
+      emit_raw(gen->code, "vpbroadcastd %s7, xmm7", vec->reg);
+    } else {
+      emit_raw(gen->code, "movd xmm7, eax");
+      emit_raw(gen->code, "pshufd xmm7, xmm7, 0");
+    }
+  }
+
+  for (i = 0; i < n; i += vec->lanes) {
+    if (i + vec->lanes > n) {
+      i = n - vec->lanes;
+    }
+    gen_store_vector(gen, vec, cell_addr(addr, sizeof(addr), lo + i), 7);
+  }
+}
+
+/*
+ * Generates n consecutive multiplications, which all read the same
+ * source cell. Groups of targets that fit into one vector register are
+ * updated with a single packed multiply and add.
+ */
+static void gen_mul(gen_t *gen, const ir_t *ops, size_t n)
+{
+  const vector_t *vec = NULL;
+  long lo = ops[0].offset, hi = ops[0].offset;
+  long factors[16] = { 0 };
+  char addr[32];
+  const char *constant;
+  size_t i;
+
+  emit(gen->code, OP_MOV, reg_operand(EAX), cell_operand(ops[0].src));
+
+  for (i = 1; i < n; i++) {
+    lo = ops[i].offset < lo ? ops[i].offset : lo;
+    hi = ops[i].offset > hi ? ops[i].offset : hi;
+  }
+
+  if (n >= MUL_VECTOR_MIN) {
+    if (hi - lo < 4 && (gen->features & FEATURE_SSE4_1)) {
+      vec = &xmm;
+    } else if (hi - lo < 8 && (gen->features & FEATURE_AVX2)) {
+      vec = &ymm;
+    } else if (hi - lo < 16 && (gen->features & FEATURE_AVX512F)) {
+      vec = &zmm;
+    }
+  }
+
+  if (vec == NULL) {
+    for (i = 0; i < n; i++) {
+      if (ops[i].value == 1) {
+        emit(gen->code, OP_ADD, cell_operand(ops[i].offset), reg_operand(EAX));
+      } else if (ops[i].value == -1) {
+        emit(gen->code, OP_SUB, cell_operand(ops[i].offset), reg_operand(EAX));
+      } else {
+        emit_raw(gen->code, "imul ecx, eax, %ld", ops[i].value);
+        emit(gen->code, OP_ADD, cell_operand(ops[i].offset), reg_operand(ECX));
+      }
+    }
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    factors[ops[i].offset - lo] += ops[i].value;
+  }
+  constant = label_name(gen->code, add_constant(gen->code, factors, vec->lanes));
+  cell_addr(addr, sizeof(addr), lo);
+
+  if (vec == &zmm) {
+    emit_raw(gen->code, "vpbroadcastd zmm0, eax");
+    emit_raw(gen->code, "vpmulld zmm0, zmm0, ZMMWORD PTR %s", constant);
+    emit_raw(gen->code, "vpaddd zmm0, zmm0, ZMMWORD PTR %s", addr);
+    emit_raw(gen->code, "vmovdqu32 ZMMWORD PTR %s, zmm0", addr);
+  } else if (use_vex(gen->features)) {
+    emit_raw(gen->code, "vmovd xmm0, eax");
+    emit_raw(gen->code, "vpbroadcastd %s0, xmm0", vec->reg);
+    emit_raw(gen->code, "vpmulld %s0, %s0, %s PTR %s", vec->reg, vec->reg, vec->ptr, constant);
+    emit_raw(gen->code, "vpaddd %s0, %s0, %s PTR %s", vec->reg, vec->reg, vec->ptr, addr);
+    emit_raw(gen->code, "vmovdqu %s PTR %s, %s0", vec->ptr, addr, vec->reg);
+  } else {
+    emit_raw(gen->code, "movd xmm0, eax");
+    emit_raw(gen->code, "pshufd xmm0, xmm0, 0");
+    emit_raw(gen->code, "pmulld xmm0, XMMWORD PTR %s", constant);
+    emit_raw(gen->code, "movdqu xmm1, XMMWORD PTR %s", addr);
+    emit_raw(gen->code, "paddd xmm1, xmm0");
+    emit_raw(gen->code, "movdqu XMMWORD PTR %s, xmm1", addr);
+  }
+}
+
+/*
+ * Moves the pointer by step cells until it points to a zero cell. For
+ * steps of one and two cells in either direction the cells are compared
+ * a vector at a time, and the lowest (or for backward scans the highest)
+ * zero lane of the mask gives the final position.
+ */
+static void gen_scan(gen_t *gen, long step)
+{
+  const vector_t *vec = widest_vector(gen->features);
+  const operand_t cell = cell_operand(0);
+  const char *bsf = (gen->features & FEATURE_BMI) ? "tzcnt" : "bsf";
+  size_t head, done;
+  unsigned long mask;
+  long bytes, back;
+  char addr[32];
+
+  head = new_label(gen->code, 'S', ++gen->scan);
+  if (gen->info->opt_level > 0) {
+    gen->code->labels[head].align = gen->info->tune->loop_align;
+    gen->code->labels[head].skip = gen->info->tune->loop_skip;
+  }
+
+  if (vec == NULL || gen->info->opt_level == 0 || (step != 1 && step != -1 && step != 2 && step != -2)) {
+    done = new_label(gen->code, 'X', gen->scan);
+    emit(gen->code, OP_CMP, cell, imm_operand(0));
+    emit(gen->code, OP_JZ, label_operand(done), no_operand);
+    emit(gen->code, OP_LABEL, label_operand(head), no_operand);
+    gen_move(gen, step);
+    emit(gen->code, OP_CMP, cell, imm_operand(0));
+    emit(gen->code, OP_JNZ, label_operand(head), no_operand);
+    emit(gen->code, OP_LABEL, label_operand(done), no_operand);
+    return;
+  }
+
+  bytes = vec->lanes * CELL_BYTES;
+  back = step < 0 ? bytes - CELL_BYTES : 0;
+
+  /* Mask of the lanes that the scan visits, one bit per lane or per byte */
+  if (vec == &zmm) {
+    mask = step == 2 ? 0x5555 : step == -2 ? 0xAAAA : 0;
+  } else {
+    mask = step == 2 ? 0x0F0F0F0F : step == -2 ? 0xF0F0F0F0 : 0;
+    mask &= vec == &xmm ? 0xFFFF : 0xFFFFFFFF;
+  }
+  gen_zero_vector(gen, vec, 0);
+
+  /* Step back by one vector so that the loop can step first */
+  emit(gen->code, step > 0 ? OP_SUB : OP_ADD, reg_operand(EDI), imm_operand(bytes));
+  emit(gen->code, OP_LABEL, label_operand(head), no_operand);
+  emit(gen->code, step > 0 ? OP_ADD : OP_SUB, reg_operand(EDI), imm_operand(bytes));
+  gen_zero_mask(gen, vec, cell_addr(addr, sizeof(addr), -back / CELL_BYTES));
+  if (mask != 0) {
+    emit_raw(gen->code, "and eax, %lu", mask);
+  } else {
+    emit_raw(gen->code, "test eax, eax");
+  }
+  emit(gen->code, OP_JZ, label_operand(head), no_operand);
+
+  /* Advance to the zero lane */
+  if (step > 0 && vec == &zmm) {
+    emit_raw(gen->code, "%s eax, eax", bsf);
+    emit_raw(gen->code, "lea edi, [edi+eax*4]");
+  } else if (step > 0) {
+    emit_raw(gen->code, "%s eax, eax", bsf);
+    emit_raw(gen->code, "add edi, eax");
+  } else if (vec == &zmm) {
+    emit_raw(gen->code, "bsr eax, eax");
+    emit_raw(gen->code, "lea edi, [edi+eax*4-%ld]", back);
+  } else {
+    emit_raw(gen->code, "bsr eax, eax");
+    emit_raw(gen->code, "lea edi, [edi+eax-%ld]", bytes - 1);
+  }
+}
+
+/*
+ * Clears cells while moving the pointer by step cells until it points to
+ * a zero cell. Forward and backward clears of adjacent cells test a
+ * vector at a time and clear it whole if it holds no zero cell; the
+ * cells before the zero cell of the last vector are cleared by rep stosd.
+ */
+static void gen_clear(gen_t *gen, long step)
+{
+  const vector_t *vec = widest_vector(gen->features);
+  const operand_t cell = cell_operand(0);
+  const char *bsf = (gen->features & FEATURE_BMI) ? "tzcnt" : "bsf";
+  size_t head, test, done;
+  long bytes, back;
+  char addr[32];
+
+  head = new_label(gen->code, 'S', ++gen->scan);
+  if (gen->info->opt_level > 0) {
+    gen->code->labels[head].align = gen->info->tune->loop_align;
+    gen->code->labels[head].skip = gen->info->tune->loop_skip;
+  }
+
+  if (vec == NULL || gen->info->opt_level == 0 || (step != 1 && step != -1)) {
+    done = new_label(gen->code, 'X', gen->scan);
+    emit(gen->code, OP_CMP, cell, imm_operand(0));
+    emit(gen->code, OP_JZ, label_operand(done), no_operand);
+    emit(gen->code, OP_LABEL, label_operand(head), no_operand);
+    emit(gen->code, OP_MOV, cell, imm_operand(0));
+    gen_move(gen, step);
+    emit(gen->code, OP_CMP, cell, imm_operand(0));
+    emit(gen->code, OP_JNZ, label_operand(head), no_operand);
+    emit(gen->code, OP_LABEL, label_operand(done), no_operand);
+    return;
+  }
+
+  bytes = vec->lanes * CELL_BYTES;
+  back = step < 0 ? bytes - CELL_BYTES : 0;
+  cell_addr(addr, sizeof(addr), -back / CELL_BYTES);
+  test = new_label(gen->code, 'T', gen->scan);
+
+  gen_zero_vector(gen, vec, 0);
+  emit(gen->code, OP_JMP, label_operand(test), no_operand);
+  emit(gen->code, OP_LABEL, label_operand(head), no_operand);
+  gen_store_vector(gen, vec, addr, 0);
+  gen_move(gen, step * vec->lanes);
+  emit(gen->code, OP_LABEL, label_operand(test), no_operand);
+  gen_zero_mask(gen, vec, addr);
+  emit_raw(gen->code, "test eax, eax");
+  emit(gen->code, OP_JZ, label_operand(head), no_operand);
+
+  if (step > 0) {
+    /* Clear the cells below the lowest zero lane, which leaves EDI on it */
+    emit_raw(gen->code, "%s ecx, eax", bsf);
+    if (vec != &zmm) {
+      emit_raw(gen->code, "shr ecx, 2");
+    }
+    emit_raw(gen->code, "xor eax, eax");
+    emit_raw(gen->code, "rep stosd");
+    return;
+  }
+
+  /* Clear the cells above the highest zero lane up to the pointer */
+  emit(gen->code, OP_MOV, reg_operand(ECX), reg_operand(EDI));
+  emit_raw(gen->code, "bsr eax, eax");
+  if (vec == &zmm) {
+    emit_raw(gen->code, "lea edi, [edi+eax*4-%ld]", back);
+  } else {
+    emit_raw(gen->code, "lea edi, [edi+eax-%ld]", bytes - 1);
+  }
+  emit(gen->code, OP_MOV, reg_operand(EDX), reg_operand(EDI));
+  emit(gen->code, OP_SUB, reg_operand(ECX), reg_operand(EDI));
+  emit_raw(gen->code, "shr ecx, 2");
+  emit(gen->code, OP_ADD, reg_operand(EDI), imm_operand(CELL_BYTES));
+  emit_raw(gen->code, "xor eax, eax");
+  emit_raw(gen->code, "rep stosd");
+  emit(gen->code, OP_MOV, reg_operand(EDI), reg_operand(EDX));
+}
+
+/*
+ * Appends the low byte of the cell at offset to the output buffer at
+ * ESI; the buffer is flushed out of line when it is full.
+ */
+static void gen_out(gen_t *gen, long offset)
+{
+  code_t *code = gen->code;
+  size_t flush, done;
+  int cold;
+
+  flush = new_label(code, 'F', ++gen->io);
+  done = new_label(code, 'D', gen->io);
+  emit(code, OP_MOV, reg_operand(EAX), cell_operand(offset));
+  emit_raw(code, "mov BYTE PTR [esi], al");
+  emit(code, OP_INC, reg_operand(ESI), no_operand);
+  emit_raw(code, "cmp esi, OFFSET bf_out_buf+%d", OUT_BUF_SIZE);
+  emit(code, OP_JZ, label_operand(flush), no_operand);
+  emit(code, OP_LABEL, label_operand(done), no_operand);
+
+  cold = code->cold;
+  code->cold = 1;
+  emit(code, OP_LABEL, label_operand(flush), no_operand);
+  emit_raw(code, "call bf_flush");
+  emit(code, OP_JMP, label_operand(done), no_operand);
+  code->cold = cold;
+}
+
+/*
+ * Copies the next byte of the input buffer into the low byte of the
+ * cell at offset. Refilling the buffer and EOF, which leaves the cell
+ * unchanged, are handled out of line.
+ */
+static void gen_in(gen_t *gen, long offset)
+{
+  code_t *code = gen->code;
+  size_t refill, load, done;
+  char addr[32];
+  int cold;
+
+  refill = new_label(code, 'I', ++gen->io);
+  load = new_label(code, 'G', gen->io);
+  done = new_label(code, 'D', gen->io);
+  emit_raw(code, "mov eax, DWORD PTR bf_in_pos");
+  emit_raw(code, "cmp eax, DWORD PTR bf_in_end");
+  emit(code, OP_JZ, label_operand(refill), no_operand);
+  emit(code, OP_LABEL, label_operand(load), no_operand);
+  emit_raw(code, "mov cl, BYTE PTR [eax]");
+  emit(code, OP_INC, reg_operand(EAX), no_operand);
+  emit_raw(code, "mov DWORD PTR bf_in_pos, eax");
+  emit_raw(code, "mov BYTE PTR %s, cl", cell_addr(addr, sizeof(addr), offset));
+  emit(code, OP_LABEL, label_operand(done), no_operand);
+
+  cold = code->cold;
+  code->cold = 1;
+  emit(code, OP_LABEL, label_operand(refill), no_operand);
+  emit_raw(code, "call bf_refill");
+  emit(code, OP_JNZ, label_operand(load), no_operand);
+  emit(code, OP_JMP, label_operand(done), no_operand);
+  code->cold = cold;
+}
+
+/*
+ * Emits a symbol for the code region that starts here, which belongs to
+ * the loop at prog->ops[loop] or to no loop. Loop regions are named by
+ * the source range of the loop, such as bf_loop_3_5_3_40 for a loop from
+ * line 3, column 5 to column 40. The code after a loop resumes the
+ * region of the enclosing loop under that name with a numbered suffix.
+ * Profilers attribute the addresses up to the next symbol to the region.
+ */
+static void gen_region(gen_t *gen, const program_t *prog, size_t loop, int resume)
+{
+  const ir_t *begin, *end;
+  char name[128];
+
+  if (!gen->info->debug && !gen->info->run && !gen->info->sample) {
+    return;
+  }
+
+  if (loop == NO_LOOP) {
+    snprintf(name, sizeof(name), "bf_%smain", gen->code->prefix);
+  } else {
+    begin = &prog->ops[loop];
+    if (begin->op == IR_COUNT) {
+      for (end = begin; end->op != IR_NEXT; end++) {
+      }
+    } else {
+      end = &prog->ops[begin->match];
+    }
+    snprintf(name, sizeof(name), "bf_%sloop_%u_%u_%u_%u", gen->code->prefix,
+             begin->line, begin->column, end->line, end->column);
+  }
+
+  if (resume) {
+    emit_symbol(gen->code, "%s.%zu", name, ++gen->regions);
+  } else {
+    emit_symbol(gen->code, "%s", name);
+  }
+  gen->code->insns[gen->code->len - 1].dst =
+    imm_operand(loop == NO_LOOP ? REGION_MAIN : (long)loop);
+}
+
+/*
+ * Returns the number of operations from ops[0] on that assign the same
+ * value to consecutive cells in ascending or descending order.
+ */
+static size_t set_run_length(const ir_t *ops, size_t len)
+{
+  long dir;
+  size_t n = 1;
+
+  if (len < 2 || ops[1].op != IR_SET || ops[1].value != ops[0].value) {
+    return 1;
+  }
+
+  dir = ops[1].offset - ops[0].offset;
+  if (dir != 1 && dir != -1) {
+    return 1;
+  }
+
+  while (n < len && ops[n].op == IR_SET && ops[n].value == ops[0].value &&
+         ops[n].offset == ops[n - 1].offset + dir) {
+    n++;
+  }
+
+  return n;
+}
+
+/*
+ * Counts the steps of the basic block that starts at prog->ops[i] off
+ * the budget in R15 and leaves the program if the budget is exhausted.
+ * A step is an operation of the optimised program; the block runs up to
+ * and including the test of the next loop operation.
+ */
+static void gen_steps(gen_t *gen, const program_t *prog, size_t i)
+{
+  size_t n;
+
+  if (!gen->info->count_steps) {
+    return;
+  }
+
+  for (n = 0; i + n < prog->len; n++) {
+    switch (prog->ops[i + n].op) {
+    case IR_LOOP:
+    case IR_END:
+    case IR_BREAK:
+    case IR_COUNT:
+    case IR_REPEAT:
+    case IR_NEXT:
+      n++;
+      break;
+    default:
+      continue;
+    }
+    break;
+  }
+
+  if (n > 0) {
+    emit_raw(gen->code, "sub r15, %zu", n);
+    if (gen->info->checkpoint_steps != 0) {
+      /* bf_step_limit returns after checkpoints */
+      emit_raw(gen->code, "jns 1f");
+      emit_raw(gen->code, "call bf_step_limit");
+      emit_raw(gen->code, "1:");
+    } else {
+      emit_raw(gen->code, "js bf_step_limit");
+    }
+  }
+}
+
+/*
+ * Calls the routine of the cache of loops with the window of cells of
+ * the loop at prog->ops[loop]
+ */
+static void gen_memo_call(gen_t *gen, long lo, size_t cells, size_t loop, const char *routine)
+{
+  emit_raw(gen->code, "lea eax, [edi%+ld]", 4 * lo);
+  emit(gen->code, OP_MOV, reg_operand(ECX), imm_operand((long)cells));
+  emit(gen->code, OP_MOV, reg_operand(EDX), imm_operand((long)loop + 1));
+  emit_raw(gen->code, "call %s", routine);
+}
+
+/*
+ * Checks whether the n operations of a copy loop body add *add to cell
+ * 0, write it, undo the addition or clear the cell, which sets *clear,
+ * and read the next byte into it
+ */
+static int is_copy_body(const ir_t *body, size_t n, long *add, int *clear)
+{
+  size_t i = 0;
+
+  *add = 0;
+  *clear = 0;
+  if (i < n && body[i].op == IR_ADD && body[i].offset == 0) {
+    *add = body[i++].value;
+  }
+  if (i == n || body[i].op != IR_OUT || body[i].offset != 0) {
+    return 0;
+  }
+  i++;
+  if (i < n && body[i].op == IR_ADD && body[i].offset == 0 &&
+      (uint32_t)(body[i].value + *add) == 0) {
+    i++;
+  } else if (i < n && body[i].op == IR_SET && body[i].offset == 0 && body[i].value == 0) {
+    *clear = 1;
+    i++;
+  } else if (*add != 0) {
+    return 0;
+  }
+  return i + 1 == n && body[i].op == IR_IN && body[i].offset == 0;
+}
+
+/*
+ * Checks whether the loop at prog->ops[loop] copies its input to the
+ * output, such as ",[.,]", ",[.[-],]" or ",[+.-,]", for bf_copy. The
+ * copies of the body of unrolled loops must be the same.
+ */
+static int is_copy_loop(const program_t *prog, size_t loop, long *add, int *clear)
+{
+  const ir_t *body = &prog->ops[loop + 1];
+  size_t n = prog->ops[loop].match - loop - 1;
+  size_t len, i;
+
+  for (len = 0; len < n && body[len].op != IR_BREAK; len++) {
+  }
+  if ((n + 1) % (len + 1) != 0 || !is_copy_body(body, len, add, clear)) {
+    return 0;
+  }
+  for (i = len; i < n; i++) {
+    if (i % (len + 1) == len) {
+      if (body[i].op != IR_BREAK || body[i].offset != 0) {
+        return 0;
+      }
+    } else if (body[i].op != body[i % (len + 1)].op ||
+               body[i].offset != body[i % (len + 1)].offset ||
+               body[i].value != body[i % (len + 1)].value) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Divides with the div instruction in place of the division loop, whose
+ * end label is end, if the loop handles the divisor and the cells that
+ * the loop needs to be zero are; the loop runs otherwise
+ */
+static void gen_divmod(gen_t *gen, const divmod_t *div, size_t end)
+{
+  code_t *code = gen->code;
+  size_t loop;
+  size_t i;
+
+  loop = new_label(code, 'V', ++gen->io);
+  for (i = 0; i < div->nzero; i++) {
+    emit(code, OP_CMP, cell_operand(div->zero[i]), imm_operand(0));
+    emit(code, OP_JNZ, label_operand(loop), no_operand);
+  }
+  emit(code, OP_MOV, reg_operand(ECX), cell_operand(div->divisor));
+  for (i = 0; i < (size_t)div->min_divisor; i++) {
+    emit(code, OP_CMP, reg_operand(ECX), imm_operand(i));
+    emit(code, OP_JZ, label_operand(loop), no_operand);
+  }
+  emit(code, OP_MOV, reg_operand(EAX), cell_operand(0));
+  emit_raw(code, "xor edx, edx");
+  emit_raw(code, "div ecx");
+  emit(code, OP_ADD, cell_operand(div->quotient), reg_operand(EAX));
+  emit(code, OP_MOV, cell_operand(div->remainder), reg_operand(EDX));
+  emit(code, OP_SUB, reg_operand(ECX), reg_operand(EDX));
+  emit(code, OP_MOV, cell_operand(div->divisor), reg_operand(ECX));
+  emit(code, OP_MOV, cell_operand(0), imm_operand(0));
+  emit(code, OP_JMP, label_operand(end), no_operand);
+  emit(code, OP_LABEL, label_operand(loop), no_operand);
+}
+
+/*
+ * Checks whether the profile says that the body of the loop never ran,
+ * so that the loop can be placed out of line. Instrumented code keeps
+ * the loops in place.
+ */
+static int is_cold_loop(const gen_t *gen, const ir_t *ir)
+{
+  const loop_count_t *count;
+
+  if (gen->info->profile_generate != NULL) {
+    return 0;
+  }
+
+  count = find_loop_count(gen->info->profile, ir->line, ir->column);
+  return count != NULL && count->entries == 0;
+}
+
+/*
+ * Checks whether the head of the loop should be aligned: with a profile
+ * that knows the loop if it is hot, otherwise if it is innermost
+ */
+static int is_aligned_loop(const gen_t *gen, const ir_t *ir, int innermost)
+{
+  const loop_count_t *count;
+
+  /* Loops that run at most once have no back edge */
+  if (gen->info->opt_level == 0 || ir->value != 0) {
+    return 0;
+  }
+
+  count = find_loop_count(gen->info->profile, ir->line, ir->column);
+  if (count != NULL) {
+    return is_hot_loop(gen->info->profile, count);
+  }
+  return innermost;
+}
+
+/*
+ * Generates the code of the program for a processor with the given
+ * features into the instruction stream.
+ */
+void generate(code_t *code, const program_t *prog, const info_t *info, unsigned int features)
+{
+  const operand_t cell = cell_operand(0);
+  const ir_t *ir;
+  gen_t gen;
+  phase_t phases[PHASE_MAX];
+  size_t *stack;
+  size_t *loops;
+  int *outer_cold;
+  size_t top = 0;
+  size_t nphases = 1, phase = 1, phase_label = 0;
+  size_t begin, end, i, n;
+  char addr[32];
+  divmod_t div;
+  size_t memo_loop = NO_LOOP, memo_cells = 0;
+  long memo_lo = 0;
+  long add;
+  int clear;
+  int innermost = 0;
+  int cold;
+
+  gen.code = code;
+  gen.info = info;
+  gen.features = features;
+  gen.loop = gen.io = gen.scan = gen.regions = gen.counters = 0;
+
+  stack = malloc((prog->len + 1) * sizeof(*stack));
+  loops = malloc((prog->len + 1) * sizeof(*loops));
+  outer_cold = malloc((prog->len + 1) * sizeof(*outer_cold));
+  if (stack == NULL || loops == NULL || outer_cold == NULL) {
+    error("Out of memory while creating loop stack");
+  }
+
+  /* Cold code is placed behind everything else, so it is a region of its own */
+  if (info->debug || info->run || info->sample) {
+    code->cold = 1;
+    emit_symbol(code, "bf_%scold", code->prefix);
+    code->insns[code->len - 1].dst = imm_operand(REGION_RUNTIME);
+    code->cold = 0;
+  }
+  gen_region(&gen, prog, NO_LOOP, 0);
+  gen_steps(&gen, prog, 0);
+
+  /*
+   * bf_par_fork starts a process for each phase and returns its number
+   * in it; the first phase starts with the program, the others with the
+   * pointer on the first cell
+   */
+  if (info->parallel) {
+    nphases = split_phases(prog, phases);
+  }
+  if (nphases > 1) {
+    emit(code, OP_MOV, reg_operand(ECX), imm_operand(nphases));
+    emit_raw(code, "call bf_par_fork");
+    phase_label = new_label(code, 'P', 1);
+    for (i = 2; i < nphases; i++) {
+      new_label(code, 'P', i);
+    }
+    for (i = 1; i < nphases; i++) {
+      emit(code, OP_CMP, reg_operand(EAX), imm_operand(i));
+      emit(code, OP_JZ, label_operand(phase_label + i - 1), no_operand);
+    }
+  }
+
+  for (i = 0; i < prog->len; i += n) {
+    ir = &prog->ops[i];
+    n = 1;
+
+    /* Each phase ends its process */
+    if (phase < nphases && i == phases[phase].begin) {
+      emit_raw(code, "jmp bf_par_exit");
+      emit(code, OP_LABEL, label_operand(phase_label + phase - 1), no_operand);
+      gen_move(&gen, phases[phase++].pos);
+    }
+
+    if (info->debug) {
+      code->line = ir->line;
+      code->column = ir->column;
+    }
+
+    switch (ir->op) {
+    case IR_ADD:
+      while (i + n < prog->len && ir[n].op == IR_ADD) {
+        n++;
+      }
+      gen_add_run(&gen, ir, n);
+      break;
+    case IR_MOVE:
+      gen_move(&gen, ir->value);
+      break;
+    case IR_SET:
+      n = set_run_length(ir, prog->len - i);
+      gen_set_run(&gen, ir[0].offset < ir[n - 1].offset ? ir[0].offset : ir[n - 1].offset,
+                  n, ir->value);
+      break;
+    case IR_MUL:
+      while (i + n < prog->len && ir[n].op == IR_MUL && ir[n].src == ir->src) {
+        n++;
+      }
+      gen_mul(&gen, ir, n);
+      break;
+    case IR_SCAN:
+      gen_scan(&gen, ir->value);
+      break;
+    case IR_CLEAR:
+      gen_clear(&gen, ir->value);
+      break;
+    case IR_OUT:
+      gen_out(&gen, ir->offset);
+      break;
+    case IR_IN:
+      gen_in(&gen, ir->offset);
+      break;
+    case IR_LOOP:
+      /* Copy loops run in bulk until a byte ends them or the input does */
+      if (use_copy_loops(info) && is_copy_loop(prog, i, &add, &clear)) {
+        emit(code, OP_MOV, reg_operand(EBX), imm_operand(add & 0xff));
+        emit(code, OP_MOV, reg_operand(EDX), imm_operand(clear));
+        emit_raw(code, "call bf_copy");
+      }
+
+      /*
+       * Push new loop on stack; its end label directly follows its begin
+       * label and the label behind the results of cached loops follows
+       * that. Top-level loops run at most once, so they are not cached.
+       */
+      begin = new_label(code, 'B', ++gen.loop);
+      end = new_label(code, 'E', gen.loop);
+      loops[top] = i;
+      stack[top++] = begin;
+      innermost = 1;
+      if (memo_loop == NO_LOOP && top > 1 &&
+          (memo_cells = find_memo_window(prog, i, info, &memo_lo)) != 0) {
+        memo_loop = i;
+        new_label(code, 'M', gen.loop);
+      }
+
+      /* Division loops divide at once when their cells allow it */
+      if (memo_loop != i && info->opt_level > 0 && !info->count_steps &&
+          info->profile_generate == NULL && find_divmod(prog, i, &div)) {
+        gen_divmod(&gen, &div, end);
+      }
+
+      emit(code, OP_CMP, cell, imm_operand(0));
+      outer_cold[top - 1] = code->cold;
+      if (memo_loop == i) {
+        /* Cached loops take the result of an earlier run on the same cells */
+        emit(code, OP_JZ, label_operand(end + 1), no_operand);
+        gen_memo_call(&gen, memo_lo, memo_cells, i, "bf_memo_find");
+        emit(code, OP_JZ, label_operand(end + 1), no_operand);
+      } else if (!code->cold && is_cold_loop(&gen, ir)) {
+        /* Loops that did not run in the profiled runs are placed out of line */
+        emit(code, OP_JNZ, label_operand(begin), no_operand);
+        code->cold = 1;
+      } else {
+        emit(code, OP_JZ, label_operand(end), no_operand);
+      }
+
+      /* Count the entries and the iterations of the loop */
+      if (info->profile_generate != NULL) {
+        emit_raw(code, "inc QWORD PTR bf_pgo_counts+%zu", 16 * gen.counters);
+      }
+      gen_region(&gen, prog, i, 0);
+      emit(code, OP_LABEL, label_operand(begin), no_operand);
+      if (info->profile_generate != NULL) {
+        emit_raw(code, "inc QWORD PTR bf_pgo_counts+%zu", 16 * gen.counters++ + 8);
+      }
+      gen_steps(&gen, prog, i + 1);
+      break;
+    case IR_END:
+      /* Find matching label by popping the stack */
+      begin = stack[--top];
+      end = begin + 1;
+
+      /* Align the heads of the hot loops */
+      cold = code->cold != outer_cold[top];
+      if (!cold && is_aligned_loop(&gen, &prog->ops[loops[top]], innermost)) {
+        code->labels[begin].align = info->tune->loop_align;
+        code->labels[begin].skip = info->tune->loop_skip;
+      }
+      innermost = 0;
+
+      /* Loops that run at most once fall through to their end */
+      if (prog->ops[loops[top]].value == 0) {
+        emit(code, OP_CMP, cell, imm_operand(0));
+        emit(code, OP_JNZ, label_operand(begin), no_operand);
+      }
+      if (cold) {
+        emit(code, OP_JMP, label_operand(end), no_operand);
+        code->cold = outer_cold[top];
+      }
+      gen_region(&gen, prog, top > 0 ? loops[top - 1] : NO_LOOP, 1);
+      emit(code, OP_LABEL, label_operand(end), no_operand);
+      if (memo_loop == loops[top]) {
+        gen_memo_call(&gen, memo_lo, memo_cells, memo_loop, "bf_memo_save");
+        emit(code, OP_LABEL, label_operand(end + 1), no_operand);
+        memo_loop = NO_LOOP;
+      }
+      gen_steps(&gen, prog, i + 1);
+      break;
+    case IR_BREAK:
+      /* Leave the loop with the pointer where the next copy would test it */
+      end = stack[top - 1] + 1;
+      if (ir->offset == 0) {
+        emit(code, OP_CMP, cell, imm_operand(0));
+        emit(code, OP_JZ, label_operand(end), no_operand);
+        gen_steps(&gen, prog, i + 1);
+        break;
+      }
+      begin = new_label(code, 'K', ++gen.io);
+      emit(code, OP_CMP, cell_operand(ir->offset), imm_operand(0));
+      emit(code, OP_JZ, label_operand(begin), no_operand);
+      cold = code->cold;
+      code->cold = 1;
+      emit(code, OP_LABEL, label_operand(begin), no_operand);
+      gen_move(&gen, ir->offset);
+      emit(code, OP_JMP, label_operand(end), no_operand);
+      code->cold = cold;
+      gen_steps(&gen, prog, i + 1);
+      break;
+    case IR_COUNT:
+      /*
+       * Keep the number of iterations in EBP, which the run-time routines
+       * preserve; its labels are the head and the test of the single
+       * copies and the head and the end of the unrolled copies
+       */
+      begin = new_label(code, 'R', ++gen.loop);
+      new_label(code, 'Q', gen.loop);
+      new_label(code, 'B', gen.loop);
+      new_label(code, 'E', gen.loop);
+      loops[top] = i;
+      stack[top++] = begin;
+
+      if (ir->value == 1) {
+        emit_raw(code, "mov ebp, DWORD PTR [edi]");
+      } else {
+        emit_raw(code, "imul ebp, DWORD PTR [edi], %ld", ir->value);
+      }
+      emit(code, OP_JMP, label_operand(begin + 1), no_operand);
+      gen_region(&gen, prog, i, 0);
+      emit(code, OP_LABEL, label_operand(begin), no_operand);
+      gen_steps(&gen, prog, i + 1);
+      break;
+    case IR_REPEAT:
+      begin = stack[top - 1];
+      emit(code, OP_DEC, reg_operand(EBP), no_operand);
+      emit(code, OP_LABEL, label_operand(begin + 1), no_operand);
+      emit_raw(code, "test ebp, %ld", ir->value - 1);
+      emit(code, OP_JNZ, label_operand(begin), no_operand);
+      emit_raw(code, "test ebp, ebp");
+      emit(code, OP_JZ, label_operand(begin + 3), no_operand);
+      if (info->opt_level > 0) {
+        code->labels[begin + 2].align = info->tune->loop_align;
+        code->labels[begin + 2].skip = info->tune->loop_skip;
+      }
+      emit(code, OP_LABEL, label_operand(begin + 2), no_operand);
+      gen_steps(&gen, prog, i + 1);
+      break;
+    case IR_NEXT:
+      begin = stack[--top];
+      innermost = 0;
+      emit(code, OP_SUB, reg_operand(EBP), imm_operand(ir->value));
+      emit(code, OP_JNZ, label_operand(begin + 2), no_operand);
+      gen_region(&gen, prog, top > 0 ? loops[top - 1] : NO_LOOP, 1);
+      emit(code, OP_LABEL, label_operand(begin + 3), no_operand);
+      gen_steps(&gen, prog, i + 1);
+      break;
+    case IR_TRAP:
+      /* The loop that follows never terminates for cells with bits of the mask set */
+      emit_raw(code, "test DWORD PTR %s, %lu", cell_addr(addr, sizeof(addr), ir->offset),
+               (unsigned long)ir->value & 0xffffffffUL);
+      emit_raw(code, "jnz bf_endless");
+      break;
+    }
+  }
+
+  /* The exit sequence belongs to no source position */
+  code->line = 0;
+  code->column = 0;
+
+  /* Write what is left in the output buffer and the tape, then the profile */
+  emit_raw(code, "call bf_flush");
+  if (info->tape_dump != NULL) {
+    emit_raw(code, "call bf_tape_dump");
+  }
+  if (info->count_steps) {
+    emit_raw(code, "call bf_step_total");
+  }
+  if (info->sample) {
+    emit_raw(code, "call bf_prof_report");
+  }
+  if (info->profile_generate != NULL) {
+    emit_raw(code, "call bf_pgo_write");
+  }
+
+  /* Specify sys_exit function code (from OS vector table) */
+  emit(code, OP_MOV, reg_operand(EAX), imm_operand(1));
+
+  /* Specify successful return code for OS */
+  emit(code, OP_MOV, reg_operand(EBX), imm_operand(0));
+
+  /* Tell kernel to perform system call */
+  emit(code, OP_INT, imm_operand(0x80), no_operand);
+
+  free(outer_cold);
+  free(loops);
+  free(stack);
+}
@@ -0,0 +1,625 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Recognition of division loops. The usual BF divmod algorithm, such as
+ *
+ *   [->-[>+>>]>[+[-<+>]>+>>]<<<<<]
+ *
+ * on n d 0 0 0 0, counts the dividend n down to zero, moving one unit
+ * from the divisor d to the remainder per step and the remainder back
+ * to the divisor when the divisor runs out, which adds one to the
+ * quotient. It ends with 0 d-n%d n%d n/d after n steps.
+ *
+ * Loops are not matched by their text. A trial run on 23 / 7 finds the
+ * cells that the loop would use as divisor, remainder and quotient.
+ * The body is then run on symbols: a dividend N, a divisor cell D, a
+ * remainder R and a quotient Q, with every other cell zero. Where it
+ * tests a cell whose value depends on a symbol, the run splits into the
+ * case where the symbol has the value that makes the cell zero and the
+ * case where it does not. Every case that the invariant of the algorithm
+ * allows, D >= 1 and D + R = d for a divisor d from the smallest one on
+ * that the loop handles, must perform one step of it:
+ *
+ *   N D R Q  ->  N-1 D-1 R+1 Q     if D != 1
+ *   N D R Q  ->  N-1 R+1 0   Q+1   if D = 1
+ *
+ * leaving the other cells zero and the pointer where it was. By
+ * induction over the steps, the loop then divides any dividend by any
+ * such divisor. The generated code checks that the other cells are zero
+ * and the divisor is large enough before it divides; it runs the loop
+ * otherwise.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bfc.h"
+
+#define DIV_WINDOW DIVMOD_CELLS  /* Cells of the tape the loop is run on */
+#define DIV_BASE    8     /* Position of the dividend on that tape */
+#define DIV_OPS    64     /* Maximum number of operations of a division loop */
+#define DIV_STEPS  100000 /* Maximum number of operations of a trial or a proof */
+#define DIV_MIN_MAX 4     /* Largest smallest divisor of loops that are accepted */
+#define DIV_EXCLUDED 16   /* Maximum number of values a symbol is known not to have */
+
+/* Symbols of the values of the cells of a division */
+enum { SYM_N, SYM_D, SYM_R, SYM_Q, DIV_SYMBOLS };
+
+/* Tape of a trial run of a loop */
+typedef struct trial_t trial_t;
+struct trial_t
+{
+  uint32_t cells[DIV_WINDOW];
+  long steps;
+};
+
+/* Value of a cell as a linear function of the symbols modulo 2^32 */
+typedef struct symbolic_t symbolic_t;
+struct symbolic_t
+{
+  long constant;
+  long coeffs[DIV_SYMBOLS];
+};
+
+/* State of one case of the symbolic run of the body */
+typedef struct path_t path_t;
+struct path_t
+{
+  symbolic_t cells[DIV_WINDOW];
+  long pos;
+  size_t pc;                   /* Index of the next operation */
+  int fixed[DIV_SYMBOLS];      /* The symbol has the value in value */
+  uint32_t value[DIV_SYMBOLS];
+  uint32_t excluded[DIV_SYMBOLS][DIV_EXCLUDED];  /* Values the symbol does not have */
+  size_t nexcluded[DIV_SYMBOLS];
+};
+
+/* Symbolic run of the body of a loop over all its cases */
+typedef struct proof_t proof_t;
+struct proof_t
+{
+  const program_t *prog;
+  size_t loop;
+  const divmod_t *div;
+  long steps;
+  char touched[DIV_WINDOW];
+};
+
+/*
+ * Runs the operations from begin up to end with the pointer at *pos.
+ * Returns 1 if they finish without leaving the tape, reading input or
+ * writing output, 2 if an IR_BREAK leaves the loop and 0 otherwise.
+ */
+static int run(const program_t *prog, size_t begin, size_t end, trial_t *trial, long *pos)
+{
+  const ir_t *ir;
+  long cell;
+  size_t i;
+  int result;
+
+  for (i = begin; i < end; i++) {
+    ir = &prog->ops[i];
+    if (++trial->steps > DIV_STEPS) {
+      return 0;
+    }
+
+    cell = *pos + ir->offset;
+    if (ir->op != IR_MOVE && ir->op != IR_SCAN && ir->op != IR_CLEAR &&
+        (cell < 0 || cell >= DIV_WINDOW)) {
+      return 0;
+    }
+
+    switch (ir->op) {
+    case IR_ADD:
+      trial->cells[cell] += (uint32_t)ir->value;
+      break;
+    case IR_SET:
+      trial->cells[cell] = (uint32_t)ir->value;
+      break;
+    case IR_MUL:
+      if (*pos + ir->src < 0 || *pos + ir->src >= DIV_WINDOW) {
+        return 0;
+      }
+      trial->cells[cell] += (uint32_t)ir->value * trial->cells[*pos + ir->src];
+      break;
+    case IR_MOVE:
+      *pos += ir->value;
+      break;
+    case IR_SCAN:
+    case IR_CLEAR:
+      for (;;) {
+        if (*pos < 0 || *pos >= DIV_WINDOW || ++trial->steps > DIV_STEPS) {
+          return 0;
+        }
+        if (trial->cells[*pos] == 0) {
+          break;
+        }
+        if (ir->op == IR_CLEAR) {
+          trial->cells[*pos] = 0;
+        }
+        *pos += ir->value;
+      }
+      break;
+    case IR_LOOP:
+      while (trial->cells[*pos] != 0) {
+        /* Empty bodies would otherwise spin without taking steps */
+        if (++trial->steps > DIV_STEPS) {
+          return 0;
+        }
+        result = run(prog, i + 1, ir->match, trial, pos);
+        if (result == 0 || *pos < 0 || *pos >= DIV_WINDOW) {
+          return 0;
+        }
+        if (result == 2) {
+          break;
+        }
+      }
+      i = ir->match;
+      break;
+    case IR_BREAK:
+      if (trial->cells[cell] == 0) {
+        *pos = cell;
+        return 2;
+      }
+      break;
+    case IR_END:
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Runs the loop on n / d with the divisor at offset div; returns nonzero if it ends in place */
+static int run_trial(const program_t *prog, size_t loop, trial_t *trial, uint32_t n,
+                     long div, uint32_t d)
+{
+  long pos = DIV_BASE;
+  size_t i;
+
+  for (i = 0; i < DIV_WINDOW; i++) {
+    trial->cells[i] = 0;
+  }
+  trial->cells[DIV_BASE] = n;
+  trial->cells[DIV_BASE + div] = d;
+  trial->steps = 0;
+  return run(prog, loop, prog->ops[loop].match + 1, trial, &pos) == 1 && pos == DIV_BASE;
+}
+
+/* Finds the cell that holds value after a trial, other than the dividend and the divisor */
+static long find_cell(const trial_t *trial, long div, uint32_t value)
+{
+  long found = 0;
+  long i;
+
+  for (i = 0; i < DIV_WINDOW; i++) {
+    if (i != DIV_BASE && i != DIV_BASE + div && trial->cells[i] == value) {
+      if (found != 0) {
+        return 0;
+      }
+      found = i - DIV_BASE;
+    }
+  }
+  return found;
+}
+
+/* Checks whether the body of the loop is small, nested and free of input and output */
+static int is_candidate(const program_t *prog, size_t loop)
+{
+  size_t i, end = prog->ops[loop].match;
+  int nested = 0;
+
+  if (end - loop > DIV_OPS) {
+    return 0;
+  }
+  for (i = loop + 1; i < end; i++) {
+    switch (prog->ops[i].op) {
+    case IR_LOOP:
+      nested = 1;
+      break;
+    case IR_ADD:
+    case IR_SET:
+    case IR_MUL:
+    case IR_MOVE:
+    case IR_SCAN:
+    case IR_CLEAR:
+    case IR_END:
+    case IR_BREAK:
+      break;
+    default:
+      return 0;
+    }
+  }
+  return nested;
+}
+
+/* Sets the value to the symbol plus a constant, or just the constant for sym < 0 */
+static void set_symbolic(symbolic_t *value, int sym, long constant)
+{
+  int i;
+
+  value->constant = constant;
+  for (i = 0; i < DIV_SYMBOLS; i++) {
+    value->coeffs[i] = i == sym;
+  }
+}
+
+/* Replaces the symbols that the path fixes by their values and wraps to 32 bits */
+static void substitute(symbolic_t *value, const path_t *path)
+{
+  int i;
+
+  for (i = 0; i < DIV_SYMBOLS; i++) {
+    if (path->fixed[i]) {
+      value->constant += value->coeffs[i] * (long)path->value[i];
+      value->coeffs[i] = 0;
+    }
+    value->coeffs[i] = cell_value(value->coeffs[i]);
+  }
+  value->constant = cell_value(value->constant);
+}
+
+/* Fixes the symbol to the value on the path */
+static void fix(path_t *path, int sym, uint32_t value)
+{
+  size_t i;
+
+  path->fixed[sym] = 1;
+  path->value[sym] = value;
+  for (i = 0; i < DIV_WINDOW; i++) {
+    substitute(&path->cells[i], path);
+  }
+}
+
+/* Checks whether the invariant D >= 1 and D + R = d >= min_divisor allows the path */
+static int is_feasible(const proof_t *proof, const path_t *path)
+{
+  uint64_t d;
+
+  if (path->fixed[SYM_D] && path->value[SYM_D] == 0) {
+    return 0;
+  }
+  if (path->fixed[SYM_D] && path->fixed[SYM_R]) {
+    d = (uint64_t)path->value[SYM_D] + path->value[SYM_R];
+    return d >= (uint64_t)proof->div->min_divisor && d <= UINT32_MAX;
+  }
+  return 1;
+}
+
+static int prove_path(proof_t *proof, path_t *path);
+
+/*
+ * Decides whether the cell is zero on the path. If that depends on a
+ * symbol, the case where the symbol makes the cell zero is proven
+ * first, from the same operation, and the path goes on as the case
+ * where it does not. Returns 0 or 1 for a zero or nonzero cell, or -1 if
+ * the cell cannot be decided or the other case fails.
+ */
+static int test_cell(proof_t *proof, path_t *path, long cell)
+{
+  const symbolic_t *value = &path->cells[cell];
+  path_t *zero;
+  uint32_t root;
+  size_t i;
+  int sym = -1, result;
+
+  proof->touched[cell] = 1;
+  for (i = 0; i < DIV_SYMBOLS; i++) {
+    if (value->coeffs[i] == 0) {
+      continue;
+    }
+    if (sym >= 0 || (value->coeffs[i] != 1 && value->coeffs[i] != -1)) {
+      return -1;
+    }
+    sym = i;
+  }
+  if (sym < 0) {
+    return value->constant != 0;
+  }
+
+  /* x + c and -x + c are zero for x = -c and x = c */
+  root = (uint32_t)(-value->coeffs[sym] * value->constant);
+  for (i = 0; i < path->nexcluded[sym]; i++) {
+    if (path->excluded[sym][i] == root) {
+      return 1;
+    }
+  }
+  if (path->nexcluded[sym] == DIV_EXCLUDED) {
+    return -1;
+  }
+
+  zero = malloc(sizeof(*zero));
+  if (zero == NULL) {
+    error("Out of memory while looking for division loops");
+  }
+  *zero = *path;
+  fix(zero, sym, root);
+  result = !is_feasible(proof, zero) || prove_path(proof, zero);
+  free(zero);
+  if (!result) {
+    return -1;
+  }
+
+  path->excluded[sym][path->nexcluded[sym]++] = root;
+  return 1;
+}
+
+/* Finds the end of the loop that the IR_BREAK at prog->ops[i] leaves */
+static size_t break_target(const program_t *prog, size_t i)
+{
+  size_t depth = 0;
+
+  for (i++; prog->ops[i].op != IR_END || depth > 0; i++) {
+    if (prog->ops[i].op == IR_LOOP) {
+      depth++;
+    } else if (prog->ops[i].op == IR_END) {
+      depth--;
+    }
+  }
+  return i;
+}
+
+/* Checks whether the path ends with the cells of one step of the division */
+static int check_step(const proof_t *proof, const path_t *path)
+{
+  const divmod_t *div = proof->div;
+  symbolic_t want;
+  size_t i;
+  long cell;
+  int last = 0;
+
+  if (path->pos != DIV_BASE) {
+    return 0;
+  }
+
+  /* The divisor runs out if it is 1 */
+  if (path->fixed[SYM_D]) {
+    last = path->value[SYM_D] == 1;
+  } else {
+    for (i = 0; i < path->nexcluded[SYM_D] && path->excluded[SYM_D][i] != 1; i++) {
+    }
+    if (i == path->nexcluded[SYM_D]) {
+      return 0;
+    }
+  }
+
+  for (i = 0; i < DIV_WINDOW; i++) {
+    cell = (long)i - DIV_BASE;
+    if (cell == 0) {
+      set_symbolic(&want, SYM_N, -1);
+    } else if (cell == div->divisor) {
+      set_symbolic(&want, last ? SYM_R : SYM_D, last ? 1 : -1);
+    } else if (cell == div->remainder) {
+      set_symbolic(&want, last ? -1 : SYM_R, last ? 0 : 1);
+    } else if (cell == div->quotient) {
+      set_symbolic(&want, SYM_Q, last ? 1 : 0);
+    } else {
+      set_symbolic(&want, -1, 0);
+    }
+    substitute(&want, path);
+    if (memcmp(&want, &path->cells[i], sizeof(want)) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Runs the rest of the body on the path and its cases; returns nonzero if all are steps */
+static int prove_path(proof_t *proof, path_t *path)
+{
+  const program_t *prog = proof->prog;
+  const ir_t *ir;
+  symbolic_t *dst;
+  const symbolic_t *src;
+  long cell;
+  size_t i;
+  int nonzero;
+
+  while (path->pc < prog->ops[proof->loop].match) {
+    ir = &prog->ops[path->pc];
+    if (++proof->steps > DIV_STEPS) {
+      return 0;
+    }
+
+    cell = path->pos + ir->offset;
+    if (ir->op != IR_MOVE && ir->op != IR_SCAN && ir->op != IR_CLEAR &&
+        (cell < 0 || cell >= DIV_WINDOW)) {
+      return 0;
+    }
+
+    switch (ir->op) {
+    case IR_ADD:
+      proof->touched[cell] = 1;
+      path->cells[cell].constant = cell_value(path->cells[cell].constant + ir->value);
+      path->pc++;
+      break;
+    case IR_SET:
+      proof->touched[cell] = 1;
+      set_symbolic(&path->cells[cell], -1, ir->value);
+      path->pc++;
+      break;
+    case IR_MUL:
+      if (path->pos + ir->src < 0 || path->pos + ir->src >= DIV_WINDOW) {
+        return 0;
+      }
+      proof->touched[cell] = proof->touched[path->pos + ir->src] = 1;
+      dst = &path->cells[cell];
+      src = &path->cells[path->pos + ir->src];
+      dst->constant = cell_value(dst->constant + ir->value * src->constant);
+      for (i = 0; i < DIV_SYMBOLS; i++) {
+        dst->coeffs[i] = cell_value(dst->coeffs[i] + ir->value * src->coeffs[i]);
+      }
+      path->pc++;
+      break;
+    case IR_MOVE:
+      path->pos += ir->value;
+      path->pc++;
+      break;
+    case IR_SCAN:
+    case IR_CLEAR:
+      /* One cell at a time, so that each test can split the path */
+      if (path->pos < 0 || path->pos >= DIV_WINDOW) {
+        return 0;
+      }
+      nonzero = test_cell(proof, path, path->pos);
+      if (nonzero < 0) {
+        return 0;
+      }
+      if (!nonzero) {
+        path->pc++;
+        break;
+      }
+      if (ir->op == IR_CLEAR) {
+        set_symbolic(&path->cells[path->pos], -1, 0);
+      }
+      path->pos += ir->value;
+      break;
+    case IR_LOOP:
+      nonzero = test_cell(proof, path, cell);
+      if (nonzero < 0) {
+        return 0;
+      }
+      path->pc = nonzero ? path->pc + 1 : ir->match + 1;
+      break;
+    case IR_END:
+      nonzero = test_cell(proof, path, cell);
+      if (nonzero < 0) {
+        return 0;
+      }
+      path->pc = nonzero ? ir->match + 1 : path->pc + 1;
+      break;
+    case IR_BREAK:
+      nonzero = test_cell(proof, path, cell);
+      if (nonzero < 0) {
+        return 0;
+      }
+      if (!nonzero) {
+        path->pos = cell;
+        path->pc = break_target(prog, path->pc) + 1;
+      } else {
+        path->pc++;
+      }
+      break;
+    default:
+      return 0;
+    }
+  }
+
+  return path->pc == prog->ops[proof->loop].match && check_step(proof, path);
+}
+
+/*
+ * Proves that the body of the loop at prog->ops[loop] performs a step of
+ * the division on the cells in *div for divisors from div->min_divisor
+ * on, and stores the cells that must be zero in div
+ */
+static int prove_step(const program_t *prog, size_t loop, divmod_t *div)
+{
+  proof_t proof;
+  path_t *path;
+  long cell;
+  size_t i;
+  int result;
+
+  path = malloc(sizeof(*path));
+  if (path == NULL) {
+    error("Out of memory while looking for division loops");
+  }
+
+  proof.prog = prog;
+  proof.loop = loop;
+  proof.div = div;
+  proof.steps = 0;
+  for (i = 0; i < DIV_WINDOW; i++) {
+    proof.touched[i] = 0;
+    set_symbolic(&path->cells[i], -1, 0);
+  }
+  set_symbolic(&path->cells[DIV_BASE], SYM_N, 0);
+  set_symbolic(&path->cells[DIV_BASE + div->divisor], SYM_D, 0);
+  set_symbolic(&path->cells[DIV_BASE + div->remainder], SYM_R, 0);
+  set_symbolic(&path->cells[DIV_BASE + div->quotient], SYM_Q, 0);
+  path->pos = DIV_BASE;
+  path->pc = loop + 1;
+  for (i = 0; i < DIV_SYMBOLS; i++) {
+    path->fixed[i] = 0;
+    path->nexcluded[i] = 0;
+  }
+
+  /* The body runs while the dividend is not zero */
+  path->excluded[SYM_N][path->nexcluded[SYM_N]++] = 0;
+
+  result = prove_path(&proof, path);
+  free(path);
+  if (!result) {
+    return 0;
+  }
+
+  /* Every other cell the loop touches must be zero */
+  div->nzero = 0;
+  for (i = 0; i < DIV_WINDOW; i++) {
+    cell = (long)i - DIV_BASE;
+    if (proof.touched[i] && cell != 0 && cell != div->divisor && cell != div->quotient) {
+      div->zero[div->nzero++] = cell;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Checks whether the loop at prog->ops[loop] divides the cell it tests
+ * by another cell and describes its cells in *div
+ */
+int find_divmod(const program_t *prog, size_t loop, divmod_t *div)
+{
+  trial_t trial;
+  long offset;
+
+  if (!is_candidate(prog, loop)) {
+    return 0;
+  }
+
+  for (offset = -4; offset <= 4; offset++) {
+    if (offset == 0) {
+      continue;
+    }
+
+    /* Find the remainder and the quotient of 23 / 7 */
+    if (!run_trial(prog, loop, &trial, 23, offset, 7) || trial.cells[DIV_BASE] != 0 ||
+        trial.cells[DIV_BASE + offset] != 5) {
+      continue;
+    }
+    div->divisor = offset;
+    div->remainder = find_cell(&trial, offset, 2);
+    div->quotient = find_cell(&trial, offset, 3);
+    if (div->remainder == 0 || div->quotient == 0) {
+      continue;
+    }
+
+    /* The usual algorithm needs a divisor of 2 or more */
+    for (div->min_divisor = 1; div->min_divisor <= DIV_MIN_MAX; div->min_divisor++) {
+      if (prove_step(prog, loop, div)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,392 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "bfc.h"
+
+#define CODE_SIZE 1024  /* Initial number of instructions in a stream */
+
+static const char *const reg_names[] = {
+  "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"
+};
+
+static const char *const op_names[] = {
+  [OP_ADD] = "add",
+  [OP_SUB] = "sub",
+  [OP_INC] = "inc",
+  [OP_DEC] = "dec",
+  [OP_MOV] = "mov",
+  [OP_CMP] = "cmp",
+  [OP_TEST] = "test",
+  [OP_JMP] = "jmp",
+  [OP_JZ] = "jz",
+  [OP_JNZ] = "jnz",
+  [OP_INT] = "int"
+};
+
+const operand_t no_operand = { OPND_NONE, EAX, 0 };
+
+operand_t reg_operand(enum reg reg)
+{
+  operand_t opnd = { OPND_REG, reg, 0 };
+  return opnd;
+}
+
+operand_t mem_operand(enum reg base, long disp)
+{
+  operand_t opnd = { OPND_MEM, base, disp };
+  return opnd;
+}
+
+operand_t imm_operand(long value)
+{
+  operand_t opnd = { OPND_IMM, EAX, value };
+  return opnd;
+}
+
+operand_t label_operand(size_t label)
+{
+  operand_t opnd = { OPND_LABEL, EAX, label };
+  return opnd;
+}
+
+int same_operand(operand_t a, operand_t b)
+{
+  if (a.kind != b.kind) {
+    return 0;
+  }
+
+  switch (a.kind) {
+  case OPND_NONE:
+    return 1;
+  case OPND_REG:
+    return a.reg == b.reg;
+  case OPND_MEM:
+    return a.reg == b.reg && a.value == b.value;
+  default:
+    return a.value == b.value;
+  }
+}
+
+void code_init(code_t *code)
+{
+  code->len = 0;
+  code->size = CODE_SIZE;
+  code->insns = malloc(code->size * sizeof(*code->insns));
+  code->nlabels = 0;
+  code->labels_size = CODE_SIZE;
+  code->labels = malloc(code->labels_size * sizeof(*code->labels));
+  code->cold = 0;
+  code->line = 0;
+  code->column = 0;
+  code->prefix = "";
+  code->nconsts = 0;
+  code->consts_size = 16;
+  code->consts = malloc(code->consts_size * sizeof(*code->consts));
+  if (code->insns == NULL || code->labels == NULL || code->consts == NULL) {
+    error("Out of memory while creating instruction stream");
+  }
+}
+
+void code_free(code_t *code)
+{
+  size_t i;
+
+  for (i = 0; i < code->len; i++) {
+    free(code->insns[i].text);
+  }
+  free(code->insns);
+  free(code->labels);
+  free(code->consts);
+}
+
+/*
+ * Allocates a new label whose assembly name is .L<kind><n> and returns
+ * its number, which is what label operands refer to.
+ */
+size_t new_label(code_t *code, char kind, size_t n)
+{
+  if (code->nlabels == code->labels_size) {
+    code->labels_size *= 2;
+    code->labels = realloc(code->labels, code->labels_size * sizeof(*code->labels));
+    if (code->labels == NULL) {
+      error("Out of memory while allocating %zu labels", code->labels_size);
+    }
+  }
+
+  code->labels[code->nlabels].kind = kind;
+  code->labels[code->nlabels].n = n;
+  code->labels[code->nlabels].align = 0;
+  code->labels[code->nlabels].skip = 0;
+  return code->nlabels++;
+}
+
+/*
+ * Returns the name of the label. The name is stored in a static buffer
+ * that the next call overwrites.
+ */
+const char *label_name(const code_t *code, size_t label)
+{
+  static char name[64];
+
+  snprintf(name, sizeof(name), ".L%s%c%zu", code->prefix,
+           code->labels[label].kind, code->labels[label].n);
+  return name;
+}
+
+/*
+ * Adds a vector of n 32-bit constants to the read-only data and returns
+ * the label of its first element. Vectors are aligned to 64 bytes.
+ */
+size_t add_constant(code_t *code, const long *values, unsigned int n)
+{
+  constant_t *constant;
+  unsigned int i;
+
+  if (code->nconsts == code->consts_size) {
+    code->consts_size *= 2;
+    code->consts = realloc(code->consts, code->consts_size * sizeof(*code->consts));
+    if (code->consts == NULL) {
+      error("Out of memory while adding constant %zu", code->nconsts);
+    }
+  }
+
+  constant = &code->consts[code->nconsts++];
+  constant->label = new_label(code, 'C', code->nconsts);
+  constant->n = n;
+  for (i = 0; i < n; i++) {
+    constant->values[i] = values[i];
+  }
+
+  return constant->label;
+}
+
+static insn_t *append(code_t *code)
+{
+  if (code->len == code->size) {
+    code->size *= 2;
+    code->insns = realloc(code->insns, code->size * sizeof(*code->insns));
+    if (code->insns == NULL) {
+      error("Out of memory while growing instruction stream to %zu", code->size);
+    }
+  }
+
+  return &code->insns[code->len++];
+}
+
+void emit(code_t *code, enum opcode op, operand_t dst, operand_t src)
+{
+  insn_t *insn = append(code);
+
+  insn->op = op;
+  insn->dst = dst;
+  insn->src = src;
+  insn->text = NULL;
+  insn->cold = code->cold;
+  insn->line = code->line;
+  insn->column = code->column;
+}
+
+void emit_raw(code_t *code, const char *fmt, ...)
+{
+  va_list params;
+  char *text;
+  int len;
+
+  va_start(params, fmt);
+  len = vsnprintf(NULL, 0, fmt, params);
+  va_end(params);
+
+  if ((text = malloc(len + 1)) == NULL) {
+    error("Out of memory while emitting assembly code");
+  }
+
+  va_start(params, fmt);
+  vsnprintf(text, len + 1, fmt, params);
+  va_end(params);
+
+  emit(code, OP_RAW, no_operand, no_operand);
+  code->insns[code->len - 1].text = text;
+}
+
+/* Emits a symbol, which is named by the format like emit_raw */
+void emit_symbol(code_t *code, const char *fmt, ...)
+{
+  va_list params;
+  char *text;
+  int len;
+
+  va_start(params, fmt);
+  len = vsnprintf(NULL, 0, fmt, params);
+  va_end(params);
+
+  if ((text = malloc(len + 1)) == NULL) {
+    error("Out of memory while emitting symbol");
+  }
+
+  va_start(params, fmt);
+  vsnprintf(text, len + 1, fmt, params);
+  va_end(params);
+
+  emit(code, OP_SYMBOL, no_operand, no_operand);
+  code->insns[code->len - 1].text = text;
+}
+
+/* Deletes every instruction whose entry in dead is nonzero and clears dead */
+void remove_insns(code_t *code, char *dead)
+{
+  size_t i, j;
+
+  for (i = j = 0; i < code->len; i++) {
+    if (dead[i]) {
+      free(code->insns[i].text);
+      dead[i] = 0;
+    } else {
+      code->insns[j++] = code->insns[i];
+    }
+  }
+  code->len = j;
+}
+
+/*
+ * Moves the cold instructions behind the hot ones, keeping the order
+ * within each, so that rarely executed paths do not occupy cache lines
+ * and fetch windows of the code around them.
+ */
+void place_cold_code(code_t *code)
+{
+  insn_t *insns;
+  size_t i, j = 0;
+  int cold;
+
+  insns = malloc(code->size * sizeof(*insns));
+  if (insns == NULL) {
+    error("Out of memory while placing cold code");
+  }
+
+  for (cold = 0; cold <= 1; cold++) {
+    for (i = 0; i < code->len; i++) {
+      if (code->insns[i].cold == cold) {
+        insns[j++] = code->insns[i];
+      }
+    }
+  }
+
+  free(code->insns);
+  code->insns = insns;
+}
+
+static void write_operand(FILE *as, const code_t *code, operand_t opnd)
+{
+  switch (opnd.kind) {
+  case OPND_NONE:
+    break;
+  case OPND_REG:
+    fprintf(as, "%s", reg_names[opnd.reg]);
+    break;
+  case OPND_MEM:
+    fprintf(as, "DWORD PTR [%s", reg_names[opnd.reg]);
+    if (opnd.value != 0) {
+      fprintf(as, "%+ld", opnd.value);
+    }
+    fprintf(as, "]");
+    break;
+  case OPND_IMM:
+    fprintf(as, "%ld", opnd.value);
+    break;
+  case OPND_LABEL:
+    fprintf(as, "%s", label_name(code, opnd.value));
+    break;
+  }
+}
+
+/*
+ * Writes the instruction stream as Intel syntax assembly code. Source
+ * positions become .loc directives for file 1, from which the assembler
+ * builds the DWARF line table; code without a position is given line 0.
+ */
+void write_code(FILE *as, const code_t *code)
+{
+  const insn_t *insn;
+  const label_t *label;
+  unsigned int line = 0, column = 0;
+  size_t i;
+  unsigned int j;
+
+  for (i = 0; i < code->len; i++) {
+    insn = &code->insns[i];
+
+    if (insn->op != OP_LABEL && insn->op != OP_SYMBOL &&
+        (insn->line != line || insn->column != column)) {
+      line = insn->line;
+      column = insn->column;
+      fprintf(as, "\t.loc 1 %u %u\n", line, column);
+    }
+
+    switch (insn->op) {
+    case OP_LABEL:
+      label = &code->labels[insn->dst.value];
+      if (label->align != 0) {
+        fprintf(as, "\t.balign %u,,%u\n", label->align, label->skip);
+      }
+      write_operand(as, code, insn->dst);
+      fprintf(as, ":\n");
+      break;
+    case OP_RAW:
+      fprintf(as, "\t%s\n", insn->text);
+      break;
+    case OP_SYMBOL:
+      fprintf(as, "%s:\n", insn->text);
+      break;
+    default:
+      fprintf(as, "\t%s", op_names[insn->op]);
+      if (insn->dst.kind != OPND_NONE) {
+        fprintf(as, " ");
+        write_operand(as, code, insn->dst);
+      }
+      if (insn->src.kind != OPND_NONE) {
+        fprintf(as, ", ");
+        write_operand(as, code, insn->src);
+      }
+      fprintf(as, "\n");
+      break;
+    }
+  }
+
+  if (line != 0) {
+    fprintf(as, "\t.loc 1 0 0\n");
+  }
+
+  if (code->nconsts == 0) {
+    return;
+  }
+
+  fprintf(as, ".section .rodata\n");
+  for (i = 0; i < code->nconsts; i++) {
+    fprintf(as, "\t.balign 64\n");
+    fprintf(as, "%s:\n", label_name(code, code->consts[i].label));
+    for (j = 0; j < code->consts[i].n; j++) {
+      fprintf(as, "\t.long %ld\n", code->consts[i].values[j]);
+    }
+  }
+  fprintf(as, ".section .text\n");
+}
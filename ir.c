@@ -0,0 +1,824 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Intermediate representation of BF programs. A program is a flat array
+ * of operations in which loops are delimited by IR_LOOP and IR_END.
+ * Between loop boundaries pointer movement is folded into the offsets of
+ * the operations, so that a block such as ">+>+<<" becomes two additions
+ * at offsets 1 and 2 without any movement.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "bfc.h"
+
+#define PROGRAM_SIZE 1024  /* Initial number of operations in a program */
+#define AFFINE_CELLS 16    /* Maximum number of cells in a summarised loop */
+#define UNROLL_MAX    8    /* Maximum number of body copies in an unrolled loop */
+#define UNROLL_BUDGET 32   /* Maximum number of operations in an unrolled loop */
+
+void program_init(program_t *prog)
+{
+  prog->len = 0;
+  prog->size = PROGRAM_SIZE;
+  prog->line = 0;
+  prog->column = 0;
+  prog->ops = malloc(prog->size * sizeof(*prog->ops));
+  if (prog->ops == NULL) {
+    error("Out of memory while creating program");
+  }
+}
+
+void program_free(program_t *prog)
+{
+  free(prog->ops);
+}
+
+/* Appends an operation at the current source position and returns it */
+ir_t *append_op(program_t *prog, enum ir_op op, long offset, long value)
+{
+  ir_t *ir;
+
+  if (prog->len == prog->size) {
+    prog->size *= 2;
+    prog->ops = realloc(prog->ops, prog->size * sizeof(*prog->ops));
+    if (prog->ops == NULL) {
+      error("Out of memory while growing program to %zu operations", prog->size);
+    }
+  }
+
+  ir = &prog->ops[prog->len++];
+  ir->op = op;
+  ir->offset = offset;
+  ir->value = value;
+  ir->src = 0;
+  ir->match = 0;
+  ir->line = prog->line;
+  ir->column = prog->column;
+  return ir;
+}
+
+/* Links every IR_LOOP with its IR_END through their match fields */
+void match_loops(program_t *prog)
+{
+  size_t *stack;
+  size_t top = 0;
+  size_t i;
+
+  stack = malloc((prog->len + 1) * sizeof(*stack));
+  if (stack == NULL) {
+    error("Out of memory while matching loops");
+  }
+
+  for (i = 0; i < prog->len; i++) {
+    if (prog->ops[i].op == IR_LOOP) {
+      stack[top++] = i;
+    } else if (prog->ops[i].op == IR_END) {
+      prog->ops[i].match = stack[--top];
+      prog->ops[stack[top]].match = i;
+    }
+  }
+
+  free(stack);
+}
+
+/* Sign extends the low 32 bits of value, which wrap like a cell */
+long cell_value(long value)
+{
+  return (int32_t)(uint32_t)value;
+}
+
+/* Widens the window of cells from *lo to *hi, empty if *lo > *hi, to the cell */
+void widen_window(long *lo, long *hi, long cell)
+{
+  if (*lo > *hi) {
+    *lo = *hi = cell;
+  } else if (cell < *lo) {
+    *lo = cell;
+  } else if (cell > *hi) {
+    *hi = cell;
+  }
+}
+
+/*
+ * Follows the pointer from *pos through the operations from begin up to
+ * end, which hold whole loops, widens the window from *lo to *hi to the
+ * cells they touch and stores the pointer after them in *pos. Returns
+ * zero if the pointer is not known throughout: a loop does not leave it
+ * where it found it, a scan moves it, or a break that moves it follows
+ * a body that did not return.
+ */
+int find_window(const program_t *prog, size_t begin, size_t end, long *pos, long *lo, long *hi)
+{
+  const ir_t *ir;
+  long *stack;
+  size_t depth = 0, i;
+  int known = 1;
+
+  stack = malloc((end - begin + 1) * sizeof(*stack));
+  if (stack == NULL) {
+    error("Out of memory while following the pointer");
+  }
+
+  for (i = begin; known && i < end; i++) {
+    ir = &prog->ops[i];
+    switch (ir->op) {
+    case IR_ADD:
+    case IR_SET:
+    case IR_IN:
+    case IR_OUT:
+    case IR_TRAP:
+      widen_window(lo, hi, *pos + ir->offset);
+      break;
+    case IR_MUL:
+      widen_window(lo, hi, *pos + ir->offset);
+      widen_window(lo, hi, *pos + ir->src);
+      break;
+    case IR_MOVE:
+      *pos += ir->value;
+      break;
+    case IR_LOOP:
+    case IR_COUNT:
+      widen_window(lo, hi, *pos);
+      stack[depth++] = *pos;
+      break;
+    case IR_END:
+      widen_window(lo, hi, *pos);
+      /* Fall through */
+    case IR_NEXT:
+      known = stack[--depth] == *pos;
+      break;
+    case IR_REPEAT:
+      known = stack[depth - 1] == *pos;
+      break;
+    case IR_BREAK:
+      /* Breaks that move the pointer only follow unbalanced bodies */
+      known = ir->offset == 0;
+      widen_window(lo, hi, *pos);
+      break;
+    case IR_SCAN:
+    case IR_CLEAR:
+      known = 0;
+      break;
+    }
+  }
+
+  free(stack);
+  return known;
+}
+
+/*
+ * Reads BF source code into the program. Runs of '+', '-', '>' and '<'
+ * become single operations; all other characters are comments.
+ */
+void parse(program_t *prog, FILE *src)
+{
+  ir_t *last;
+  size_t depth = 0;
+  size_t line = 1;
+  size_t column = 0;
+  int c;
+
+  while ((c = fgetc(src)) != EOF) {
+    last = prog->len > 0 ? &prog->ops[prog->len - 1] : NULL;
+    prog->line = line;
+    prog->column = ++column;
+
+    switch (c) {
+    case '>':
+    case '<':
+      if (last != NULL && last->op == IR_MOVE) {
+        last->value += c == '>' ? 1 : -1;
+      } else {
+        append_op(prog, IR_MOVE, 0, c == '>' ? 1 : -1);
+      }
+      break;
+    case '+':
+    case '-':
+      if (last != NULL && last->op == IR_ADD) {
+        last->value = cell_value(last->value + (c == '+' ? 1 : -1));
+      } else {
+        append_op(prog, IR_ADD, 0, c == '+' ? 1 : -1);
+      }
+      break;
+    case '.':
+      append_op(prog, IR_OUT, 0, 0);
+      break;
+    case ',':
+      append_op(prog, IR_IN, 0, 0);
+      break;
+    case '[':
+      append_op(prog, IR_LOOP, 0, 0);
+      depth++;
+      break;
+    case ']':
+      if (depth == 0) {
+        error("Unmatched ']' on line %zu", line);
+      }
+      append_op(prog, IR_END, 0, 0);
+      depth--;
+      break;
+    case '\n':
+      line++;
+      column = 0;
+      break;
+    }
+  }
+
+  if (depth > 0) {
+    error("Missing ']' for %zu loop(s) at end of file", depth);
+  }
+
+  match_loops(prog);
+}
+
+/* Checks whether the operation only writes the cell at its offset */
+static int is_block_op(const ir_t *ir)
+{
+  return ir->op == IR_ADD || ir->op == IR_SET;
+}
+
+/* Orders assignments before additions, each by ascending offset */
+static int compare_block_ops(const void *a, const void *b)
+{
+  const ir_t *x = a, *y = b;
+
+  if (x->op != y->op) {
+    return x->op == IR_SET ? -1 : 1;
+  }
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*
+ * Sorts every run of additions and assignments. They update distinct
+ * cells, so their order does not matter, and sorted runs let code
+ * generation combine updates of adjacent cells.
+ */
+static void sort_blocks(program_t *prog)
+{
+  size_t i, j;
+
+  for (i = 0; i < prog->len; i = j + 1) {
+    for (j = i; j < prog->len && is_block_op(&prog->ops[j]); j++) {
+    }
+    if (j - i > 1) {
+      qsort(&prog->ops[i], j - i, sizeof(*prog->ops), compare_block_ops);
+    }
+  }
+}
+
+/*
+ * Folds pointer movement into the offsets of the operations that follow
+ * it up to the next loop boundary or scan, where the accumulated
+ * movement is materialised. Additions and assignments to the same cell
+ * are combined when only additions and assignments to other cells lie
+ * between them.
+ */
+static void normalise(program_t *prog)
+{
+  program_t out;
+  ir_t *ir, *prev;
+  long pending = 0;
+  size_t i, j, block = 0;
+
+  program_init(&out);
+
+  for (i = 0; i < prog->len; i++) {
+    ir = &prog->ops[i];
+    out.line = ir->line;
+    out.column = ir->column;
+
+    switch (ir->op) {
+    case IR_MOVE:
+      pending += ir->value;
+      break;
+    case IR_ADD:
+    case IR_SET:
+      /* Look for an earlier update of the same cell in this block */
+      prev = NULL;
+      for (j = out.len; j > block && is_block_op(&out.ops[j - 1]); j--) {
+        if (out.ops[j - 1].offset == ir->offset + pending) {
+          prev = &out.ops[j - 1];
+          break;
+        }
+      }
+      if (prev != NULL && ir->op == IR_ADD) {
+        prev->value = cell_value(prev->value + ir->value);
+      } else if (prev != NULL) {
+        prev->op = IR_SET;
+        prev->value = ir->value;
+      } else if (ir->value != 0 || ir->op == IR_SET) {
+        append_op(&out, ir->op, ir->offset + pending, ir->value);
+      }
+      if (prev != NULL && prev->op == IR_ADD && prev->value == 0) {
+        /* Remove the addition of zero */
+        for (j = prev - out.ops; j + 1 < out.len; j++) {
+          out.ops[j] = out.ops[j + 1];
+        }
+        out.len--;
+      }
+      break;
+    case IR_MUL:
+      append_op(&out, IR_MUL, ir->offset + pending, ir->value)->src = ir->src + pending;
+      break;
+    case IR_IN:
+    case IR_OUT:
+      append_op(&out, ir->op, ir->offset + pending, 0);
+      break;
+    case IR_TRAP:
+      append_op(&out, IR_TRAP, ir->offset + pending, ir->value);
+      break;
+    case IR_BREAK:
+      append_op(&out, IR_BREAK, ir->offset + pending, 0);
+      block = out.len;
+      break;
+    case IR_LOOP:
+    case IR_END:
+    case IR_SCAN:
+    case IR_CLEAR:
+    case IR_COUNT:
+    case IR_REPEAT:
+    case IR_NEXT:
+      if (pending != 0) {
+        append_op(&out, IR_MOVE, 0, pending);
+        pending = 0;
+      }
+      append_op(&out, ir->op, 0, ir->value);
+      block = out.len;
+      break;
+    }
+  }
+
+  if (pending != 0) {
+    append_op(&out, IR_MOVE, 0, pending);
+  }
+
+  program_free(prog);
+  *prog = out;
+  sort_blocks(prog);
+  match_loops(prog);
+}
+
+/* Affine function of the cell values on entry to a loop body */
+typedef struct affine_t affine_t;
+struct affine_t
+{
+  long constant;
+  long coeffs[AFFINE_CELLS];  /* Coefficient of the cell at offsets[i] */
+  int written;                /* Cell is written by the loop body */
+};
+
+/* Returns the inverse of the odd number value modulo 2^32 */
+static long inverse(long value)
+{
+  uint32_t x = value;
+  int i;
+
+  /* Each Newton step doubles the number of correct low bits */
+  for (i = 0; i < 5; i++) {
+    x *= 2 - (uint32_t)value * x;
+  }
+
+  return cell_value(x);
+}
+
+/* Checks whether the function does not depend on any cell */
+static int is_constant(const affine_t *affine, size_t ncells)
+{
+  size_t i;
+
+  for (i = 0; i < ncells; i++) {
+    if (affine->coeffs[i] != 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Returns the index of offset in offsets, adding it if there is room */
+static int cell_index(long *offsets, size_t *n, long offset)
+{
+  size_t i;
+
+  for (i = 0; i < *n; i++) {
+    if (offsets[i] == offset) {
+      return i;
+    }
+  }
+  if (*n == AFFINE_CELLS) {
+    return -1;
+  }
+  offsets[*n] = offset;
+  return (*n)++;
+}
+
+/*
+ * Appends the closed form of the loop between ops[begin] and its end to
+ * out and returns nonzero, or returns zero if the loop has none. This
+ * covers innermost loops such as clear loops "[-]", multiply loops such
+ * as "[->++>+<<]" and scan loops such as "[>]", as well as loops such as
+ * "[[-]>]" that clear cells up to the next zero cell.
+ *
+ * Other balanced loops whose bodies are straight-line additions,
+ * assignments and multiplications, such as "[>+++[->++<]<-]" once the
+ * inner loop is summarised, are executed symbolically. Every cell then
+ * ends up as an affine function of the cell values on entry. The loop
+ * has a closed form if cell 0 only changes by an odd constant c, so that
+ * it reaches zero after n = -cell * c^-1 (mod 2^32) iterations, and
+ * every other cell either becomes a constant or adds a constant plus
+ * multiples of such constant cells to itself. Applying the body twice
+ * then has the same linear part as applying it once, and after n > 0
+ * iterations the cell at j with f(x) = x[j] + sum a[i] * x[i] + b holds
+ * x[j] + sum a[i] * x[i] + n * (b + sum a[i] * b[i]) - sum a[i] * b[i].
+ * Where this differs from the entry value for n = 0, the closed form is
+ * guarded by a loop that runs at most once.
+ */
+static int recognise_loop(program_t *out, const program_t *prog, size_t begin)
+{
+  const ir_t *body = &prog->ops[begin + 1];
+  const size_t n = prog->ops[begin].match - begin - 1;
+  affine_t cells[AFFINE_CELLS];
+  long offsets[AFFINE_CELLS];
+  size_t ncells = 1;
+  long step, trips, sum, loop_sum;
+  int guard = 0;
+  int dst, src;
+  size_t i, j;
+
+  /* The closed form takes the position of the loop */
+  out->line = prog->ops[begin].line;
+  out->column = prog->ops[begin].column;
+
+  /* Scan loop: the body only moves the pointer */
+  if (n == 1 && body[0].op == IR_MOVE) {
+    append_op(out, IR_SCAN, 0, body[0].value);
+    return 1;
+  }
+
+  /* Range clear: the body clears the cell and moves the pointer */
+  if (n == 2 && body[0].op == IR_SET && body[0].offset == 0 && body[0].value == 0 &&
+      body[1].op == IR_MOVE) {
+    append_op(out, IR_CLEAR, 0, body[1].value);
+    return 1;
+  }
+
+  /* Execute the body symbolically; cell 0 is at index 0 */
+  offsets[0] = 0;
+  for (i = 0; i < AFFINE_CELLS; i++) {
+    cells[i].constant = 0;
+    cells[i].written = 0;
+    for (j = 0; j < AFFINE_CELLS; j++) {
+      cells[i].coeffs[j] = i == j;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    if (body[i].op != IR_ADD && body[i].op != IR_SET && body[i].op != IR_MUL) {
+      return 0;
+    }
+    if ((dst = cell_index(offsets, &ncells, body[i].offset)) < 0) {
+      return 0;
+    }
+    cells[dst].written = 1;
+
+    switch (body[i].op) {
+    case IR_ADD:
+      cells[dst].constant = cell_value(cells[dst].constant + body[i].value);
+      break;
+    case IR_SET:
+      cells[dst].constant = body[i].value;
+      for (j = 0; j < AFFINE_CELLS; j++) {
+        cells[dst].coeffs[j] = 0;
+      }
+      break;
+    default:
+      if ((src = cell_index(offsets, &ncells, body[i].src)) < 0) {
+        return 0;
+      }
+      cells[dst].constant = cell_value(cells[dst].constant +
+                                       body[i].value * cells[src].constant);
+      for (j = 0; j < AFFINE_CELLS; j++) {
+        cells[dst].coeffs[j] = cell_value(cells[dst].coeffs[j] +
+                                          body[i].value * cells[src].coeffs[j]);
+      }
+      break;
+    }
+  }
+
+  /* Cell 0 must step by an odd constant */
+  step = cells[0].constant;
+  if (step % 2 == 0) {
+    return 0;
+  }
+  for (j = 0; j < ncells; j++) {
+    if (cells[0].coeffs[j] != (j == 0)) {
+      return 0;
+    }
+  }
+  trips = cell_value(-inverse(step));
+
+  /*
+   * Every other written cell must become a constant or depend on itself
+   * with coefficient 1 and otherwise only on cells that become constants
+   */
+  for (i = 1; i < ncells; i++) {
+    if (!cells[i].written) {
+      continue;
+    }
+    if (cells[i].coeffs[i] == 0) {
+      if (!is_constant(&cells[i], ncells)) {
+        return 0;
+      }
+      guard = 1;
+      continue;
+    }
+    if (cells[i].coeffs[i] != 1) {
+      return 0;
+    }
+    for (j = 1; j < ncells; j++) {
+      if (j != i && cells[i].coeffs[j] != 0) {
+        if (!cells[j].written || !is_constant(&cells[j], ncells)) {
+          return 0;
+        }
+        guard = 1;
+      }
+    }
+    if (cells[i].coeffs[0] != 0) {
+      return 0;
+    }
+  }
+
+  if (guard) {
+    append_op(out, IR_LOOP, 0, 0);
+  }
+
+  /* Accumulating cells read the constant cells and cell 0 before they change */
+  for (i = 1; i < ncells; i++) {
+    if (!cells[i].written || cells[i].coeffs[i] == 0) {
+      continue;
+    }
+    sum = 0;
+    for (j = 1; j < ncells; j++) {
+      if (j != i && cells[i].coeffs[j] != 0) {
+        append_op(out, IR_MUL, offsets[i], cells[i].coeffs[j])->src = offsets[j];
+        sum = cell_value(sum + cells[i].coeffs[j] * cells[j].constant);
+      }
+    }
+    loop_sum = cell_value(cells[i].constant + sum);
+    if (loop_sum != 0) {
+      append_op(out, IR_MUL, offsets[i], cell_value(trips * loop_sum));
+    }
+    if (sum != 0) {
+      append_op(out, IR_ADD, offsets[i], cell_value(-sum));
+    }
+  }
+
+  for (i = 1; i < ncells; i++) {
+    if (cells[i].written && cells[i].coeffs[i] == 0) {
+      append_op(out, IR_SET, offsets[i], cells[i].constant);
+    }
+  }
+  append_op(out, IR_SET, 0, 0);
+
+  if (guard) {
+    append_op(out, IR_END, 0, 0);
+  }
+  return 1;
+}
+
+/* Replaces loops by their closed forms; returns nonzero if any was replaced */
+static int recognise_loops(program_t *prog)
+{
+  program_t out;
+  size_t i;
+  int changed = 0;
+
+  program_init(&out);
+
+  for (i = 0; i < prog->len; i++) {
+    if (prog->ops[i].op == IR_LOOP && recognise_loop(&out, prog, i)) {
+      i = prog->ops[i].match;
+      changed = 1;
+    } else {
+      *append_op(&out, prog->ops[i].op, 0, 0) = prog->ops[i];
+    }
+  }
+
+  program_free(prog);
+  *prog = out;
+  match_loops(prog);
+  return changed;
+}
+
+/*
+ * Checks whether the loop body changes cell 0 only by adding an odd
+ * constant, so that it runs a number of times that can be computed on
+ * entry, and stores the factor that turns the cell into that number.
+ */
+static int is_counted(const ir_t *body, size_t n, long *trips)
+{
+  long step = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    switch (body[i].op) {
+    case IR_ADD:
+      if (body[i].offset == 0) {
+        step = cell_value(step + body[i].value);
+      }
+      break;
+    case IR_SET:
+    case IR_MUL:
+    case IR_IN:
+      if (body[i].offset == 0) {
+        return 0;
+      }
+      break;
+    case IR_OUT:
+      break;
+    default:
+      return 0;
+    }
+  }
+
+  if (step % 2 == 0) {
+    return 0;
+  }
+
+  *trips = cell_value(-inverse(step));
+  return 1;
+}
+
+/*
+ * Unrolls innermost loops that are left after loop recognition, as many
+ * times as the budget allows. Loops that run a number of times known on
+ * entry become IR_COUNT loops, which run single copies of the body until
+ * the remaining count is a multiple of the copies and then run all the
+ * copies without any tests. Other loops test the cell between the copies,
+ * which replaces most taken branches by fall through and lets pointer
+ * movement fold across the copies. Loops that run at most once are left
+ * alone.
+ *
+ * With a profile, hot loops are unrolled no further than they iterate
+ * per entry on average and other loops it knows are left alone. Loops
+ * it does not know are unrolled if by_default is set.
+ */
+static void unroll_loops(program_t *prog, const profile_t *profile, int by_default)
+{
+  program_t out;
+  const ir_t *body;
+  const loop_count_t *count;
+  size_t i, j, n, copies, copy;
+  long trips;
+  int counted;
+
+  program_init(&out);
+
+  for (i = 0; i < prog->len; i++) {
+    if (prog->ops[i].op != IR_LOOP) {
+      *append_op(&out, prog->ops[i].op, 0, 0) = prog->ops[i];
+      continue;
+    }
+
+    body = &prog->ops[i + 1];
+    n = prog->ops[i].match - i - 1;
+    out.line = prog->ops[i].line;
+    out.column = prog->ops[i].column;
+    for (j = 0; j < n && body[j].op != IR_LOOP; j++) {
+    }
+    for (copies = UNROLL_MAX; copies > 1 && copies * n > UNROLL_BUDGET; copies /= 2) {
+    }
+    count = find_loop_count(profile, prog->ops[i].line, prog->ops[i].column);
+    if (count == NULL && !by_default) {
+      copies = 1;
+    } else if (count != NULL && !is_hot_loop(profile, count)) {
+      copies = 1;
+    } else if (count != NULL) {
+      while (copies > 1 && copies * count->entries > count->iterations) {
+        copies /= 2;
+      }
+    }
+    if (j < n || copies < 2 || prog->ops[i].value != 0) {
+      *append_op(&out, IR_LOOP, 0, 0) = prog->ops[i];
+      continue;
+    }
+
+    counted = is_counted(body, n, &trips);
+    if (counted) {
+      append_op(&out, IR_COUNT, 0, trips);
+      for (j = 0; j < n; j++) {
+        *append_op(&out, body[j].op, 0, 0) = body[j];
+      }
+      append_op(&out, IR_REPEAT, 0, copies);
+    } else {
+      append_op(&out, IR_LOOP, 0, 0);
+    }
+
+    for (copy = 0; copy < copies; copy++) {
+      if (copy > 0 && !counted) {
+        append_op(&out, IR_BREAK, 0, 0);
+      }
+      for (j = 0; j < n; j++) {
+        *append_op(&out, body[j].op, 0, 0) = body[j];
+      }
+    }
+    if (counted) {
+      append_op(&out, IR_NEXT, 0, copies);
+    } else {
+      append_op(&out, IR_END, 0, 0);
+    }
+    i += n + 1;
+  }
+
+  program_free(prog);
+  *prog = out;
+  match_loops(prog);
+}
+
+/*
+ * Checks whether the body of the loop at prog->ops[loop] always leaves
+ * the cell it returns to zero, so that the loop runs at most once. That
+ * is the case if the last operation that writes the cell clears it, or
+ * if an inner loop or a scan that ends on the cell comes last.
+ */
+static int is_single_pass(const program_t *prog, size_t loop)
+{
+  const ir_t *ir;
+  long pos = 0;            /* Cell tested by the loop relative to the pointer at ir */
+  size_t i;
+
+  for (i = prog->ops[loop].match; i-- > loop + 1;) {
+    ir = &prog->ops[i];
+    switch (ir->op) {
+    case IR_MOVE:
+      pos += ir->value;
+      break;
+    case IR_ADD:
+    case IR_SET:
+    case IR_MUL:
+    case IR_IN:
+      if (ir->offset == pos) {
+        return ir->op == IR_SET && ir->value == 0;
+      }
+      break;
+    case IR_OUT:
+    case IR_TRAP:
+      break;
+    case IR_END:
+    case IR_SCAN:
+    case IR_CLEAR:
+      return pos == 0;
+    default:
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/* Marks the loops that run at most once by setting the value of their IR_LOOP */
+static void mark_single_pass(program_t *prog)
+{
+  size_t i;
+
+  for (i = 0; i < prog->len; i++) {
+    if (prog->ops[i].op == IR_LOOP) {
+      prog->ops[i].value = is_single_pass(prog, i);
+    }
+  }
+}
+
+/*
+ * Applies the IR level optimisations; a profile, if any, decides which
+ * loops to unroll, also below level 2
+ */
+void optimise(program_t *prog, int opt_level, const profile_t *profile)
+{
+  do {
+    normalise(prog);
+  } while (recognise_loops(prog));
+  mark_single_pass(prog);
+
+  if (opt_level >= 2 || profile != NULL) {
+    unroll_loops(prog, profile, opt_level >= 2);
+    normalise(prog);
+  }
+}
@@ -0,0 +1,745 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In-process execution of compiled programs. The linked program is
+ * loaded into the address space of the compiler at the addresses it was
+ * linked for and entered directly, so that it runs in the compiler
+ * process, which it ends with sys_exit. Before that the code regions
+ * can be described to perf with a perf map and a jitdump file.
+ *
+ * A batch run runs the program over many inputs. Every worker is a
+ * process forked from the compiler with a copy of the loaded program of
+ * its own, so a program that strays from its tape faults as it would on
+ * its own instead of writing into another copy. The worker runs each
+ * input that the compiler sends it in a task cloned with its address
+ * space but not its file descriptors, which reads the input as standard
+ * input, writes standard output to a file of its own and ends with
+ * sys_exit. The worker waits for the task, resets the data of the copy
+ * and sends back whether the program succeeded.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <elf.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "bfc.h"
+
+#define PAGE_SIZE 4096
+#define STACK_SIZE  0x40000     /* Stack of a worker */
+
+/* Record types and header of the jitdump format of perf */
+#define JITDUMP_MAGIC      0x4A695444
+#define JITDUMP_VERSION    1
+#define JIT_CODE_LOAD      0
+#define JIT_CODE_DEBUG_INFO 2
+
+/* Code region of the loaded program, which starts at a symbol */
+typedef struct region_t region_t;
+struct region_t
+{
+  const char *name;
+  uint64_t addr;
+  uint64_t size;
+};
+
+/* Process of a batch run with a copy of the program, which runs one input at a time */
+typedef struct worker_t worker_t;
+struct worker_t
+{
+  pid_t process;
+  int command;             /* Pipe of the indices of the inputs to run */
+  int result;              /* Pipe of whether the program succeeded for them */
+  const char *input;       /* Input running, NULL if idle */
+  const unsigned char *image;  /* Linked program */
+  uint64_t entry;
+  char *stack;
+  uint64_t *sp;            /* Initial stack pointer of the program */
+  pid_t pid;               /* Task running the input in the process */
+};
+
+/* Reads the whole file into a buffer and stores its size in size */
+unsigned char *read_file(const char *filename, size_t *size)
+{
+  unsigned char *buf;
+  FILE *file;
+  long len;
+
+  file = fopen(filename, "rb");
+  if (file == NULL) {
+    error("Could not read file %s", filename);
+  }
+
+  fseek(file, 0, SEEK_END);
+  len = ftell(file);
+  rewind(file);
+
+  buf = malloc(len > 0 ? len : 1);
+  if (buf == NULL) {
+    error("Out of memory while reading %s", filename);
+  }
+  if (len < 0 || fread(buf, 1, len, file) != (size_t)len) {
+    error("Could not read file %s", filename);
+  }
+
+  fclose(file);
+  *size = len;
+  return buf;
+}
+
+static int segment_prot(const Elf64_Phdr *phdr)
+{
+  return ((phdr->p_flags & PF_R) ? PROT_READ : 0) |
+         ((phdr->p_flags & PF_W) ? PROT_WRITE : 0) |
+         ((phdr->p_flags & PF_X) ? PROT_EXEC : 0);
+}
+
+/*
+ * Reads the linked program in filename, deletes the file and checks
+ * that it is an x86-64 executable
+ */
+static unsigned char *read_program(const char *filename, size_t *size)
+{
+  const Elf64_Ehdr *ehdr;
+  unsigned char *image;
+
+  image = read_file(filename, size);
+  unlink(filename);
+
+  ehdr = (const Elf64_Ehdr *)image;
+  if (*size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_X86_64) {
+    error("%s is not an x86-64 executable", filename);
+  }
+
+  return image;
+}
+
+/* Finds the pages that the loadable segments of the program occupy */
+static void segment_extent(const unsigned char *image, size_t size, const char *filename,
+                           uint64_t *lo, uint64_t *hi)
+{
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+  const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(image + ehdr->e_phoff);
+  size_t i;
+
+  *lo = UINT64_MAX;
+  *hi = 0;
+  for (i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type != PT_LOAD) {
+      continue;
+    }
+    if (phdrs[i].p_offset + phdrs[i].p_filesz > size) {
+      error("Segment %zu of %s is truncated", i, filename);
+    }
+    if (phdrs[i].p_vaddr < *lo) {
+      *lo = phdrs[i].p_vaddr;
+    }
+    if (phdrs[i].p_vaddr + phdrs[i].p_memsz > *hi) {
+      *hi = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+    }
+  }
+
+  if (*lo >= *hi) {
+    error("No loadable segments in %s", filename);
+  }
+  *lo &= ~(uint64_t)(PAGE_SIZE - 1);
+  *hi = (*hi + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+/*
+ * Maps the loadable segments of the program at their link addresses.
+ * Pages that two segments share get the permissions of both.
+ */
+static void load_segments(const unsigned char *image, size_t size, const char *filename)
+{
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+  const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(image + ehdr->e_phoff);
+  uint64_t lo, hi, page;
+  void *mem;
+  int prot;
+  size_t i;
+
+  segment_extent(image, size, filename, &lo, &hi);
+
+  mem = mmap((void *)lo, hi - lo, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (mem != (void *)lo) {
+    error("Could not map %s at 0x%lx", filename, (unsigned long)lo);
+  }
+
+  for (i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD) {
+      memcpy((void *)phdrs[i].p_vaddr, image + phdrs[i].p_offset, phdrs[i].p_filesz);
+    }
+  }
+
+  for (page = lo; page < hi; page += PAGE_SIZE) {
+    prot = 0;
+    for (i = 0; i < ehdr->e_phnum; i++) {
+      if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_vaddr < page + PAGE_SIZE &&
+          phdrs[i].p_vaddr + phdrs[i].p_memsz > page) {
+        prot |= segment_prot(&phdrs[i]);
+      }
+    }
+    if (mprotect((void *)page, PAGE_SIZE, prot) != 0) {
+      error("Could not protect the pages of %s", filename);
+    }
+  }
+}
+
+static int compare_regions(const void *a, const void *b)
+{
+  const region_t *x = a, *y = b;
+
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/*
+ * Collects the symbols in executable sections as regions, which extend
+ * to the next symbol or the end of their section, and returns their
+ * number. The names point into the image.
+ */
+static size_t find_regions(const unsigned char *image, region_t **regions)
+{
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+  const Elf64_Shdr *shdrs = (const Elf64_Shdr *)(image + ehdr->e_shoff);
+  const Elf64_Shdr *text;
+  const Elf64_Sym *syms;
+  const char *names;
+  size_t i, j, nsyms, n = 0;
+
+  for (i = 0; i < ehdr->e_shnum && shdrs[i].sh_type != SHT_SYMTAB; i++) {
+  }
+  if (i == ehdr->e_shnum) {
+    *regions = NULL;
+    return 0;
+  }
+
+  syms = (const Elf64_Sym *)(image + shdrs[i].sh_offset);
+  nsyms = shdrs[i].sh_size / sizeof(*syms);
+  names = (const char *)(image + shdrs[shdrs[i].sh_link].sh_offset);
+
+  *regions = malloc((nsyms + 1) * sizeof(**regions));
+  if (*regions == NULL) {
+    error("Out of memory while collecting %zu symbols", nsyms);
+  }
+
+  for (j = 0; j < nsyms; j++) {
+    if (syms[j].st_shndx == SHN_UNDEF || syms[j].st_shndx >= ehdr->e_shnum ||
+        ELF64_ST_TYPE(syms[j].st_info) > STT_FUNC || names[syms[j].st_name] == '\0') {
+      continue;
+    }
+    text = &shdrs[syms[j].st_shndx];
+    if (!(text->sh_flags & SHF_EXECINSTR)) {
+      continue;
+    }
+    (*regions)[n].name = names + syms[j].st_name;
+    (*regions)[n].addr = syms[j].st_value;
+    (*regions)[n].size = text->sh_addr + text->sh_size - syms[j].st_value;
+    n++;
+  }
+
+  qsort(*regions, n, sizeof(**regions), compare_regions);
+  for (i = 0; i + 1 < n; i++) {
+    if ((*regions)[i + 1].addr - (*regions)[i].addr < (*regions)[i].size) {
+      (*regions)[i].size = (*regions)[i + 1].addr - (*regions)[i].addr;
+    }
+  }
+
+  return n;
+}
+
+/* Writes /tmp/perf-<pid>.map, which perf reads to symbolise the addresses */
+static void write_perf_map(const region_t *regions, size_t n)
+{
+  char filename[64];
+  FILE *map;
+  size_t i;
+
+  snprintf(filename, sizeof(filename), "/tmp/perf-%d.map", (int)getpid());
+  map = fopen(filename, "w");
+  if (map == NULL) {
+    error("Could not write file %s", filename);
+  }
+
+  for (i = 0; i < n; i++) {
+    if (regions[i].size > 0) {
+      fprintf(map, "%lx %lx %s\n", (unsigned long)regions[i].addr,
+              (unsigned long)regions[i].size, regions[i].name);
+    }
+  }
+
+  fclose(map);
+}
+
+static uint64_t timestamp(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void write_u32(FILE *dump, uint32_t value)
+{
+  fwrite(&value, sizeof(value), 1, dump);
+}
+
+static void write_u64(FILE *dump, uint64_t value)
+{
+  fwrite(&value, sizeof(value), 1, dump);
+}
+
+/*
+ * Writes jit-<pid>.dump in the current directory with a code load record
+ * for every region, which perf inject --jit turns into symbols. Loop
+ * regions, whose names give their source position, are preceded by a
+ * debug record that maps their first address to that line of the BF
+ * source. perf record notices the file when it is mapped executable.
+ */
+static void write_jitdump(const region_t *regions, size_t n, const char *src_filename)
+{
+  char filename[64];
+  unsigned int line, column;
+  const char *loop;
+  size_t i, len;
+  FILE *dump;
+  void *marker;
+
+  snprintf(filename, sizeof(filename), "jit-%d.dump", (int)getpid());
+  dump = fopen(filename, "w+");
+  if (dump == NULL) {
+    error("Could not write file %s", filename);
+  }
+
+  marker = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(dump), 0);
+  if (marker == MAP_FAILED) {
+    error("Could not map file %s", filename);
+  }
+
+  /* File header */
+  write_u32(dump, JITDUMP_MAGIC);
+  write_u32(dump, JITDUMP_VERSION);
+  write_u32(dump, 40);
+  write_u32(dump, EM_X86_64);
+  write_u32(dump, 0);
+  write_u32(dump, getpid());
+  write_u64(dump, timestamp());
+  write_u64(dump, 0);
+
+  for (i = 0; i < n; i++) {
+    if (regions[i].size == 0) {
+      continue;
+    }
+
+    loop = strstr(regions[i].name, "loop_");
+    if (loop != NULL && sscanf(loop, "loop_%u_%u", &line, &column) == 2) {
+      len = strlen(src_filename) + 1;
+      write_u32(dump, JIT_CODE_DEBUG_INFO);
+      write_u32(dump, 16 + 16 + 16 + len);
+      write_u64(dump, timestamp());
+      write_u64(dump, regions[i].addr);
+      write_u64(dump, 1);
+      write_u64(dump, regions[i].addr);
+      write_u32(dump, line);
+      write_u32(dump, 0);
+      fwrite(src_filename, 1, len, dump);
+    }
+
+    len = strlen(regions[i].name) + 1;
+    write_u32(dump, JIT_CODE_LOAD);
+    write_u32(dump, 16 + 40 + len + regions[i].size);
+    write_u64(dump, timestamp());
+    write_u32(dump, getpid());
+    write_u32(dump, syscall(SYS_gettid));
+    write_u64(dump, regions[i].addr);
+    write_u64(dump, regions[i].addr);
+    write_u64(dump, regions[i].size);
+    write_u64(dump, i);
+    fwrite(regions[i].name, 1, len, dump);
+    fwrite((const void *)regions[i].addr, 1, regions[i].size, dump);
+  }
+
+  fclose(dump);
+}
+
+/*
+ * Loads the linked program in filename, deletes the file, writes the
+ * files for perf that info asks for and runs the program. The program
+ * ends the process, so this does not return.
+ */
+void run_jit(const info_t *info, const char *filename)
+{
+  const Elf64_Ehdr *ehdr;
+  unsigned char *image;
+  region_t *regions;
+  size_t size, n;
+
+  image = read_program(filename, &size);
+  ehdr = (const Elf64_Ehdr *)image;
+  load_segments(image, size, filename);
+
+  if (info->perf != 0) {
+    n = find_regions(image, &regions);
+    if (info->perf & PERF_MAP) {
+      write_perf_map(regions, n);
+    }
+    if (info->perf & PERF_JITDUMP) {
+      write_jitdump(regions, n, info->in_filename);
+    }
+    free(regions);
+  }
+
+  fflush(NULL);
+  ((void (*)(void))ehdr->e_entry)();
+
+  error("Program returned from %s", filename);
+}
+
+/*
+ * Restores the writable segments of the program to their contents at
+ * load time. Whole pages of zeros are dropped, so that the kernel
+ * supplies fresh zero pages when the program touches them.
+ */
+static void reset_segments(const unsigned char *image)
+{
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+  const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(image + ehdr->e_phoff);
+  uint64_t zero, end, page;
+  size_t i;
+
+  for (i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type != PT_LOAD || !(phdrs[i].p_flags & PF_W)) {
+      continue;
+    }
+    memcpy((void *)phdrs[i].p_vaddr, image + phdrs[i].p_offset, phdrs[i].p_filesz);
+
+    zero = phdrs[i].p_vaddr + phdrs[i].p_filesz;
+    end = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+    page = (zero + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (page >= end) {
+      memset((void *)zero, 0, end - zero);
+      continue;
+    }
+    memset((void *)zero, 0, page - zero);
+    end &= ~(uint64_t)(PAGE_SIZE - 1);
+    if (end > page) {
+      madvise((void *)page, end - page, MADV_DONTNEED);
+    }
+    memset((void *)end, 0, phdrs[i].p_vaddr + phdrs[i].p_memsz - end);
+  }
+}
+
+/*
+ * Lays out the stack that the kernel passes to _start: argc, argv with
+ * the program name, and empty environment and auxiliary vectors
+ */
+static uint64_t *initial_stack(char *stack, const char *name)
+{
+  uint64_t *sp = (uint64_t *)((uintptr_t)(stack + STACK_SIZE) & ~(uintptr_t)15) - 6;
+
+  sp[0] = 1;
+  sp[1] = (uint64_t)(uintptr_t)name;
+  sp[2] = 0;
+  sp[3] = 0;
+  sp[4] = AT_NULL;
+  sp[5] = 0;
+  return sp;
+}
+
+/* Runs in the cloned task; switches to the stack of the program and enters it */
+static int enter_worker(void *arg)
+{
+  const worker_t *worker = arg;
+
+  __asm__ volatile ("mov %0, %%rsp\n\t"
+                    "jmp *%1"
+                    :
+                    : "r" (worker->sp), "r" (worker->entry)
+                    : "memory");
+  return 0;
+}
+
+/* Reads the names of the input files, one per line */
+char **read_inputs(const char *filename, size_t *n)
+{
+  char **inputs;
+  char line[4096];
+  FILE *list;
+  size_t size = 64, len;
+
+  list = fopen(filename, "r");
+  if (list == NULL) {
+    error("Could not read file %s", filename);
+  }
+
+  *n = 0;
+  inputs = malloc(size * sizeof(*inputs));
+  if (inputs == NULL) {
+    error("Out of memory while reading %s", filename);
+  }
+  while (fgets(line, sizeof(line), list) != NULL) {
+    len = strcspn(line, "\n");
+    line[len] = '\0';
+    if (len == 0) {
+      continue;
+    }
+    if (*n == size) {
+      size *= 2;
+      inputs = realloc(inputs, size * sizeof(*inputs));
+    }
+    if (inputs == NULL || (inputs[*n] = strdup(line)) == NULL) {
+      error("Out of memory while reading %s", filename);
+    }
+    (*n)++;
+  }
+  fclose(list);
+
+  return inputs;
+}
+
+/*
+ * Starts the input in a task of the worker process. The task inherits a
+ * copy of the file descriptors, so standard input and output are pointed
+ * at the files of the input just for the clone.
+ */
+static int start_input(worker_t *worker, const char *input, int saved_in, int saved_out)
+{
+  char *output;
+  int in, out;
+
+  output = malloc(strlen(input) + 5);
+  if (output == NULL) {
+    error("Out of memory while naming the output of %s", input);
+  }
+  sprintf(output, "%s.out", input);
+
+  in = open(input, O_RDONLY);
+  if (in < 0) {
+    fprintf(stderr, "bfc: Could not read file %s\n", input);
+    free(output);
+    return 0;
+  }
+  out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    fprintf(stderr, "bfc: Could not write file %s\n", output);
+    close(in);
+    free(output);
+    return 0;
+  }
+  free(output);
+
+  if (dup2(in, 0) < 0 || dup2(out, 1) < 0) {
+    error("Could not redirect the input and output of %s", input);
+  }
+  worker->pid = clone(enter_worker, worker->stack + STACK_SIZE, CLONE_VM | CLONE_FS | SIGCHLD,
+                      worker);
+  if (worker->pid < 0) {
+    error("Could not start a worker for %s", input);
+  }
+  close(in);
+  close(out);
+  dup2(saved_in, 0);
+  dup2(saved_out, 1);
+
+  return 1;
+}
+
+/* Reports how the input ended; returns nonzero if the program succeeded */
+static int input_status(const char *input, int status)
+{
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    return 1;
+  }
+  if (WIFEXITED(status)) {
+    fprintf(stderr, "bfc: %s: exit status %d\n", input, WEXITSTATUS(status));
+  } else if (WIFSIGNALED(status)) {
+    fprintf(stderr, "bfc: %s: terminated by signal %d\n", input, WTERMSIG(status));
+  }
+  return 0;
+}
+
+/*
+ * Runs the inputs whose indices the compiler sends to the worker process
+ * one at a time and sends back for each whether the program succeeded.
+ * Ends the process when the compiler closes the pipe.
+ */
+static void serve_inputs(worker_t *worker, char **inputs, const char *name)
+{
+  size_t input;
+  int saved_in, saved_out, status, ok;
+
+  saved_in = dup(0);
+  saved_out = dup(1);
+  while (read(worker->command, &input, sizeof(input)) == sizeof(input)) {
+    ok = 0;
+    if (start_input(worker, inputs[input], saved_in, saved_out)) {
+      while (waitpid(worker->pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+          error("Could not wait for the program on %s", inputs[input]);
+        }
+      }
+      ok = input_status(inputs[input], status);
+      reset_segments(worker->image);
+      worker->sp = initial_stack(worker->stack, name);
+    }
+    if (write(worker->result, &ok, sizeof(ok)) != sizeof(ok)) {
+      error("Could not report the result of %s", inputs[input]);
+    }
+  }
+  _exit(EXIT_SUCCESS);
+}
+
+/*
+ * Runs the program linked to filename over the inputs listed in the
+ * batch file of info, writing the output of each input to <input>.out,
+ * in info->jobs worker processes. Returns nonzero if the program
+ * succeeded for all inputs.
+ */
+int run_batch(const info_t *info, const char *filename)
+{
+  worker_t *workers;
+  struct pollfd *fds;
+  char **inputs;
+  unsigned char *image;
+  size_t ninputs, nworkers, next = 0, running = 0, size, i, j;
+  int command[2], result[2], ok = 1, succeeded;
+  pid_t pid;
+
+  inputs = read_inputs(info->batch, &ninputs);
+  nworkers = info->jobs > 0 ? info->jobs : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers > ninputs) {
+    nworkers = ninputs;
+  }
+  if (nworkers == 0) {
+    nworkers = 1;
+  }
+
+  workers = calloc(nworkers, sizeof(*workers));
+  fds = calloc(nworkers, sizeof(*fds));
+  if (workers == NULL || fds == NULL) {
+    error("Out of memory while creating %zu workers", nworkers);
+  }
+
+  /* The workers inherit the program loaded at its link address */
+  image = read_program(filename, &size);
+  load_segments(image, size, filename);
+
+  fflush(NULL);
+  for (i = 0; i < nworkers; i++) {
+    workers[i].image = image;
+    workers[i].entry = ((const Elf64_Ehdr *)image)->e_entry;
+    workers[i].stack = malloc(STACK_SIZE);
+    if (workers[i].stack == NULL) {
+      error("Out of memory while creating %zu workers", nworkers);
+    }
+    workers[i].sp = initial_stack(workers[i].stack, info->in_filename);
+
+    if (pipe(command) != 0 || pipe(result) != 0) {
+      error("Could not create the pipes of %zu workers", nworkers);
+    }
+    pid = fork();
+    if (pid < 0) {
+      error("Could not start %zu workers", nworkers);
+    }
+    if (pid == 0) {
+      /* Only the compiler may hold the pipes of the other workers */
+      for (j = 0; j < i; j++) {
+        close(workers[j].command);
+        close(workers[j].result);
+      }
+      close(command[1]);
+      close(result[0]);
+      workers[i].command = command[0];
+      workers[i].result = result[1];
+      serve_inputs(&workers[i], inputs, info->in_filename);
+    }
+    close(command[0]);
+    close(result[1]);
+    workers[i].process = pid;
+    workers[i].command = command[1];
+    workers[i].result = result[0];
+  }
+
+  while (next < ninputs || running > 0) {
+    /* Send inputs to the idle workers */
+    for (i = 0; i < nworkers && next < ninputs; i++) {
+      if (workers[i].input == NULL) {
+        if (write(workers[i].command, &next, sizeof(next)) != sizeof(next)) {
+          error("Could not send %s to a worker", inputs[next]);
+        }
+        workers[i].input = inputs[next++];
+        running++;
+      }
+    }
+
+    for (i = 0; i < nworkers; i++) {
+      fds[i].fd = workers[i].input != NULL ? workers[i].result : -1;
+      fds[i].events = POLLIN;
+    }
+    if (poll(fds, nworkers, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error("Could not wait for the workers");
+    }
+    for (i = 0; i < nworkers; i++) {
+      if (fds[i].fd < 0 || fds[i].revents == 0) {
+        continue;
+      }
+      if (read(workers[i].result, &succeeded, sizeof(succeeded)) != sizeof(succeeded)) {
+        error("The worker running %s stopped", workers[i].input);
+      }
+      ok &= succeeded;
+      workers[i].input = NULL;
+      running--;
+    }
+  }
+
+  /* Workers end when their pipe of inputs is closed */
+  for (i = 0; i < nworkers; i++) {
+    close(workers[i].command);
+    close(workers[i].result);
+    while (waitpid(workers[i].process, NULL, 0) < 0 && errno == EINTR) {
+    }
+    free(workers[i].stack);
+  }
+  free(image);
+  free(workers);
+  free(fds);
+  for (i = 0; i < ninputs; i++) {
+    free(inputs[i]);
+  }
+  free(inputs);
+
+  return ok;
+}
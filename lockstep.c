@@ -0,0 +1,447 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Lockstep batch engine, an experimental alternative to running copies
+ * of the compiled program with -b. It interprets the optimised IR for
+ * LANES inputs at once. The tapes are interleaved, so that a cell of all
+ * lanes forms one vector, and every operation works on the vectors,
+ * masked to the lanes that run it.
+ *
+ * A loop runs while any lane has a nonzero cell; lanes whose cell is
+ * zero sit out the remaining iterations. As long as all pointers are at
+ * the same cell, which holds unless lanes moved in loops they ran for
+ * different numbers of iterations, cells are read and written as whole
+ * vectors; otherwise every lane accesses its own cell. Lanes whose
+ * pointer leaves the tape stop and report it.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bfc.h"
+
+#define LANES 16
+
+typedef uint32_t cells_t __attribute__((vector_size(4 * LANES)));
+typedef int32_t lanes_t __attribute__((vector_size(4 * LANES)));
+
+/* Buffer of the input or the output of a lane */
+typedef struct stream_t stream_t;
+struct stream_t
+{
+  unsigned char *data;
+  size_t len;
+  size_t size;             /* Allocated bytes of output */
+  size_t pos;              /* Read position of input */
+};
+
+typedef struct lockstep_t lockstep_t;
+struct lockstep_t
+{
+  const program_t *prog;
+  uint32_t *tape;          /* Cell c of lane l at tape[c * LANES + l] */
+  long ncells;
+  long ptr[LANES];         /* Cell of each lane */
+  int uniform;             /* All live lanes are at the same cell */
+  unsigned int live;       /* Lanes that have not left the tape */
+  stream_t in[LANES];
+  stream_t out[LANES];
+};
+
+static const lanes_t lane_bits = {
+  0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80,
+  0x100, 0x200, 0x400, 0x800, 0x1000, 0x2000, 0x4000, 0x8000
+};
+
+/* Stops the lanes of the mask whose pointer plus offset is off the tape */
+static unsigned int check_lanes(lockstep_t *ls, long offset, unsigned int mask)
+{
+  long cell;
+  int l;
+
+  for (l = 0; l < LANES; l++) {
+    cell = ls->ptr[l] + offset;
+    if ((mask >> l & 1) && (cell < 0 || cell >= ls->ncells)) {
+      ls->live &= ~(1u << l);
+    }
+  }
+  return mask & ls->live;
+}
+
+/*
+ * Loads the cells at offset of the lanes of the mask into v. Vectors are
+ * passed by reference, which keeps the calling convention independent
+ * of the vector extensions the compiler is built for.
+ */
+static void load(lockstep_t *ls, long offset, unsigned int mask, cells_t *v)
+{
+  int l;
+
+  if (ls->uniform) {
+    *v = *(cells_t *)&ls->tape[(ls->ptr[__builtin_ctz(mask)] + offset) * LANES];
+    return;
+  }
+  for (l = 0; l < LANES; l++) {
+    if (mask >> l & 1) {
+      (*v)[l] = ls->tape[(ls->ptr[l] + offset) * LANES + l];
+    }
+  }
+}
+
+/* Stores v to the cells at offset of the lanes of the mask */
+static void store(lockstep_t *ls, long offset, const cells_t *v, unsigned int mask)
+{
+  cells_t *cell;
+  cells_t m;
+  int l;
+
+  if (ls->uniform) {
+    cell = (cells_t *)&ls->tape[(ls->ptr[__builtin_ctz(mask)] + offset) * LANES];
+    m = (cells_t)((lane_bits & (int32_t)mask) != 0);
+    *cell = (*v & m) | (*cell & ~m);
+    return;
+  }
+  for (l = 0; l < LANES; l++) {
+    if (mask >> l & 1) {
+      ls->tape[(ls->ptr[l] + offset) * LANES + l] = (*v)[l];
+    }
+  }
+}
+
+/* Returns the lanes of the mask whose cell at offset is nonzero */
+static unsigned int nonzero(lockstep_t *ls, long offset, unsigned int mask)
+{
+  cells_t v = {0};
+  lanes_t nz;
+  unsigned int bits = 0;
+  int l;
+
+  if ((mask = check_lanes(ls, offset, mask)) == 0) {
+    return 0;
+  }
+  load(ls, offset, mask, &v);
+  nz = v != 0;
+  for (l = 0; l < LANES; l++) {
+    bits |= (nz[l] & 1u) << l;
+  }
+  return bits & mask;
+}
+
+/* Checks whether the live lanes are at the same cell */
+static void update_uniform(lockstep_t *ls)
+{
+  long ptr = 0;
+  int first = 1;
+  int l;
+
+  ls->uniform = 1;
+  for (l = 0; l < LANES; l++) {
+    if (ls->live >> l & 1) {
+      if (first) {
+        ptr = ls->ptr[l];
+        first = 0;
+      } else if (ls->ptr[l] != ptr) {
+        ls->uniform = 0;
+        return;
+      }
+    }
+  }
+}
+
+static void move(lockstep_t *ls, long cells, unsigned int mask)
+{
+  int l;
+
+  for (l = 0; l < LANES; l++) {
+    if (mask >> l & 1) {
+      ls->ptr[l] += cells;
+    }
+  }
+  if (mask != ls->live) {
+    update_uniform(ls);
+  }
+}
+
+/* Runs IR_SCAN and IR_CLEAR lane by lane */
+static void scan(lockstep_t *ls, const ir_t *ir, unsigned int mask)
+{
+  uint32_t *cell;
+  int l;
+
+  for (l = 0; l < LANES; l++) {
+    if (!(mask >> l & 1)) {
+      continue;
+    }
+    for (;;) {
+      if (ls->ptr[l] < 0 || ls->ptr[l] >= ls->ncells) {
+        ls->live &= ~(1u << l);
+        break;
+      }
+      cell = &ls->tape[ls->ptr[l] * LANES + l];
+      if (*cell == 0) {
+        break;
+      }
+      if (ir->op == IR_CLEAR) {
+        *cell = 0;
+      }
+      ls->ptr[l] += ir->value;
+    }
+  }
+  update_uniform(ls);
+}
+
+static void input(lockstep_t *ls, long offset, unsigned int mask)
+{
+  stream_t *in;
+  uint32_t *cell;
+  int l;
+
+  for (l = 0; l < LANES; l++) {
+    in = &ls->in[l];
+    if ((mask >> l & 1) && in->pos < in->len) {
+      cell = &ls->tape[(ls->ptr[l] + offset) * LANES + l];
+      *cell = (*cell & ~0xffu) | in->data[in->pos++];
+    }
+  }
+}
+
+static void output(lockstep_t *ls, long offset, unsigned int mask)
+{
+  stream_t *out;
+  int l;
+
+  for (l = 0; l < LANES; l++) {
+    out = &ls->out[l];
+    if (!(mask >> l & 1)) {
+      continue;
+    }
+    if (out->len == out->size) {
+      out->size = out->size > 0 ? 2 * out->size : OUT_BUF_SIZE;
+      out->data = realloc(out->data, out->size);
+      if (out->data == NULL) {
+        error("Out of memory while buffering output");
+      }
+    }
+    out->data[out->len++] = ls->tape[(ls->ptr[l] + offset) * LANES + l];
+  }
+}
+
+/* Runs the operations from begin to end in the lanes of the mask */
+static void run(lockstep_t *ls, size_t begin, size_t end, unsigned int mask)
+{
+  const ir_t *ir;
+  const unsigned int entry = mask;
+  cells_t v = {0}, w = {0};
+  size_t i;
+
+  for (i = begin; i < end; i++) {
+    ir = &ls->prog->ops[i];
+    if ((mask &= ls->live) == 0) {
+      return;
+    }
+
+    switch (ir->op) {
+    case IR_ADD:
+      if ((mask = check_lanes(ls, ir->offset, mask)) != 0) {
+        load(ls, ir->offset, mask, &v);
+        v += (uint32_t)ir->value;
+        store(ls, ir->offset, &v, mask);
+      }
+      break;
+    case IR_SET:
+      if ((mask = check_lanes(ls, ir->offset, mask)) != 0) {
+        v = (cells_t){0} + (uint32_t)ir->value;
+        store(ls, ir->offset, &v, mask);
+      }
+      break;
+    case IR_MUL:
+      mask = check_lanes(ls, ir->offset, mask);
+      if ((mask = check_lanes(ls, ir->src, mask)) != 0) {
+        load(ls, ir->src, mask, &w);
+        load(ls, ir->offset, mask, &v);
+        v += w * (uint32_t)ir->value;
+        store(ls, ir->offset, &v, mask);
+      }
+      break;
+    case IR_MOVE:
+      move(ls, ir->value, mask);
+      break;
+    case IR_SCAN:
+    case IR_CLEAR:
+      scan(ls, ir, mask);
+      break;
+    case IR_IN:
+      if ((mask = check_lanes(ls, ir->offset, mask)) != 0) {
+        input(ls, ir->offset, mask);
+      }
+      break;
+    case IR_OUT:
+      if ((mask = check_lanes(ls, ir->offset, mask)) != 0) {
+        output(ls, ir->offset, mask);
+      }
+      break;
+    case IR_LOOP:
+      for (mask = nonzero(ls, 0, mask); mask != 0; mask = nonzero(ls, 0, mask)) {
+        run(ls, i + 1, ir->match, mask);
+      }
+      i = ir->match;
+      mask = entry;
+      break;
+    default:
+      error("The lockstep engine does not support unrolled loops");
+    }
+  }
+}
+
+/* Reads the input of a lane; returns 0 if it cannot be read */
+static int read_input(stream_t *in, const char *filename)
+{
+  FILE *file;
+  size_t n;
+
+  in->len = in->pos = 0;
+  file = fopen(filename, "rb");
+  if (file == NULL) {
+    return 0;
+  }
+  do {
+    if (in->len == in->size) {
+      in->size = in->size > 0 ? 2 * in->size : IN_BUF_SIZE;
+      in->data = realloc(in->data, in->size);
+      if (in->data == NULL) {
+        error("Out of memory while reading %s", filename);
+      }
+    }
+    n = fread(in->data + in->len, 1, in->size - in->len, file);
+    in->len += n;
+  } while (n > 0);
+  fclose(file);
+  return 1;
+}
+
+/* Writes the output of a lane to <input>.out; returns 0 on failure */
+static int write_output(const stream_t *out, const char *input)
+{
+  char *filename;
+  FILE *file;
+  int ok;
+
+  filename = malloc(strlen(input) + 5);
+  if (filename == NULL) {
+    error("Out of memory while naming the output of %s", input);
+  }
+  sprintf(filename, "%s.out", input);
+
+  file = fopen(filename, "wb");
+  ok = file != NULL && fwrite(out->data, 1, out->len, file) == out->len;
+  if (file != NULL && fclose(file) != 0) {
+    ok = 0;
+  }
+  if (!ok) {
+    fprintf(stderr, "bfc: Could not write file %s\n", filename);
+  }
+  free(filename);
+  return ok;
+}
+
+/*
+ * Runs the program over the inputs listed in the batch file of info,
+ * LANES inputs at a time, and writes the output of each input to
+ * <input>.out. Returns nonzero if all inputs ran to the end.
+ */
+int run_lockstep(const info_t *info)
+{
+  lockstep_t ls;
+  program_t prog;
+  FILE *src;
+  char **inputs;
+  size_t ninputs, first, n, i;
+  unsigned int mask;
+  int ok = 1;
+  int l;
+
+  src = fopen(info->in_filename, "r");
+  if (src == NULL) {
+    error("Could not read file %s", info->in_filename);
+  }
+  program_init(&prog);
+  parse(&prog, src);
+  fclose(src);
+  if (info->opt_level > 0) {
+    /* Unrolled loops would only make the lanes diverge sooner */
+    optimise(&prog, 1, NULL);
+  }
+
+  inputs = read_inputs(info->batch, &ninputs);
+
+  memset(&ls, 0, sizeof(ls));
+  ls.prog = &prog;
+  ls.ncells = info->cells_size / 4;
+  ls.tape = aligned_alloc(sizeof(cells_t), (ls.ncells > 0 ? ls.ncells : 1) * sizeof(cells_t));
+  if (ls.tape == NULL) {
+    error("Out of memory while allocating %d tapes", LANES);
+  }
+
+  for (first = 0; first < ninputs; first += n) {
+    n = ninputs - first < LANES ? ninputs - first : LANES;
+
+    memset(ls.tape, 0, ls.ncells * sizeof(cells_t));
+    mask = 0;
+    for (l = 0; l < (int)n; l++) {
+      ls.ptr[l] = 0;
+      ls.out[l].len = 0;
+      if (read_input(&ls.in[l], inputs[first + l])) {
+        mask |= 1u << l;
+      } else {
+        fprintf(stderr, "bfc: Could not read file %s\n", inputs[first + l]);
+        ok = 0;
+      }
+    }
+    ls.live = mask;
+    ls.uniform = 1;
+
+    run(&ls, 0, prog.len, mask);
+
+    for (l = 0; l < (int)n; l++) {
+      if (!(mask >> l & 1)) {
+        continue;
+      }
+      ok &= write_output(&ls.out[l], inputs[first + l]);
+      if (!(ls.live >> l & 1)) {
+        fprintf(stderr, "bfc: %s: pointer left the tape\n", inputs[first + l]);
+        ok = 0;
+      }
+    }
+  }
+
+  for (l = 0; l < LANES; l++) {
+    free(ls.in[l].data);
+    free(ls.out[l].data);
+  }
+  free(ls.tape);
+  for (i = 0; i < ninputs; i++) {
+    free(inputs[i]);
+  }
+  free(inputs);
+  program_free(&prog);
+
+  return ok;
+}
@@ -0,0 +1,101 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Selection of loops whose results are cached. A loop that reads no
+ * input, writes no output and leaves the pointer where it found it,
+ * with balanced inner loops and no scans, only touches a window of
+ * cells known at compile time. Its result is a function of the window
+ * on entry, so bf_memo_find can replace it by the window it left the
+ * last time it ran on the same contents, which bf_memo_save records.
+ * Since the pointer returns, the window is all the cache has to hold.
+ *
+ * With -fmemoise-loops, loops with inner loops are cached. Loops that a
+ * profile knows are cached if they were entered often and each entry ran
+ * many iterations of them and their inner loops.
+ */
+
+#include "bfc.h"
+
+#define MEMO_ENTRIES 16  /* Entries of a loop in a profile from which it is cached */
+#define MEMO_TRIPS   64  /* Iterations per entry from which a loop in a profile is cached */
+
+/*
+ * Checks whether the loop at prog->ops[loop] is worth caching. For loops
+ * that the profile knows, it decides by the iterations of the loop and
+ * its inner loops per entry; -fmemoise-loops caches other loops with
+ * inner loops.
+ */
+static int is_expensive(const program_t *prog, size_t loop, const info_t *info, int nested)
+{
+  const loop_count_t *count, *inner;
+  unsigned long iterations = 0;
+  size_t i;
+
+  count = find_loop_count(info->profile, prog->ops[loop].line, prog->ops[loop].column);
+  if (count == NULL) {
+    return info->memo_loops && nested;
+  }
+
+  for (i = loop; i < prog->ops[loop].match; i++) {
+    if (prog->ops[i].op == IR_LOOP || prog->ops[i].op == IR_COUNT) {
+      inner = find_loop_count(info->profile, prog->ops[i].line, prog->ops[i].column);
+      iterations += inner != NULL ? inner->iterations : 0;
+    }
+  }
+  return count->entries >= MEMO_ENTRIES && iterations >= MEMO_TRIPS * count->entries;
+}
+
+/*
+ * Returns the number of cells of the window of the loop at
+ * prog->ops[loop] and stores its first cell relative to the pointer in
+ * *lo, or returns zero if the loop is not cached
+ */
+size_t find_memo_window(const program_t *prog, size_t loop, const info_t *info, long *lo)
+{
+  long pos = 0, hi = 0;
+  size_t i;
+  int nested = 0;
+
+  if (!use_memo_loops(info)) {
+    return 0;
+  }
+
+  for (i = loop + 1; i < prog->ops[loop].match; i++) {
+    switch (prog->ops[i].op) {
+    case IR_IN:
+    case IR_OUT:
+    case IR_TRAP:
+      return 0;
+    case IR_LOOP:
+    case IR_COUNT:
+      nested = 1;
+      break;
+    default:
+      break;
+    }
+  }
+
+  *lo = 1;
+  if (!find_window(prog, loop, prog->ops[loop].match + 1, &pos, lo, &hi) ||
+      hi - *lo >= MEMO_CELLS || !is_expensive(prog, loop, info, nested)) {
+    return 0;
+  }
+  return (size_t)(hi - *lo + 1);
+}
@@ -0,0 +1,499 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Machine level peephole optimiser. The pass tracks what is known about
+ * the current cell (the DWORD at [edi]) and whether the zero flag
+ * reflects it. This removes compares whose result is already in the
+ * flags, resolves branches whose outcome is known (e.g. the entry test
+ * of a loop that directly follows the end of another loop), threads
+ * jumps through chains of such tests and deletes the code and labels
+ * that thereby become unreachable.
+ */
+
+#include <stdlib.h>
+
+#include "bfc.h"
+
+#define THREAD_LIMIT 64  /* Maximum number of instructions a jump is threaded through */
+
+enum cell_value
+{
+  CELL_UNKNOWN,
+  CELL_ZERO,
+  CELL_NONZERO
+};
+
+typedef struct state_t state_t;
+struct state_t
+{
+  int reached;           /* Instruction may be executed */
+  int flags;             /* Zero flag is set if and only if cell is zero */
+  enum cell_value cell;  /* Value of the current cell */
+};
+
+static const state_t unreached = { 0, 0, CELL_UNKNOWN };
+
+/* Checks whether the operand is the current cell */
+static int is_cell(operand_t opnd)
+{
+  return opnd.kind == OPND_MEM && opnd.reg == EDI && opnd.value == 0;
+}
+
+static int is_zero(operand_t opnd)
+{
+  return opnd.kind == OPND_IMM && opnd.value == 0;
+}
+
+/*
+ * Returns nonzero and stores the constant that the instruction adds to
+ * its destination in delta if the instruction is such an addition.
+ */
+static int constant_delta(const insn_t *insn, long *delta)
+{
+  switch (insn->op) {
+  case OP_INC:
+    *delta = 1;
+    return 1;
+  case OP_DEC:
+    *delta = -1;
+    return 1;
+  case OP_ADD:
+  case OP_SUB:
+    if (insn->src.kind != OPND_IMM) {
+      return 0;
+    }
+    *delta = insn->op == OP_ADD ? insn->src.value : -insn->src.value;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Accounts for a write to the destination other than the current cell */
+static void clobber(state_t *state, operand_t dst)
+{
+  if ((dst.kind == OPND_REG && dst.reg == EDI) ||
+      (dst.kind == OPND_MEM && dst.reg != EDI)) {
+    state->cell = CELL_UNKNOWN;
+    state->flags = 0;
+  }
+}
+
+/*
+ * Computes the state after the instruction on its fall through edge and
+ * on its branch edge. Edges that cannot be taken are marked unreached.
+ */
+static void transfer(const insn_t *insn, state_t in, state_t *fall, state_t *branch)
+{
+  state_t *zero, *nonzero;
+  long delta;
+
+  *fall = in;
+  *branch = unreached;
+
+  switch (insn->op) {
+  case OP_LABEL:
+  case OP_SYMBOL:
+    break;
+  case OP_ADD:
+  case OP_SUB:
+  case OP_INC:
+  case OP_DEC:
+    if (is_cell(insn->dst)) {
+      fall->flags = 1;
+      if (in.cell == CELL_ZERO && constant_delta(insn, &delta) && cell_value(delta) != 0) {
+        fall->cell = CELL_NONZERO;
+      } else {
+        fall->cell = CELL_UNKNOWN;
+      }
+    } else {
+      fall->flags = 0;
+      clobber(fall, insn->dst);
+    }
+    break;
+  case OP_MOV:
+    if (is_cell(insn->dst)) {
+      fall->flags = 0;
+      if (insn->src.kind == OPND_IMM) {
+        fall->cell = cell_value(insn->src.value) == 0 ? CELL_ZERO : CELL_NONZERO;
+      } else {
+        fall->cell = CELL_UNKNOWN;
+      }
+    } else {
+      clobber(fall, insn->dst);
+    }
+    break;
+  case OP_CMP:
+    fall->flags = is_cell(insn->dst) && is_zero(insn->src);
+    break;
+  case OP_TEST:
+    fall->flags = 0;
+    break;
+  case OP_JMP:
+    *branch = in;
+    *fall = unreached;
+    break;
+  case OP_JZ:
+  case OP_JNZ:
+    *branch = in;
+    if (!in.flags) {
+      break;
+    }
+    zero = insn->op == OP_JZ ? branch : fall;
+    nonzero = insn->op == OP_JZ ? fall : branch;
+    if (in.cell == CELL_NONZERO) {
+      *zero = unreached;
+    } else {
+      zero->cell = CELL_ZERO;
+    }
+    if (in.cell == CELL_ZERO) {
+      *nonzero = unreached;
+    } else {
+      nonzero->cell = CELL_NONZERO;
+    }
+    break;
+  default:
+    fall->flags = 0;
+    fall->cell = CELL_UNKNOWN;
+    break;
+  }
+}
+
+/* Merges state into the state at a join point; returns nonzero on change */
+static int merge(state_t *join, state_t state)
+{
+  state_t old = *join;
+
+  if (!state.reached) {
+    return 0;
+  }
+
+  if (!join->reached) {
+    *join = state;
+    return 1;
+  }
+
+  join->flags = join->flags && state.flags;
+  if (join->cell != state.cell) {
+    join->cell = CELL_UNKNOWN;
+  }
+
+  return join->flags != old.flags || join->cell != old.cell;
+}
+
+/* Computes the state before each instruction by iterating to a fixpoint */
+static void analyse(const code_t *code, const size_t *label_pos, state_t *states, int tape_zeroed)
+{
+  state_t fall, branch;
+  size_t i;
+  int changed;
+
+  for (i = 0; i <= code->len; i++) {
+    states[i] = unreached;
+  }
+  states[0].reached = 1;
+  states[0].cell = tape_zeroed ? CELL_ZERO : CELL_UNKNOWN;
+
+  do {
+    changed = 0;
+    for (i = 0; i < code->len; i++) {
+      if (!states[i].reached) {
+        continue;
+      }
+      transfer(&code->insns[i], states[i], &fall, &branch);
+      changed |= merge(&states[i + 1], fall);
+      if (branch.reached) {
+        changed |= merge(&states[label_pos[code->insns[i].dst.value]], branch);
+      }
+    }
+  } while (changed);
+}
+
+/*
+ * Follows the code at the label for as long as the outcome of every
+ * instruction on the way is known in the given state and returns the
+ * last label on that path, which the jump can go to directly.
+ */
+static size_t thread_jump(const code_t *code, const size_t *label_pos, size_t label, state_t state)
+{
+  const insn_t *insn;
+  size_t target = label;
+  size_t i = label_pos[label];
+  size_t steps;
+  int taken;
+
+  for (steps = 0; steps < THREAD_LIMIT && i < code->len; steps++) {
+    insn = &code->insns[i];
+    switch (insn->op) {
+    case OP_LABEL:
+    case OP_SYMBOL:
+      i++;
+      break;
+    case OP_CMP:
+      if (!state.flags || !is_cell(insn->dst) || !is_zero(insn->src)) {
+        return target;
+      }
+      i++;
+      break;
+    case OP_JMP:
+      target = insn->dst.value;
+      i = label_pos[target];
+      break;
+    case OP_JZ:
+    case OP_JNZ:
+      if (!state.flags || state.cell == CELL_UNKNOWN) {
+        return target;
+      }
+      taken = (state.cell == CELL_ZERO) == (insn->op == OP_JZ);
+      if (taken) {
+        target = insn->dst.value;
+        i = label_pos[target];
+      } else {
+        i++;
+      }
+      break;
+    default:
+      return target;
+    }
+  }
+
+  return target;
+}
+
+static int is_jump(enum opcode op)
+{
+  return op == OP_JMP || op == OP_JZ || op == OP_JNZ;
+}
+
+/* Checks whether the instruction sets the zero flag without reading it */
+static int sets_flags(enum opcode op)
+{
+  return op == OP_ADD || op == OP_SUB || op == OP_INC || op == OP_DEC ||
+         op == OP_CMP || op == OP_TEST;
+}
+
+/* Combines adjacent additions of constants to the same operand */
+static int fold_constants(code_t *code, char *dead)
+{
+  insn_t *insn;
+  long sum, delta;
+  size_t i, j;
+  int changed = 0;
+
+  for (i = 0; i < code->len; i = j) {
+    insn = &code->insns[i];
+    j = i + 1;
+    if (!constant_delta(insn, &sum) || insn->dst.kind == OPND_IMM) {
+      continue;
+    }
+
+    while (j < code->len && constant_delta(&code->insns[j], &delta) &&
+           same_operand(code->insns[j].dst, insn->dst)) {
+      sum = cell_value(sum + delta);
+      dead[j++] = 1;
+    }
+    if (j == i + 1) {
+      continue;
+    }
+
+    changed = 1;
+    if (sum == 0 && is_cell(insn->dst)) {
+      /* A later branch may rely on the flags that the run has set */
+      insn->op = OP_CMP;
+      insn->src = imm_operand(0);
+    } else if (sum == 0) {
+      dead[i] = 1;
+    } else if (sum == 1 || sum == -1) {
+      insn->op = sum == 1 ? OP_INC : OP_DEC;
+      insn->src = no_operand;
+    } else {
+      insn->op = sum > 0 ? OP_ADD : OP_SUB;
+      insn->src = imm_operand(sum > 0 ? sum : -sum);
+    }
+  }
+
+  return changed;
+}
+
+/*
+ * Deletes compares whose flags are set again before anything reads them.
+ * Moves in between do not read the flags; raw instructions may, such as
+ * the conditional jumps to run-time routines, so they end the search.
+ */
+static int remove_dead_compares(code_t *code, char *dead)
+{
+  size_t i, j;
+  int changed = 0;
+
+  for (i = 0; i + 1 < code->len; i++) {
+    if (code->insns[i].op != OP_CMP) {
+      continue;
+    }
+    for (j = i + 1; j < code->len && (code->insns[j].op == OP_MOV ||
+                                       code->insns[j].op == OP_SYMBOL); j++) {
+    }
+    if (j < code->len && sets_flags(code->insns[j].op)) {
+      dead[i] = 1;
+      changed = 1;
+    }
+  }
+
+  return changed;
+}
+
+/* Rewrites the instruction stream using the analysis; returns nonzero on change */
+static int simplify(code_t *code, const size_t *label_pos, const state_t *states, char *dead)
+{
+  insn_t *insn;
+  state_t fall, branch;
+  size_t i, j, target;
+  int changed = 0;
+
+  for (i = 0; i < code->len; i++) {
+    insn = &code->insns[i];
+
+    if (!states[i].reached) {
+      dead[i] = 1;
+      changed = 1;
+      continue;
+    }
+
+    switch (insn->op) {
+    case OP_CMP:
+      if (is_zero(insn->src)) {
+        if (states[i].flags && is_cell(insn->dst)) {
+          /* Flags were already set by an arithmetic operation or compare */
+          dead[i] = 1;
+          changed = 1;
+        } else if (insn->dst.kind == OPND_REG) {
+          insn->op = OP_TEST;
+          insn->src = insn->dst;
+          changed = 1;
+        }
+      }
+      break;
+    case OP_JZ:
+    case OP_JNZ:
+    case OP_JMP:
+      transfer(insn, states[i], &fall, &branch);
+      if (!branch.reached) {
+        dead[i] = 1;
+        changed = 1;
+        break;
+      }
+      if (insn->op != OP_JMP && !fall.reached) {
+        insn->op = OP_JMP;
+        changed = 1;
+      }
+      target = thread_jump(code, label_pos, insn->dst.value, branch);
+      if (target != (size_t)insn->dst.value) {
+        insn->dst = label_operand(target);
+        changed = 1;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  /* Jumps to the label that immediately follows are redundant */
+  for (i = 0; i < code->len; i++) {
+    if (dead[i] || !is_jump(code->insns[i].op)) {
+      continue;
+    }
+    target = label_pos[code->insns[i].dst.value];
+    for (j = i + 1; j < target && (dead[j] || code->insns[j].op == OP_LABEL ||
+                                   code->insns[j].op == OP_SYMBOL); j++)
+      ;
+    if (j == target) {
+      dead[i] = 1;
+      changed = 1;
+    }
+  }
+
+  return changed;
+}
+
+/* Deletes labels that no instruction refers to */
+static void remove_labels(code_t *code, char *dead)
+{
+  size_t *refs;
+  size_t i;
+
+  refs = calloc(code->nlabels, sizeof(*refs));
+  if (refs == NULL) {
+    error("Out of memory while removing labels");
+  }
+
+  for (i = 0; i < code->len; i++) {
+    if (is_jump(code->insns[i].op)) {
+      refs[code->insns[i].dst.value]++;
+    }
+  }
+
+  for (i = 0; i < code->len; i++) {
+    dead[i] = code->insns[i].op == OP_LABEL && refs[code->insns[i].dst.value] == 0;
+  }
+  remove_insns(code, dead);
+
+  free(refs);
+}
+
+/*
+ * Optimises the instruction stream in place. If tape_zeroed is nonzero
+ * the stream is assumed to start with all cells zero.
+ */
+void peephole(code_t *code, int tape_zeroed)
+{
+  state_t *states;
+  size_t *label_pos;
+  char *dead;
+  size_t i;
+  int changed;
+
+  do {
+    dead = calloc(code->len + 1, 1);
+    states = malloc((code->len + 1) * sizeof(*states));
+    label_pos = malloc(code->nlabels * sizeof(*label_pos));
+    if (dead == NULL || states == NULL || label_pos == NULL) {
+      error("Out of memory while optimising %zu instructions", code->len);
+    }
+
+    changed = fold_constants(code, dead);
+    remove_insns(code, dead);
+    changed |= remove_dead_compares(code, dead);
+    remove_insns(code, dead);
+
+    for (i = 0; i < code->len; i++) {
+      if (code->insns[i].op == OP_LABEL) {
+        label_pos[code->insns[i].dst.value] = i;
+      }
+    }
+
+    analyse(code, label_pos, states, tape_zeroed);
+    changed |= simplify(code, label_pos, states, dead);
+    remove_insns(code, dead);
+    remove_labels(code, dead);
+
+    free(label_pos);
+    free(states);
+    free(dead);
+  } while (changed);
+}
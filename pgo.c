@@ -0,0 +1,241 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Profile guided optimisation. Programs compiled with -fprofile-generate
+ * count how often each loop is entered and how often its body runs, and
+ * append the counts to the profile file on exit as lines of the form
+ *
+ *   <line>:<column> <entries> <iterations>
+ *
+ * which name the loop by the position of its '['. Compiling with
+ * -fprofile-use reads the file, adding up the counts of several runs.
+ */
+
+#include <stdlib.h>
+
+#include "bfc.h"
+
+#define HOT_SHARE 100      /* Hot loops run at least 1/HOT_SHARE of all iterations */
+#define PGO_BUF_SIZE 4096  /* Size of the buffer the profile is written from */
+
+static int compare_counts(const void *a, const void *b)
+{
+  const loop_count_t *x = a, *y = b;
+
+  if (x->line != y->line) {
+    return x->line < y->line ? -1 : 1;
+  }
+  return (x->column > y->column) - (x->column < y->column);
+}
+
+/* Reads the profile in filename, in which loops may appear repeatedly */
+void read_profile(profile_t *profile, const char *filename)
+{
+  loop_count_t count;
+  FILE *file;
+  size_t size = 64, i, j;
+
+  file = fopen(filename, "r");
+  if (file == NULL) {
+    error("Could not read profile %s", filename);
+  }
+
+  profile->len = 0;
+  profile->total = 0;
+  profile->loops = malloc(size * sizeof(*profile->loops));
+  if (profile->loops == NULL) {
+    error("Out of memory while reading profile %s", filename);
+  }
+
+  while (fscanf(file, "%u:%u %lu %lu", &count.line, &count.column,
+                &count.entries, &count.iterations) == 4) {
+    if (profile->len == size) {
+      size *= 2;
+      profile->loops = realloc(profile->loops, size * sizeof(*profile->loops));
+      if (profile->loops == NULL) {
+        error("Out of memory while reading profile %s", filename);
+      }
+    }
+    profile->loops[profile->len++] = count;
+    profile->total += count.iterations;
+  }
+  if (!feof(file)) {
+    error("Malformed profile %s", filename);
+  }
+  fclose(file);
+
+  /* Merge the counts of the runs */
+  qsort(profile->loops, profile->len, sizeof(*profile->loops), compare_counts);
+  for (i = j = 0; i < profile->len; i++) {
+    if (j > 0 && compare_counts(&profile->loops[j - 1], &profile->loops[i]) == 0) {
+      profile->loops[j - 1].entries += profile->loops[i].entries;
+      profile->loops[j - 1].iterations += profile->loops[i].iterations;
+    } else {
+      profile->loops[j++] = profile->loops[i];
+    }
+  }
+  profile->len = j;
+}
+
+void profile_free(profile_t *profile)
+{
+  free(profile->loops);
+}
+
+/*
+ * Returns the counts of the loop that starts at the source position, or
+ * NULL if there is no profile or it does not know the loop
+ */
+const loop_count_t *find_loop_count(const profile_t *profile, unsigned int line,
+                                    unsigned int column)
+{
+  loop_count_t key;
+
+  if (profile == NULL) {
+    return NULL;
+  }
+
+  key.line = line;
+  key.column = column;
+  return bsearch(&key, profile->loops, profile->len, sizeof(*profile->loops),
+                 compare_counts);
+}
+
+/* Checks whether the loop runs a noticeable share of all iterations */
+int is_hot_loop(const profile_t *profile, const loop_count_t *count)
+{
+  return count->iterations > 0 && count->iterations >= profile->total / HOT_SHARE;
+}
+
+/*
+ * Writes the counters of the loops and bf_pgo_write, which appends them
+ * to the profile file. The generated code counts the entries of loop n
+ * in the quad word at bf_pgo_counts + 16 * n and its iterations in the
+ * one after it, numbering the loops in program order. Instrumented
+ * programs are not unrolled, so all loops are IR_LOOP loops.
+ */
+void write_pgo_runtime(FILE *as, const program_t *prog, const char *filename)
+{
+  const ir_t *ir;
+  size_t nloops = 0, i;
+
+  fprintf(as, ".section .rodata\n");
+  fprintf(as, "bf_pgo_file:\n");
+  fprintf(as, "\t.asciz \"");
+  for (i = 0; filename[i] != '\0'; i++) {
+    if (filename[i] == '"' || filename[i] == '\\') {
+      fputc('\\', as);
+    }
+    fputc(filename[i], as);
+  }
+  fprintf(as, "\"\n");
+
+  /* The position of every loop, followed by a space */
+  fprintf(as, "\t.balign 8\n");
+  fprintf(as, "bf_pgo_names:\n");
+  for (i = 0; i < prog->len; i++) {
+    ir = &prog->ops[i];
+    if (ir->op == IR_LOOP) {
+      fprintf(as, "\t.long 1f + %zu, %d\n", 32 * nloops++,
+              snprintf(NULL, 0, "%u:%u ", ir->line, ir->column));
+    }
+  }
+  fprintf(as, "\t.balign 32\n");
+  fprintf(as, "1:\n");
+  for (i = 0; i < prog->len; i++) {
+    ir = &prog->ops[i];
+    if (ir->op == IR_LOOP) {
+      fprintf(as, "\t.ascii \"%u:%u \"\n", ir->line, ir->column);
+      fprintf(as, "\t.balign 32\n");
+    }
+  }
+
+  fprintf(as, ".section .bss\n");
+  fprintf(as, "\t.lcomm bf_pgo_counts, %zu\n", 16 * (nloops > 0 ? nloops : 1));
+  fprintf(as, "\t.lcomm bf_pgo_fd, 4\n");
+  fprintf(as, "\t.lcomm bf_pgo_buf, %d\n", PGO_BUF_SIZE);
+
+  fprintf(as, ".section .text\n");
+
+  /* sys_open(bf_pgo_file, O_WRONLY | O_CREAT | O_APPEND, 0644) */
+  fprintf(as, "bf_pgo_write:\n");
+  fprintf(as, "\tmov eax, 5\n");
+  fprintf(as, "\tmov ebx, OFFSET bf_pgo_file\n");
+  fprintf(as, "\tmov ecx, 0x441\n");
+  fprintf(as, "\tmov edx, 0644\n");
+  fprintf(as, "\tint 0x80\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjs 3f\n");
+  fprintf(as, "\tmov DWORD PTR bf_pgo_fd, eax\n");
+
+  /* Without loops the profile is just created */
+  if (nloops > 0) {
+    fprintf(as, "\tmov edi, OFFSET bf_pgo_buf\n");
+    fprintf(as, "\txor r12d, r12d\n");
+    fprintf(as, "1:\n");
+    fprintf(as, "\tmov esi, DWORD PTR bf_pgo_names[r12*8]\n");
+    fprintf(as, "\tmov ecx, DWORD PTR bf_pgo_names[r12*8+4]\n");
+    fprintf(as, "\trep movsb\n");
+    fprintf(as, "\tmov r13, r12\n");
+    fprintf(as, "\tshl r13d, 4\n");
+    fprintf(as, "\tmov rax, QWORD PTR bf_pgo_counts[r13]\n");
+    fprintf(as, "\txor ecx, ecx\n");
+    fprintf(as, "\tcall bf_format\n");
+    fprintf(as, "\tmov BYTE PTR [rdi], ' '\n");
+    fprintf(as, "\tinc edi\n");
+    fprintf(as, "\tmov rax, QWORD PTR bf_pgo_counts[r13+8]\n");
+    fprintf(as, "\txor ecx, ecx\n");
+    fprintf(as, "\tcall bf_format\n");
+    fprintf(as, "\tmov BYTE PTR [rdi], 10\n");
+    fprintf(as, "\tinc edi\n");
+    fprintf(as, "\tcmp edi, OFFSET bf_pgo_buf + %d\n", PGO_BUF_SIZE - 128);
+    fprintf(as, "\tjb 4f\n");
+    fprintf(as, "\tcall bf_pgo_flush\n");
+    fprintf(as, "4:\n");
+    fprintf(as, "\tinc r12d\n");
+    fprintf(as, "\tcmp r12d, %zu\n", nloops);
+    fprintf(as, "\tjb 1b\n");
+    fprintf(as, "\tcall bf_pgo_flush\n");
+  }
+  fprintf(as, "\tmov eax, 6\n");
+  fprintf(as, "\tmov ebx, DWORD PTR bf_pgo_fd\n");
+  fprintf(as, "\tint 0x80\n");
+  fprintf(as, "3:\n");
+  fprintf(as, "\tret\n");
+
+  /* Writes the buffer up to EDI to the profile file */
+  fprintf(as, "bf_pgo_flush:\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_pgo_buf\n");
+  fprintf(as, "\tmov edx, edi\n");
+  fprintf(as, "\tsub edx, ecx\n");
+  fprintf(as, "\tjz 2f\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\tmov eax, 4\n");
+  fprintf(as, "\tmov ebx, DWORD PTR bf_pgo_fd\n");
+  fprintf(as, "\tint 0x80\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjle 2f\n");
+  fprintf(as, "\tadd ecx, eax\n");
+  fprintf(as, "\tsub edx, eax\n");
+  fprintf(as, "\tjnz 1b\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\tmov edi, OFFSET bf_pgo_buf\n");
+  fprintf(as, "\tret\n");
+}
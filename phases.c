@@ -0,0 +1,183 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Splitting of programs into phases that can run concurrently. A phase
+ * is a run of top-level operations. Two phases are independent if the
+ * cells they touch lie far enough apart that not even the vector code
+ * of one reaches the cells of the other; the tape starts out the same
+ * for both, so neither can observe whether the other has run.
+ *
+ * The cells of a run of operations are only known if the pointer is:
+ * every loop must leave the pointer where it found it, and there must
+ * be no scans, which move it by an amount that depends on the tape.
+ * Programs that read input are not split, since the phases would have
+ * to share it.
+ */
+
+#include <stdlib.h>
+
+#include "bfc.h"
+
+#define PHASE_GAP (TAPE_GUARD / 4)  /* Cells between the cells of independent phases */
+
+/* Cells and operations of a run of top-level operations */
+typedef struct unit_t unit_t;
+struct unit_t
+{
+  size_t begin;            /* Index of the first operation */
+  long pos;                /* Pointer before the first operation */
+  long lo, hi;             /* Lowest and highest cell touched; lo > hi if none */
+  int loops;               /* Contains a loop */
+};
+
+/* Checks whether the cells of two units are too close to run concurrently */
+static int overlap(const unit_t *a, const unit_t *b)
+{
+  if (a->lo > a->hi || b->lo > b->hi) {
+    return 0;
+  }
+  return a->lo <= b->hi + PHASE_GAP && b->lo <= a->hi + PHASE_GAP;
+}
+
+/* Joins the units from first up to last into the first one */
+static size_t join(unit_t *units, size_t n, size_t first, size_t last)
+{
+  size_t i;
+
+  for (i = first + 1; i <= last; i++) {
+    if (units[i].lo <= units[i].hi) {
+      widen_window(&units[first].lo, &units[first].hi, units[i].lo);
+      widen_window(&units[first].lo, &units[first].hi, units[i].hi);
+    }
+    units[first].loops |= units[i].loops;
+  }
+  for (i = last + 1; i < n; i++) {
+    units[first + 1 + i - last - 1] = units[i];
+  }
+  return n - (last - first);
+}
+
+/*
+ * Divides the program into units at the boundaries of top-level loops
+ * and records the cells that each unit touches; returns the number of
+ * units, or zero if the pointer is not known throughout the program
+ */
+static size_t find_units(const program_t *prog, unit_t *units)
+{
+  const ir_t *ir;
+  size_t n = 0, i, end;
+  long pos = 0;
+  int loop;
+
+  for (i = 0; i < prog->len; i++) {
+    if (prog->ops[i].op == IR_IN) {
+      return 0;
+    }
+  }
+
+  for (i = 0; i < prog->len; i = end) {
+    ir = &prog->ops[i];
+    loop = ir->op == IR_LOOP || ir->op == IR_COUNT;
+    end = ir->op == IR_LOOP ? ir->match + 1 : i + 1;
+    while (ir->op == IR_COUNT && prog->ops[end - 1].op != IR_NEXT) {
+      end++;
+    }
+
+    /* Top-level loops and the runs between them start units */
+    if (n == 0 || loop || units[n - 1].loops) {
+      units[n].begin = i;
+      units[n].pos = pos;
+      units[n].lo = 1;
+      units[n].hi = 0;
+      units[n].loops = 0;
+      n++;
+    }
+
+    units[n - 1].loops |= loop;
+    if (!find_window(prog, i, end, &pos, &units[n - 1].lo, &units[n - 1].hi)) {
+      return 0;
+    }
+  }
+
+  return n;
+}
+
+/*
+ * Splits the program into at most PHASE_MAX independent phases, each of
+ * which contains a loop, and returns their number. The first phase
+ * starts at the first operation. Programs that cannot be split are one
+ * phase.
+ */
+size_t split_phases(const program_t *prog, phase_t *phases)
+{
+  unit_t *units;
+  size_t n, i, j;
+  int changed;
+
+  units = malloc((prog->len + 1) * sizeof(*units));
+  if (units == NULL) {
+    error("Out of memory while splitting the program into phases");
+  }
+
+  n = find_units(prog, units);
+  do {
+    changed = 0;
+
+    /* Dependent units run in program order, and so does everything between them */
+    for (i = 0; i < n; i++) {
+      for (j = n - 1; j > i; j--) {
+        if (overlap(&units[i], &units[j])) {
+          n = join(units, n, i, j);
+          changed = 1;
+          break;
+        }
+      }
+    }
+
+    /* Runs without loops are not worth a process of their own */
+    for (i = 0; i < n && n > 1; i++) {
+      if (!units[i].loops) {
+        n = i + 1 < n ? join(units, n, i, i + 1) : join(units, n, i - 1, i);
+        changed = 1;
+        break;
+      }
+    }
+
+    if (n > PHASE_MAX) {
+      for (i = 0; i + 1 < n; i++) {
+        n = join(units, n, i, i + 1);
+      }
+      changed = 1;
+    }
+  } while (changed);
+
+  for (i = 0; i < n; i++) {
+    phases[i].begin = units[i].begin;
+    phases[i].pos = units[i].pos;
+  }
+  free(units);
+
+  if (n == 0) {
+    phases[0].begin = 0;
+    phases[0].pos = 0;
+    n = 1;
+  }
+  return n;
+}
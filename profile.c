@@ -0,0 +1,442 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sampling profiler of compiled programs. A SIGPROF timer interrupts the
+ * program every SAMPLE_USEC microseconds of processor time, and the
+ * handler looks the interrupted address up in a table of the code
+ * regions that the region symbols start, counting a sample for the loop
+ * the region belongs to. On exit the program writes a flat profile of
+ * the samples in each loop and a profile of the samples in each loop
+ * including its inner loops, nested like the loops, to standard error.
+ *
+ * Entry 0 of the loop table is the code outside of all loops, entries 1
+ * to n are the loops in source order and entry n + 1 is the run-time
+ * code. The handler and the timer set up use the 64-bit system call
+ * interface, since signal frames follow the interface that installed
+ * the handler.
+ */
+
+#include <stdlib.h>
+
+#include "bfc.h"
+
+#define SECTION_REGIONS ".section .rodata.bf_prof_regions, \"a\""
+
+/*
+ * Returns an array with the loop table entry of every loop operation of
+ * the program and stores the number of loops in nloops.
+ */
+static size_t *number_loops(const program_t *prog, size_t *nloops)
+{
+  size_t *numbers;
+  size_t i;
+
+  numbers = malloc((prog->len + 1) * sizeof(*numbers));
+  if (numbers == NULL) {
+    error("Out of memory while numbering %zu operations", prog->len);
+  }
+
+  *nloops = 0;
+  for (i = 0; i < prog->len; i++) {
+    if (prog->ops[i].op == IR_LOOP || prog->ops[i].op == IR_COUNT) {
+      numbers[i] = ++*nloops;
+    }
+  }
+
+  return numbers;
+}
+
+/* Starts the table of code regions, which is sorted by address */
+void begin_sample_regions(FILE *as)
+{
+  fprintf(as, "%s\n", SECTION_REGIONS);
+  fprintf(as, "\t.balign 8\n");
+  fprintf(as, "bf_prof_regions:\n");
+  fprintf(as, ".section .text\n");
+}
+
+/*
+ * Adds the code regions of an instruction stream that has been written
+ * to the table, each as its address and the loop table entry it counts
+ * its samples for.
+ */
+void write_sample_regions(FILE *as, const code_t *code, const program_t *prog)
+{
+  const insn_t *insn;
+  size_t *numbers;
+  size_t nloops, entry, i;
+
+  numbers = number_loops(prog, &nloops);
+
+  fprintf(as, "%s\n", SECTION_REGIONS);
+  for (i = 0; i < code->len; i++) {
+    insn = &code->insns[i];
+    if (insn->op != OP_SYMBOL) {
+      continue;
+    }
+    if (insn->dst.value == REGION_MAIN) {
+      entry = 0;
+    } else if (insn->dst.value == REGION_RUNTIME) {
+      entry = nloops + 1;
+    } else {
+      entry = numbers[insn->dst.value];
+    }
+    fprintf(as, "\t.long %s, %zu\n", insn->text, entry);
+  }
+  fprintf(as, ".section .text\n");
+
+  free(numbers);
+}
+
+/* Writes the loop table with the parent, depth and name of every entry */
+static void write_loop_table(FILE *as, const program_t *prog, size_t nloops)
+{
+  const ir_t *ir, *end;
+  size_t *stack;
+  size_t top = 0, n = 0, i;
+
+  stack = malloc((nloops + 1) * sizeof(*stack));
+  if (stack == NULL) {
+    error("Out of memory while nesting %zu loops", nloops);
+  }
+
+  fprintf(as, ".section .rodata\n");
+  fprintf(as, "\t.balign 16\n");
+  fprintf(as, "bf_prof_loops:\n");
+  fprintf(as, "\t.long 0, 0, 1f, 4\n");
+  stack[top++] = 0;
+
+  for (i = 0; i < prog->len; i++) {
+    ir = &prog->ops[i];
+    if (ir->op == IR_END || ir->op == IR_NEXT) {
+      top--;
+      continue;
+    }
+    if (ir->op != IR_LOOP && ir->op != IR_COUNT) {
+      continue;
+    }
+    if (ir->op == IR_COUNT) {
+      for (end = ir; end->op != IR_NEXT; end++) {
+      }
+    } else {
+      end = &prog->ops[ir->match];
+    }
+    fprintf(as, "\t.long %zu, %zu, 1f + %zu, %d\n", stack[top - 1], top, 64 * ++n,
+            snprintf(NULL, 0, "loop %u:%u-%u:%u", ir->line, ir->column, end->line, end->column));
+    stack[top++] = n;
+  }
+  fprintf(as, "\t.long 0, 0, 2f, 3f - 2f\n");
+
+  /* Names are padded to 64 bytes, which fits the longest loop name */
+  fprintf(as, "\t.balign 64\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\t.ascii \"main\"\n");
+  fprintf(as, "\t.balign 64\n");
+  for (i = 0; i < prog->len; i++) {
+    ir = &prog->ops[i];
+    if (ir->op == IR_COUNT) {
+      for (end = ir; end->op != IR_NEXT; end++) {
+      }
+    } else if (ir->op == IR_LOOP) {
+      end = &prog->ops[ir->match];
+    } else {
+      continue;
+    }
+    fprintf(as, "\t.ascii \"loop %u:%u-%u:%u\"\n", ir->line, ir->column, end->line, end->column);
+    fprintf(as, "\t.balign 64\n");
+  }
+  fprintf(as, "2:\n");
+  fprintf(as, "\t.ascii \"runtime\"\n");
+  fprintf(as, "3:\n");
+
+  free(stack);
+}
+
+/*
+ * Writes the routines that format the report: bf_prof_pct writes the
+ * share of the samples in EAX as a percentage and bf_prof_line writes
+ * the line up to EDI to standard error. They clobber RAX, RBX, RCX, RDX,
+ * RSI and R8 and advance EDI.
+ */
+static void write_report_routines(FILE *as)
+{
+  /* Tenths of a percent are computed in 64 bits so that they cannot overflow */
+  fprintf(as, "bf_prof_pct:\n");
+  fprintf(as, "\tmov eax, eax\n");
+  fprintf(as, "\timul rax, rax, 1000\n");
+  fprintf(as, "\tmov ecx, DWORD PTR bf_prof_total\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\tdiv rcx\n");
+  fprintf(as, "\tmov ecx, 10\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\tdiv ecx\n");
+  fprintf(as, "\tmov DWORD PTR bf_prof_tenths, edx\n");
+  fprintf(as, "\tmov ecx, 5\n");
+  fprintf(as, "\tcall bf_format\n");
+  fprintf(as, "\tmov BYTE PTR [rdi], '.'\n");
+  fprintf(as, "\tmov eax, DWORD PTR bf_prof_tenths\n");
+  fprintf(as, "\tadd al, '0'\n");
+  fprintf(as, "\tmov BYTE PTR [rdi+1], al\n");
+  fprintf(as, "\tmov WORD PTR [rdi+2], 0x2025\n");
+  fprintf(as, "\tadd edi, 4\n");
+  fprintf(as, "\tret\n");
+
+  fprintf(as, "bf_prof_line:\n");
+  fprintf(as, "\tmov BYTE PTR [rdi], 10\n");
+  fprintf(as, "\tinc edi\n");
+  fprintf(as, "\tmov eax, 4\n");
+  fprintf(as, "\tmov ebx, 2\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_prof_buf\n");
+  fprintf(as, "\tmov edx, edi\n");
+  fprintf(as, "\tsub edx, ecx\n");
+  fprintf(as, "\tint 0x80\n");
+  fprintf(as, "\tmov edi, OFFSET bf_prof_buf\n");
+  fprintf(as, "\tret\n");
+
+  /*
+   * bf_prof_entry writes the line of the loop table entry in R12 with
+   * the samples in EAX, indented by R13 levels
+   */
+  fprintf(as, "bf_prof_entry:\n");
+  fprintf(as, "\tmov DWORD PTR bf_prof_count, eax\n");
+  fprintf(as, "\tmov ecx, 9\n");
+  fprintf(as, "\tcall bf_format\n");
+  fprintf(as, "\tmov eax, DWORD PTR bf_prof_count\n");
+  fprintf(as, "\tcall bf_prof_pct\n");
+  fprintf(as, "\tmov BYTE PTR [rdi], ' '\n");
+  fprintf(as, "\tinc edi\n");
+  fprintf(as, "\tlea ecx, [r13+r13]\n");
+  fprintf(as, "\tmov al, ' '\n");
+  fprintf(as, "\trep stosb\n");
+  fprintf(as, "\tmov rax, r12\n");
+  fprintf(as, "\tshl eax, 4\n");
+  fprintf(as, "\tmov esi, DWORD PTR bf_prof_loops[rax+8]\n");
+  fprintf(as, "\tmov ecx, DWORD PTR bf_prof_loops[rax+12]\n");
+  fprintf(as, "\trep movsb\n");
+  fprintf(as, "\tjmp bf_prof_line\n");
+}
+
+/*
+ * Writes bf_prof_report, which stops the timer and writes the profile.
+ * The flat profile lists the entries by their own samples, most first;
+ * the nested profile lists the loops in source order with the samples
+ * of their inner loops added.
+ */
+static void write_report(FILE *as, size_t nloops)
+{
+  const size_t n = nloops + 2;
+
+  fprintf(as, "bf_prof_report:\n");
+  fprintf(as, "\tmov eax, 38\n");
+  fprintf(as, "\tmov edi, 2\n");
+  fprintf(as, "\tmov esi, OFFSET bf_prof_stop\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\tsyscall\n");
+
+  /* Sum up the samples and the samples of every loop with its inner loops */
+  fprintf(as, "\txor ecx, ecx\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\tmov eax, DWORD PTR bf_prof_self[rcx*4]\n");
+  fprintf(as, "\tmov DWORD PTR bf_prof_incl[rcx*4], eax\n");
+  fprintf(as, "\tadd edx, eax\n");
+  fprintf(as, "\tinc ecx\n");
+  fprintf(as, "\tcmp ecx, %zu\n", n);
+  fprintf(as, "\tjb 1b\n");
+  fprintf(as, "\tmov DWORD PTR bf_prof_total, edx\n");
+  if (nloops > 0) {
+    fprintf(as, "\tmov ecx, %zu\n", nloops);
+    fprintf(as, "2:\n");
+    fprintf(as, "\tmov eax, ecx\n");
+    fprintf(as, "\tshl eax, 4\n");
+    fprintf(as, "\tmov edx, DWORD PTR bf_prof_loops[rax]\n");
+    fprintf(as, "\tmov eax, DWORD PTR bf_prof_incl[rcx*4]\n");
+    fprintf(as, "\tadd DWORD PTR bf_prof_incl[rdx*4], eax\n");
+    fprintf(as, "\tdec ecx\n");
+    fprintf(as, "\tjnz 2b\n");
+  }
+
+  fprintf(as, "\tmov edi, OFFSET bf_prof_buf\n");
+  fprintf(as, "\tmov esi, OFFSET bf_prof_head\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_prof_head_len\n");
+  fprintf(as, "\trep movsb\n");
+  fprintf(as, "\tmov eax, DWORD PTR bf_prof_total\n");
+  fprintf(as, "\txor ecx, ecx\n");
+  fprintf(as, "\tcall bf_format\n");
+  fprintf(as, "\tmov esi, OFFSET bf_prof_samples\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_prof_samples_len\n");
+  fprintf(as, "\trep movsb\n");
+  fprintf(as, "\tcall bf_prof_line\n");
+  fprintf(as, "\tcmp DWORD PTR bf_prof_total, 0\n");
+  fprintf(as, "\tje 9f\n");
+
+  /* Flat profile: take the entry with the most samples until none are left */
+  fprintf(as, "\tmov esi, OFFSET bf_prof_flat\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_prof_flat_len\n");
+  fprintf(as, "\trep movsb\n");
+  fprintf(as, "\tcall bf_prof_line\n");
+  fprintf(as, "\txor r13d, r13d\n");
+  fprintf(as, "3:\n");
+  fprintf(as, "\txor eax, eax\n");
+  fprintf(as, "\txor ecx, ecx\n");
+  fprintf(as, "4:\n");
+  fprintf(as, "\tcmp DWORD PTR bf_prof_self[rcx*4], eax\n");
+  fprintf(as, "\tjbe 5f\n");
+  fprintf(as, "\tmov eax, DWORD PTR bf_prof_self[rcx*4]\n");
+  fprintf(as, "\tmov r12d, ecx\n");
+  fprintf(as, "5:\n");
+  fprintf(as, "\tinc ecx\n");
+  fprintf(as, "\tcmp ecx, %zu\n", n);
+  fprintf(as, "\tjb 4b\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjz 6f\n");
+  fprintf(as, "\tmov DWORD PTR bf_prof_self[r12*4], 0\n");
+  fprintf(as, "\tcall bf_prof_entry\n");
+  fprintf(as, "\tjmp 3b\n");
+
+  /* Nested profile of the entries with samples in source order */
+  fprintf(as, "6:\n");
+  fprintf(as, "\tmov esi, OFFSET bf_prof_nested\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_prof_nested_len\n");
+  fprintf(as, "\trep movsb\n");
+  fprintf(as, "\tcall bf_prof_line\n");
+  fprintf(as, "\txor r12d, r12d\n");
+  fprintf(as, "7:\n");
+  fprintf(as, "\tmov eax, DWORD PTR bf_prof_incl[r12*4]\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjz 8f\n");
+  fprintf(as, "\tmov r13, r12\n");
+  fprintf(as, "\tshl r13d, 4\n");
+  fprintf(as, "\tmov r13d, DWORD PTR bf_prof_loops[r13+4]\n");
+  fprintf(as, "\tcall bf_prof_entry\n");
+  fprintf(as, "8:\n");
+  fprintf(as, "\tinc r12d\n");
+  fprintf(as, "\tcmp r12d, %zu\n", n);
+  fprintf(as, "\tjb 7b\n");
+  fprintf(as, "9:\n");
+  fprintf(as, "\tret\n");
+
+  write_report_routines(as);
+
+  fprintf(as, ".section .rodata\n");
+  fprintf(as, "bf_prof_head:\n");
+  fprintf(as, "\t.ascii \"\\nProfile: \"\n");
+  fprintf(as, "\t.set bf_prof_head_len, . - bf_prof_head\n");
+  fprintf(as, "bf_prof_samples:\n");
+  fprintf(as, "\t.ascii \" samples every %d us\"\n", SAMPLE_USEC);
+  fprintf(as, "\t.set bf_prof_samples_len, . - bf_prof_samples\n");
+  fprintf(as, "bf_prof_flat:\n");
+  fprintf(as, "\t.ascii \"\\n  samples       %%  self\"\n");
+  fprintf(as, "\t.set bf_prof_flat_len, . - bf_prof_flat\n");
+  fprintf(as, "bf_prof_nested:\n");
+  fprintf(as, "\t.ascii \"\\n  samples       %%  total\"\n");
+  fprintf(as, "\t.set bf_prof_nested_len, . - bf_prof_nested\n");
+  fprintf(as, ".section .text\n");
+}
+
+/*
+ * Writes the data and the routines of the profiler: bf_prof_start, which
+ * installs the handler and starts the timer, the handler and
+ * bf_prof_report. The region table must have been written.
+ */
+void write_profiler(FILE *as, const program_t *prog)
+{
+  size_t nloops;
+
+  free(number_loops(prog, &nloops));
+
+  /* Addresses before the first region and after the last are run-time code */
+  fprintf(as, "%s\n", SECTION_REGIONS);
+  fprintf(as, "\t.long bf_flush, %zu\n", nloops + 1);
+  fprintf(as, "bf_prof_regions_end:\n");
+  fprintf(as, "\t.set bf_prof_nregions, (bf_prof_regions_end - bf_prof_regions) / 8\n");
+
+  write_loop_table(as, prog, nloops);
+
+  fprintf(as, ".section .data\n");
+  fprintf(as, "\t.balign 8\n");
+  /* struct sigaction with SA_SIGINFO, SA_RESTART and SA_RESTORER */
+  fprintf(as, "bf_prof_action:\n");
+  fprintf(as, "\t.quad bf_prof_handler, 0x14000004, bf_prof_restorer, 0\n");
+  /* struct itimerval */
+  fprintf(as, "bf_prof_timer:\n");
+  fprintf(as, "\t.quad 0, %d, 0, %d\n", SAMPLE_USEC, SAMPLE_USEC);
+
+  fprintf(as, ".section .bss\n");
+  fprintf(as, "\t.lcomm bf_prof_self, %zu\n", 4 * (nloops + 2));
+  fprintf(as, "\t.lcomm bf_prof_incl, %zu\n", 4 * (nloops + 2));
+  fprintf(as, "\t.lcomm bf_prof_stop, 32\n");
+  fprintf(as, "\t.lcomm bf_prof_total, 4\n");
+  fprintf(as, "\t.lcomm bf_prof_count, 4\n");
+  fprintf(as, "\t.lcomm bf_prof_tenths, 4\n");
+  fprintf(as, "\t.lcomm bf_prof_buf, 128\n");
+
+  fprintf(as, ".section .text\n");
+
+  /* rt_sigaction(SIGPROF, &bf_prof_action, NULL, 8), setitimer(ITIMER_PROF, ...) */
+  fprintf(as, "bf_prof_start:\n");
+  fprintf(as, "\tmov eax, 13\n");
+  fprintf(as, "\tmov edi, 27\n");
+  fprintf(as, "\tmov esi, OFFSET bf_prof_action\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\tmov r10d, 8\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tmov eax, 38\n");
+  fprintf(as, "\tmov edi, 2\n");
+  fprintf(as, "\tmov esi, OFFSET bf_prof_timer\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tret\n");
+
+  /*
+   * The handler finds the last region that starts at or below the
+   * interrupted RIP, which is in the ucontext at RDX, by binary search
+   */
+  fprintf(as, "bf_prof_handler:\n");
+  fprintf(as, "\tmov rax, QWORD PTR [rdx+168]\n");
+  fprintf(as, "\txor ecx, ecx\n");
+  fprintf(as, "\tmov edx, OFFSET bf_prof_nregions\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\tcmp ecx, edx\n");
+  fprintf(as, "\tjae 3f\n");
+  fprintf(as, "\tlea r8d, [rcx+rdx]\n");
+  fprintf(as, "\tshr r8d, 1\n");
+  fprintf(as, "\tcmp eax, DWORD PTR bf_prof_regions[r8*8]\n");
+  fprintf(as, "\tjb 2f\n");
+  fprintf(as, "\tlea ecx, [r8+1]\n");
+  fprintf(as, "\tjmp 1b\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\tmov edx, r8d\n");
+  fprintf(as, "\tjmp 1b\n");
+  fprintf(as, "3:\n");
+  fprintf(as, "\tmov eax, %zu\n", nloops + 1);
+  fprintf(as, "\ttest ecx, ecx\n");
+  fprintf(as, "\tjz 4f\n");
+  fprintf(as, "\tmov eax, DWORD PTR bf_prof_regions[rcx*8-4]\n");
+  fprintf(as, "4:\n");
+  fprintf(as, "\tinc DWORD PTR bf_prof_self[rax*4]\n");
+  fprintf(as, "\tret\n");
+
+  fprintf(as, "bf_prof_restorer:\n");
+  fprintf(as, "\tmov eax, 15\n");
+  fprintf(as, "\tsyscall\n");
+
+  write_report(as, nloops);
+}
@@ -0,0 +1,1104 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Run-time support routines of compiled programs. Output bytes are
+ * stored at ESI into bf_out_buf and written when the buffer is full,
+ * before input is read and on exit. Input is read a buffer at a time.
+ * The routines clobber EAX, EBX, ECX and EDX only, except for
+ * bf_cpu_features, which runs before the registers are set up, and the
+ * routines that run on exit.
+ */
+
+#include "bfc.h"
+
+/*
+ * Writes bf_cpu_features, which returns the FEATURE_* mask of the
+ * processor in EAX. The vector extensions are only reported if the
+ * operating system saves the registers they use, as XCR0 tells.
+ */
+static void write_cpu_features(FILE *as)
+{
+  fprintf(as, "bf_cpu_features:\n");
+  fprintf(as, "\txor esi, esi\n");
+  fprintf(as, "\txor eax, eax\n");
+  fprintf(as, "\tcpuid\n");
+  fprintf(as, "\tmov edi, eax\n");
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\txor ecx, ecx\n");
+  fprintf(as, "\tcpuid\n");
+  fprintf(as, "\tmov ebp, ecx\n");
+  fprintf(as, "\ttest edx, 0x4000000\n");
+  fprintf(as, "\tjz 9f\n");
+  fprintf(as, "\tor esi, %d\n", FEATURE_SSE2);
+  fprintf(as, "\ttest ebp, 0x80000\n");
+  fprintf(as, "\tjz 1f\n");
+  fprintf(as, "\tor esi, %d\n", FEATURE_SSE4_1);
+  fprintf(as, "1:\n");
+
+  /* Leaf 7 reports BMI, BMI2, AVX2 and AVX-512 */
+  fprintf(as, "\tcmp edi, 7\n");
+  fprintf(as, "\tjb 9f\n");
+  fprintf(as, "\tmov eax, 7\n");
+  fprintf(as, "\txor ecx, ecx\n");
+  fprintf(as, "\tcpuid\n");
+  fprintf(as, "\tmov edi, ebx\n");
+  fprintf(as, "\ttest edi, 0x8\n");
+  fprintf(as, "\tjz 2f\n");
+  fprintf(as, "\tor esi, %d\n", FEATURE_BMI);
+  fprintf(as, "\ttest edi, 0x100\n");
+  fprintf(as, "\tjz 2f\n");
+  fprintf(as, "\tor esi, %d\n", FEATURE_BMI2);
+  fprintf(as, "2:\n");
+
+  /* AVX2 requires OSXSAVE and AVX as well as saved XMM and YMM state */
+  fprintf(as, "\ttest esi, %d\n", FEATURE_SSE4_1);
+  fprintf(as, "\tjz 9f\n");
+  fprintf(as, "\tmov eax, ebp\n");
+  fprintf(as, "\tand eax, 0x18000000\n");
+  fprintf(as, "\tcmp eax, 0x18000000\n");
+  fprintf(as, "\tjne 9f\n");
+  fprintf(as, "\txor ecx, ecx\n");
+  fprintf(as, "\txgetbv\n");
+  fprintf(as, "\tmov ecx, eax\n");
+  fprintf(as, "\tand ecx, 0x6\n");
+  fprintf(as, "\tcmp ecx, 0x6\n");
+  fprintf(as, "\tjne 9f\n");
+  fprintf(as, "\ttest edi, 0x20\n");
+  fprintf(as, "\tjz 9f\n");
+  fprintf(as, "\tor esi, %d\n", FEATURE_AVX2);
+
+  /* AVX-512 additionally requires saved opmask and ZMM state */
+  fprintf(as, "\tand eax, 0xe6\n");
+  fprintf(as, "\tcmp eax, 0xe6\n");
+  fprintf(as, "\tjne 9f\n");
+  fprintf(as, "\ttest edi, 0x10000\n");
+  fprintf(as, "\tjz 9f\n");
+  fprintf(as, "\tor esi, %d\n", FEATURE_AVX512F);
+  fprintf(as, "9:\n");
+  fprintf(as, "\tmov eax, esi\n");
+  fprintf(as, "\tret\n");
+}
+
+/*
+ * Writes bf_format, which writes RAX in decimal at EDI, right aligned to
+ * ECX characters, and advances EDI. It clobbers RAX, RCX, RDX, RSI and R8.
+ */
+static void write_format(FILE *as)
+{
+  fprintf(as, "bf_format:\n");
+  fprintf(as, "\tmov r8d, OFFSET bf_digits + 24\n");
+  fprintf(as, "\tmov esi, 10\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\tdiv rsi\n");
+  fprintf(as, "\tadd dl, '0'\n");
+  fprintf(as, "\tdec r8d\n");
+  fprintf(as, "\tmov BYTE PTR [r8], dl\n");
+  fprintf(as, "\tdec ecx\n");
+  fprintf(as, "\ttest rax, rax\n");
+  fprintf(as, "\tjnz 1b\n");
+  fprintf(as, "\tjmp 3f\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\tmov BYTE PTR [rdi], ' '\n");
+  fprintf(as, "\tinc edi\n");
+  fprintf(as, "\tdec ecx\n");
+  fprintf(as, "3:\n");
+  fprintf(as, "\ttest ecx, ecx\n");
+  fprintf(as, "\tjg 2b\n");
+  fprintf(as, "\tmov esi, r8d\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_digits + 24\n");
+  fprintf(as, "\tsub ecx, esi\n");
+  fprintf(as, "\trep movsb\n");
+  fprintf(as, "\tret\n");
+}
+
+/* Writes calls of the routines that report on the run when it ends */
+static void write_reports(FILE *as, const info_t *info)
+{
+  if (info->sample) {
+    fprintf(as, "\tcall bf_prof_report\n");
+  }
+  if (info->profile_generate != NULL) {
+    fprintf(as, "\tcall bf_pgo_write\n");
+  }
+}
+
+/* Returns the steps the program may run before the first step event */
+unsigned long first_steps(const info_t *info)
+{
+  if (info->checkpoint_steps != 0 && info->checkpoint_steps < info->step_budget) {
+    return info->checkpoint_steps;
+  }
+  return info->step_budget;
+}
+
+/*
+ * Writes the routines of the step counter. The code counts the steps
+ * left down in R15 from the budget and jumps to bf_step_limit once it
+ * is negative, which ends the program with STEP_EXIT. bf_step_total
+ * writes the number of steps to standard error.
+ */
+static void write_step_counter(FILE *as, const info_t *info)
+{
+  /*
+   * With checkpoints every n steps, R15 counts down to the next one and
+   * bf_step_rest holds the steps of the budget after it. The code calls
+   * bf_step_limit, which takes the checkpoint and returns while the
+   * budget lasts.
+   */
+  if (info->checkpoint_steps != 0) {
+    fprintf(as, "bf_step_limit:\n");
+    fprintf(as, "\tmov rax, QWORD PTR bf_step_rest\n");
+    fprintf(as, "\ttest rax, rax\n");
+    fprintf(as, "\tjz 1f\n");
+    fprintf(as, "\tmov rcx, %lu\n", info->checkpoint_steps);
+    fprintf(as, "\tcmp rax, rcx\n");
+    fprintf(as, "\tcmovb rcx, rax\n");
+    fprintf(as, "\tsub rax, rcx\n");
+    fprintf(as, "\tmov QWORD PTR bf_step_rest, rax\n");
+    fprintf(as, "\tadd r15, rcx\n");
+    fprintf(as, "\tjmp bf_ckpt_now\n");
+    fprintf(as, "1:\n");
+  } else {
+    fprintf(as, "bf_step_limit:\n");
+  }
+  fprintf(as, "\tcall bf_flush\n");
+  fprintf(as, "\tmov esi, OFFSET bf_step_limit_text\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_step_limit_len\n");
+  fprintf(as, "\tcall bf_step_report\n");
+  write_reports(as, info);
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\tmov ebx, %d\n", STEP_EXIT);
+  fprintf(as, "\tint 0x80\n");
+
+  fprintf(as, "bf_step_total:\n");
+  fprintf(as, "\tmov esi, OFFSET bf_step_total_text\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_step_total_len\n");
+
+  /* Writes the text at ESI of length ECX, the number of steps and a newline */
+  fprintf(as, "bf_step_report:\n");
+  fprintf(as, "\tmov edi, OFFSET bf_step_buf\n");
+  fprintf(as, "\trep movsb\n");
+  fprintf(as, "\tmov rax, %lu\n", info->step_budget);
+  fprintf(as, "\tsub rax, r15\n");
+  if (info->checkpoint_steps != 0) {
+    fprintf(as, "\tsub rax, QWORD PTR bf_step_rest\n");
+  }
+  fprintf(as, "\txor ecx, ecx\n");
+  fprintf(as, "\tcall bf_format\n");
+  fprintf(as, "\tmov BYTE PTR [rdi], 10\n");
+  fprintf(as, "\tinc edi\n");
+  fprintf(as, "\tmov eax, 4\n");
+  fprintf(as, "\tmov ebx, 2\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_step_buf\n");
+  fprintf(as, "\tmov edx, edi\n");
+  fprintf(as, "\tsub edx, ecx\n");
+  fprintf(as, "\tint 0x80\n");
+  fprintf(as, "\tret\n");
+
+  fprintf(as, ".section .rodata\n");
+  fprintf(as, "bf_step_total_text:\n");
+  fprintf(as, "\t.ascii \"\\nSteps: \"\n");
+  fprintf(as, "\t.set bf_step_total_len, . - bf_step_total_text\n");
+  fprintf(as, "bf_step_limit_text:\n");
+  fprintf(as, "\t.ascii \"\\nStep budget exceeded; steps: \"\n");
+  fprintf(as, "\t.set bf_step_limit_len, . - bf_step_limit_text\n");
+  if (info->checkpoint_steps != 0) {
+    fprintf(as, ".section .data\n");
+    fprintf(as, "\t.balign 8\n");
+    fprintf(as, "bf_step_rest:\n");
+    fprintf(as, "\t.quad %lu\n", info->step_budget - first_steps(info));
+  }
+  fprintf(as, ".section .bss\n");
+  fprintf(as, "\t.lcomm bf_step_buf, 64\n");
+  fprintf(as, ".section .text\n");
+}
+
+/*
+ * Writes the routines that enforce the limits of processor time, real
+ * time and memory. bf_limit_start sets them up: RLIMIT_CPU raises
+ * SIGXCPU and ITIMER_REAL raises SIGALRM when the time is up, and
+ * RLIMIT_AS caps the address space. The handlers flush the output and
+ * end the program with CPU_LIMIT_EXIT or TIME_LIMIT_EXIT.
+ *
+ * A signal that arrives while bf_flush or bf_refill runs would see the
+ * output buffer in an inconsistent state, so the handler only sets
+ * bf_limit_hit, which the routines check before they return, and
+ * checks again a millisecond later. The handlers are installed without
+ * SA_RESTART so that a blocking read returns to bf_refill.
+ */
+static void write_limits(FILE *as, const info_t *info)
+{
+  fprintf(as, "bf_limit_start:\n");
+  if (info->cpu_limit != 0) {
+    /* setrlimit(RLIMIT_CPU); the hard limit leaves time for the handler */
+    fprintf(as, "\tmov eax, 160\n");
+    fprintf(as, "\tmov edi, 0\n");
+    fprintf(as, "\tmov esi, OFFSET bf_limit_cpu\n");
+    fprintf(as, "\tsyscall\n");
+    fprintf(as, "\tmov eax, 13\n");
+    fprintf(as, "\tmov edi, 24\n");
+    fprintf(as, "\tmov esi, OFFSET bf_limit_cpu_action\n");
+    fprintf(as, "\txor edx, edx\n");
+    fprintf(as, "\tmov r10d, 8\n");
+    fprintf(as, "\tsyscall\n");
+  }
+  if (info->memory_limit != 0) {
+    fprintf(as, "\tmov eax, 160\n");
+    fprintf(as, "\tmov edi, 9\n");
+    fprintf(as, "\tmov esi, OFFSET bf_limit_memory\n");
+    fprintf(as, "\tsyscall\n");
+  }
+  if (info->cpu_limit != 0 || info->time_limit != 0) {
+    fprintf(as, "\tmov eax, 13\n");
+    fprintf(as, "\tmov edi, 14\n");
+    fprintf(as, "\tmov esi, OFFSET bf_limit_time_action\n");
+    fprintf(as, "\txor edx, edx\n");
+    fprintf(as, "\tmov r10d, 8\n");
+    fprintf(as, "\tsyscall\n");
+  }
+  if (info->time_limit != 0) {
+    fprintf(as, "\tmov eax, 38\n");
+    fprintf(as, "\tmov edi, 0\n");
+    fprintf(as, "\tmov esi, OFFSET bf_limit_time\n");
+    fprintf(as, "\txor edx, edx\n");
+    fprintf(as, "\tsyscall\n");
+  }
+  fprintf(as, "\tret\n");
+
+  if (info->cpu_limit == 0 && info->time_limit == 0) {
+    fprintf(as, ".section .data\n");
+    fprintf(as, "\t.balign 8\n");
+    fprintf(as, "bf_limit_memory:\n");
+    fprintf(as, "\t.quad %lu, %lu\n", info->memory_limit, info->memory_limit);
+    fprintf(as, ".section .text\n");
+    return;
+  }
+
+  /* The handlers pass the exit status and the message in R8, R9 and R10 */
+  fprintf(as, "bf_limit_cpu_handler:\n");
+  fprintf(as, "\tmov r8d, %d\n", CPU_LIMIT_EXIT);
+  fprintf(as, "\tmov r9d, OFFSET bf_limit_cpu_text\n");
+  fprintf(as, "\tmov r10d, OFFSET bf_limit_cpu_len\n");
+  fprintf(as, "\tjmp 1f\n");
+  fprintf(as, "bf_limit_time_handler:\n");
+  fprintf(as, "\tmov r8d, %d\n", TIME_LIMIT_EXIT);
+  fprintf(as, "\tmov r9d, OFFSET bf_limit_time_text\n");
+  fprintf(as, "\tmov r10d, OFFSET bf_limit_time_len\n");
+  fprintf(as, "1:\n");
+
+  /* The first limit that is hit is reported */
+  fprintf(as, "\tcmp DWORD PTR bf_limit_status, 0\n");
+  fprintf(as, "\tjne 2f\n");
+  fprintf(as, "\tmov DWORD PTR bf_limit_status, r8d\n");
+  fprintf(as, "\tmov DWORD PTR bf_limit_text, r9d\n");
+  fprintf(as, "\tmov DWORD PTR bf_limit_len, r10d\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\tmov rax, QWORD PTR [rdx+168]\n");
+  fprintf(as, "\tcmp rax, OFFSET bf_flush\n");
+  fprintf(as, "\tjb 3f\n");
+  fprintf(as, "\tcmp rax, OFFSET bf_io_end\n");
+  fprintf(as, "\tjae 3f\n");
+  fprintf(as, "\tmov BYTE PTR bf_limit_hit, 1\n");
+  fprintf(as, "\tmov eax, 38\n");
+  fprintf(as, "\tmov edi, 0\n");
+  fprintf(as, "\tmov esi, OFFSET bf_limit_retry\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tret\n");
+
+  /* Otherwise take the output pointer from the interrupted code and end */
+  fprintf(as, "3:\n");
+  fprintf(as, "\tmov esi, DWORD PTR [rdx+112]\n");
+  fprintf(as, "bf_limit_exit:\n");
+  /* Block all signals so that the retry timer cannot interrupt the exit */
+  fprintf(as, "\tpush rsi\n");
+  fprintf(as, "\tmov eax, 14\n");
+  fprintf(as, "\tmov edi, 0\n");
+  fprintf(as, "\tmov esi, OFFSET bf_limit_mask\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\tmov r10d, 8\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tpop rsi\n");
+  fprintf(as, "\tmov BYTE PTR bf_limit_hit, 0\n");
+  fprintf(as, "\tcall bf_flush\n");
+  fprintf(as, "\tmov eax, 4\n");
+  fprintf(as, "\tmov ebx, 2\n");
+  fprintf(as, "\tmov ecx, DWORD PTR bf_limit_text\n");
+  fprintf(as, "\tmov edx, DWORD PTR bf_limit_len\n");
+  fprintf(as, "\tint 0x80\n");
+  if (info->count_steps) {
+    fprintf(as, "\tcall bf_step_total\n");
+  }
+  write_reports(as, info);
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\tmov ebx, DWORD PTR bf_limit_status\n");
+  fprintf(as, "\tint 0x80\n");
+
+  fprintf(as, "bf_limit_restorer:\n");
+  fprintf(as, "\tmov eax, 15\n");
+  fprintf(as, "\tsyscall\n");
+
+  fprintf(as, ".section .rodata\n");
+  fprintf(as, "bf_limit_cpu_text:\n");
+  fprintf(as, "\t.ascii \"\\nProcessor time limit exceeded\\n\"\n");
+  fprintf(as, "\t.set bf_limit_cpu_len, . - bf_limit_cpu_text\n");
+  fprintf(as, "bf_limit_time_text:\n");
+  fprintf(as, "\t.ascii \"\\nTime limit exceeded\\n\"\n");
+  fprintf(as, "\t.set bf_limit_time_len, . - bf_limit_time_text\n");
+
+  /* struct sigaction with SA_SIGINFO and SA_RESTORER, struct rlimit, struct itimerval */
+  fprintf(as, ".section .data\n");
+  fprintf(as, "\t.balign 8\n");
+  fprintf(as, "bf_limit_cpu_action:\n");
+  fprintf(as, "\t.quad bf_limit_cpu_handler, 0x04000004, bf_limit_restorer, 0\n");
+  fprintf(as, "bf_limit_time_action:\n");
+  fprintf(as, "\t.quad bf_limit_time_handler, 0x04000004, bf_limit_restorer, 0\n");
+  fprintf(as, "bf_limit_cpu:\n");
+  fprintf(as, "\t.quad %lu, %lu\n", info->cpu_limit, info->cpu_limit + 2);
+  fprintf(as, "bf_limit_memory:\n");
+  fprintf(as, "\t.quad %lu, %lu\n", info->memory_limit, info->memory_limit);
+  fprintf(as, "bf_limit_time:\n");
+  fprintf(as, "\t.quad 0, 0, %lu, 0\n", info->time_limit);
+  fprintf(as, "bf_limit_retry:\n");
+  fprintf(as, "\t.quad 0, 0, 0, 1000\n");
+  fprintf(as, "bf_limit_mask:\n");
+  fprintf(as, "\t.quad -1\n");
+
+  fprintf(as, ".section .bss\n");
+  fprintf(as, "\t.lcomm bf_limit_status, 4\n");
+  fprintf(as, "\t.lcomm bf_limit_text, 4\n");
+  fprintf(as, "\t.lcomm bf_limit_len, 4\n");
+  fprintf(as, "\t.lcomm bf_limit_hit, 1\n");
+  fprintf(as, ".section .text\n");
+}
+
+/* Writes the string s followed by suffix as an .asciz directive */
+void write_asciz(FILE *as, const char *s, const char *suffix)
+{
+  size_t i;
+
+  fprintf(as, "\t.asciz \"");
+  for (i = 0; s[i] != '\0'; i++) {
+    if (s[i] == '"' || s[i] == '\\') {
+      fputc('\\', as);
+    }
+    fputc(s[i], as);
+  }
+  fprintf(as, "%s\"\n", suffix);
+}
+
+/* Writes a routine that writes the message to standard error and exits with status 1 */
+static void write_fatal(FILE *as, const char *name, const char *msg, const char *filename)
+{
+  fprintf(as, ".section .rodata\n");
+  fprintf(as, "%s_text:\n", name);
+  fprintf(as, "\t.ascii \"%s\"\n", msg);
+  write_asciz(as, filename, "\\n");
+  fprintf(as, "\t.set %s_len, . - %s_text - 1\n", name, name);
+  fprintf(as, ".section .text\n");
+  fprintf(as, "%s:\n", name);
+  fprintf(as, "\tmov eax, 4\n");
+  fprintf(as, "\tmov ebx, 2\n");
+  fprintf(as, "\tmov ecx, OFFSET %s_text\n", name);
+  fprintf(as, "\tmov edx, OFFSET %s_len\n", name);
+  fprintf(as, "\tint 0x80\n");
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\tmov ebx, 1\n");
+  fprintf(as, "\tint 0x80\n");
+}
+
+/*
+ * Writes bf_tape_map, which maps the tape of sparse tape programs and
+ * stores its address in bf_tape. The mapping reserves no swap and the
+ * kernel backs its pages when they are first touched, so resident
+ * memory follows the touched cells. Transparent huge pages would back
+ * every touched cell with 2 MiB, so they are turned off for the tape.
+ *
+ * The tape starts on a page between two guard pages, so that a tape
+ * image can be mapped over its start. The private mapping copies the
+ * pages of the image that the program writes to.
+ */
+static void write_sparse_tape(FILE *as, const info_t *info)
+{
+  unsigned long size = ((info->cells_size + 4095UL) & ~4095UL) + 2 * 4096;
+
+  fprintf(as, ".section .bss\n");
+  fprintf(as, "\t.lcomm bf_tape, 4\n");
+  fprintf(as, ".section .text\n");
+
+  /* mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_32BIT, -1, 0) */
+  fprintf(as, "bf_tape_map:\n");
+  fprintf(as, "\tmov eax, 9\n");
+  fprintf(as, "\txor edi, edi\n");
+  fprintf(as, "\tmov rsi, %lu\n", size);
+  fprintf(as, "\tmov edx, 3\n");
+  fprintf(as, "\tmov r10d, 0x4062\n");
+  fprintf(as, "\tmov r8, -1\n");
+  fprintf(as, "\txor r9d, r9d\n");
+  fprintf(as, "\tsyscall\n");
+  if (info->memory_limit != 0) {
+    /* ENOMEM: the tape does not fit under the memory limit */
+    fprintf(as, "\tcmp rax, -12\n");
+    fprintf(as, "\tje bf_tape_limit_error\n");
+  }
+  fprintf(as, "\tcmp rax, -4095\n");
+  fprintf(as, "\tjae bf_tape_map_error\n");
+  fprintf(as, "\tlea ecx, [rax+4096]\n");
+  fprintf(as, "\tmov DWORD PTR bf_tape, ecx\n");
+
+  /* madvise(tape, size, MADV_NOHUGEPAGE), which may fail harmlessly */
+  fprintf(as, "\tmov edi, eax\n");
+  fprintf(as, "\tmov eax, 28\n");
+  fprintf(as, "\tmov rsi, %lu\n", size);
+  fprintf(as, "\tmov edx, 15\n");
+  fprintf(as, "\tsyscall\n");
+
+  if (info->tape_load != NULL) {
+    /* open(bf_tape_file, O_RDONLY) and fstat for the size of the image */
+    fprintf(as, "\tmov eax, 2\n");
+    fprintf(as, "\tmov edi, OFFSET bf_tape_file\n");
+    fprintf(as, "\txor esi, esi\n");
+    fprintf(as, "\tsyscall\n");
+    fprintf(as, "\ttest eax, eax\n");
+    fprintf(as, "\tjs bf_tape_load_error\n");
+    fprintf(as, "\tmov r12d, eax\n");
+    fprintf(as, "\tmov eax, 5\n");
+    fprintf(as, "\tmov edi, r12d\n");
+    fprintf(as, "\tmov esi, OFFSET bf_tape_stat\n");
+    fprintf(as, "\tsyscall\n");
+    fprintf(as, "\ttest eax, eax\n");
+    fprintf(as, "\tjnz bf_tape_load_error\n");
+    fprintf(as, "\tmov rsi, QWORD PTR bf_tape_stat+48\n");
+    fprintf(as, "\tmov rdx, %u\n", info->cells_size);
+    fprintf(as, "\tcmp rsi, rdx\n");
+    fprintf(as, "\tja bf_tape_load_error\n");
+    fprintf(as, "\ttest rsi, rsi\n");
+    fprintf(as, "\tjz 1f\n");
+
+    /* mmap(tape, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) */
+    fprintf(as, "\tmov eax, 9\n");
+    fprintf(as, "\tmov edi, DWORD PTR bf_tape\n");
+    fprintf(as, "\tmov edx, 3\n");
+    fprintf(as, "\tmov r10d, 0x12\n");
+    fprintf(as, "\tmov r8d, r12d\n");
+    fprintf(as, "\txor r9d, r9d\n");
+    fprintf(as, "\tsyscall\n");
+    fprintf(as, "\tcmp rax, -4095\n");
+    fprintf(as, "\tjae bf_tape_load_error\n");
+    fprintf(as, "1:\n");
+    fprintf(as, "\tmov eax, 3\n");
+    fprintf(as, "\tmov edi, r12d\n");
+    fprintf(as, "\tsyscall\n");
+  }
+  fprintf(as, "\tret\n");
+
+  write_fatal(as, "bf_tape_map_error", "Could not map the tape", "");
+  if (info->memory_limit != 0) {
+    write_fatal(as, "bf_tape_limit_error", "The tape exceeds the memory limit", "");
+  }
+  if (info->tape_load != NULL) {
+    fprintf(as, ".section .rodata\n");
+    fprintf(as, "bf_tape_file:\n");
+    write_asciz(as, info->tape_load, "");
+    fprintf(as, ".section .bss\n");
+    fprintf(as, "\t.lcomm bf_tape_stat, 144\n");
+    write_fatal(as, "bf_tape_load_error", "Could not load the tape image ", info->tape_load);
+  }
+}
+
+/*
+ * Writes bf_tape_dump, which writes the tape up to its last nonzero
+ * cell to the dump file when the program ends
+ */
+static void write_tape_dump(FILE *as, const info_t *info)
+{
+  unsigned int ncells = info->cells_size / 4;
+
+  fprintf(as, ".section .rodata\n");
+  fprintf(as, "bf_dump_file:\n");
+  write_asciz(as, info->tape_dump, "");
+  fprintf(as, ".section .text\n");
+
+  fprintf(as, "bf_tape_dump:\n");
+  if (info->sparse_tape) {
+    fprintf(as, "\tmov r12d, DWORD PTR bf_tape\n");
+  } else {
+    fprintf(as, "\tmov r12d, OFFSET cells\n");
+  }
+
+  /* Find the last nonzero cell from the end of the tape downwards */
+  fprintf(as, "\txor r13d, r13d\n");
+  if (ncells > 0) {
+    fprintf(as, "\tlea edi, [r12+%u]\n", 4 * (ncells - 1));
+    fprintf(as, "\tmov ecx, %u\n", ncells);
+    fprintf(as, "\txor eax, eax\n");
+    fprintf(as, "\tstd\n");
+    fprintf(as, "\trepe scasd\n");
+    fprintf(as, "\tcld\n");
+    fprintf(as, "\tje 1f\n");
+    fprintf(as, "\tlea r13d, [rdi+8]\n");
+    fprintf(as, "\tsub r13d, r12d\n");
+    fprintf(as, "1:\n");
+  }
+
+  /* open(bf_dump_file, O_WRONLY | O_CREAT | O_TRUNC, 0644) and write */
+  fprintf(as, "\tmov eax, 2\n");
+  fprintf(as, "\tmov edi, OFFSET bf_dump_file\n");
+  fprintf(as, "\tmov esi, 0x241\n");
+  fprintf(as, "\tmov edx, 0644\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjs bf_tape_dump_error\n");
+  fprintf(as, "\tmov ebx, eax\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\ttest r13d, r13d\n");
+  fprintf(as, "\tjz 2f\n");
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\tmov edi, ebx\n");
+  fprintf(as, "\tmov esi, r12d\n");
+  fprintf(as, "\tmov edx, r13d\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tcmp rax, -4\n");
+  fprintf(as, "\tje 1b\n");
+  fprintf(as, "\ttest rax, rax\n");
+  fprintf(as, "\tjle bf_tape_dump_error\n");
+  fprintf(as, "\tadd r12d, eax\n");
+  fprintf(as, "\tsub r13d, eax\n");
+  fprintf(as, "\tjmp 1b\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\tmov eax, 3\n");
+  fprintf(as, "\tmov edi, ebx\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjnz bf_tape_dump_error\n");
+  fprintf(as, "\tret\n");
+
+  write_fatal(as, "bf_tape_dump_error", "Could not dump the tape to ", info->tape_dump);
+}
+
+/*
+ * Writes bf_par_fork, which starts a process with a pipe for its output
+ * for each of the ECX phases of the program. It returns the number of
+ * the phase in each process, which writes its output to the pipe and
+ * ends in bf_par_exit. The first process never returns: it copies the
+ * output of each phase to its own in turn and ends like the phase did,
+ * with the exit status or the signal of the first phase that failed,
+ * after it has killed the phases that are still running.
+ */
+static void write_phases(FILE *as)
+{
+  fprintf(as, ".section .bss\n");
+  fprintf(as, "\t.lcomm bf_par_pids, %d\n", 4 * PHASE_MAX);
+  fprintf(as, "\t.lcomm bf_par_fds, %d\n", 4 * PHASE_MAX);
+  fprintf(as, ".section .text\n");
+
+  fprintf(as, "bf_par_fork:\n");
+  fprintf(as, "\tpush rdi\n");
+  fprintf(as, "\tpush rsi\n");
+  fprintf(as, "\tmov r12d, ecx\n");
+  fprintf(as, "\txor r13d, r13d\n");
+
+  /* pipe(fds), as large as the kernel allows without privileges, and fork() */
+  fprintf(as, "1:\n");
+  fprintf(as, "\tsub rsp, 8\n");
+  fprintf(as, "\tmov eax, 22\n");
+  fprintf(as, "\tmov rdi, rsp\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjnz bf_par_error\n");
+  fprintf(as, "\tmov eax, 72\n");
+  fprintf(as, "\tmov edi, DWORD PTR [rsp+4]\n");
+  fprintf(as, "\tmov esi, 1031\n");
+  fprintf(as, "\tmov edx, 0x100000\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tmov eax, 57\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\ttest rax, rax\n");
+  fprintf(as, "\tjs bf_par_error\n");
+  fprintf(as, "\tjz 7f\n");
+  fprintf(as, "\tmov DWORD PTR bf_par_pids[r13*4], eax\n");
+  fprintf(as, "\tmov eax, DWORD PTR [rsp]\n");
+  fprintf(as, "\tmov DWORD PTR bf_par_fds[r13*4], eax\n");
+  fprintf(as, "\tmov eax, 3\n");
+  fprintf(as, "\tmov edi, DWORD PTR [rsp+4]\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tadd rsp, 8\n");
+  fprintf(as, "\tinc r13d\n");
+  fprintf(as, "\tcmp r13d, r12d\n");
+  fprintf(as, "\tjb 1b\n");
+
+  /* Copy the output of each phase in program order */
+  fprintf(as, "\txor r13d, r13d\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\txor eax, eax\n");
+  fprintf(as, "\tmov edi, DWORD PTR bf_par_fds[r13*4]\n");
+  fprintf(as, "\tmov esi, OFFSET bf_in_buf\n");
+  fprintf(as, "\tmov edx, %d\n", IN_BUF_SIZE);
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tcmp rax, -4\n");
+  fprintf(as, "\tje 2b\n");
+  fprintf(as, "\ttest rax, rax\n");
+  fprintf(as, "\tjle 4f\n");
+  fprintf(as, "\tmov ebx, OFFSET bf_in_buf\n");
+  fprintf(as, "\tmov r14d, eax\n");
+  fprintf(as, "3:\n");
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\tmov edi, 1\n");
+  fprintf(as, "\tmov esi, ebx\n");
+  fprintf(as, "\tmov edx, r14d\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tcmp rax, -4\n");
+  fprintf(as, "\tje 3b\n");
+  fprintf(as, "\ttest rax, rax\n");
+  fprintf(as, "\tjle 4f\n");
+  fprintf(as, "\tadd ebx, eax\n");
+  fprintf(as, "\tsub r14d, eax\n");
+  fprintf(as, "\tjnz 3b\n");
+  fprintf(as, "\tjmp 2b\n");
+
+  /* close(fd) and wait4(pid, &status, 0, NULL) */
+  fprintf(as, "4:\n");
+  fprintf(as, "\tmov eax, 3\n");
+  fprintf(as, "\tmov edi, DWORD PTR bf_par_fds[r13*4]\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tsub rsp, 8\n");
+  fprintf(as, "5:\n");
+  fprintf(as, "\tmov eax, 61\n");
+  fprintf(as, "\tmov edi, DWORD PTR bf_par_pids[r13*4]\n");
+  fprintf(as, "\tmov rsi, rsp\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\txor r10d, r10d\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tcmp rax, -4\n");
+  fprintf(as, "\tje 5b\n");
+  fprintf(as, "\tmov ebx, DWORD PTR [rsp]\n");
+  fprintf(as, "\tadd rsp, 8\n");
+  fprintf(as, "\ttest ebx, 0x7f\n");
+  fprintf(as, "\tjnz 6f\n");
+  fprintf(as, "\tshr ebx, 8\n");
+  fprintf(as, "\tand ebx, 0xff\n");
+  fprintf(as, "\tjnz 9f\n");
+  fprintf(as, "\tinc r13d\n");
+  fprintf(as, "\tcmp r13d, r12d\n");
+  fprintf(as, "\tjb 2b\n");
+  fprintf(as, "\tjmp 8f\n");
+  fprintf(as, "9:\n");
+  fprintf(as, "\tcall bf_par_kill\n");
+  fprintf(as, "\tjmp 8f\n");
+
+  /* kill(getpid(), signal) for a phase that a signal ended */
+  fprintf(as, "6:\n");
+  fprintf(as, "\tcall bf_par_kill\n");
+  fprintf(as, "\tand ebx, 0x7f\n");
+  fprintf(as, "\tmov eax, 39\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tmov edi, eax\n");
+  fprintf(as, "\tmov esi, ebx\n");
+  fprintf(as, "\tmov eax, 62\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tadd ebx, 128\n");
+  fprintf(as, "8:\n");
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\tint 0x80\n");
+
+  /* The phase writes to the pipe */
+  fprintf(as, "7:\n");
+  fprintf(as, "\tmov eax, 3\n");
+  fprintf(as, "\tmov edi, DWORD PTR [rsp]\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tmov eax, DWORD PTR [rsp+4]\n");
+  fprintf(as, "\tmov DWORD PTR bf_out_fd, eax\n");
+  fprintf(as, "\tadd rsp, 8\n");
+  fprintf(as, "\tmov eax, r13d\n");
+  fprintf(as, "\tpop rsi\n");
+  fprintf(as, "\tpop rdi\n");
+  fprintf(as, "\tret\n");
+
+  /*
+   * kill(pid, SIGKILL) and wait4(pid, NULL, 0, NULL) for the phases after
+   * the one that failed, which would otherwise run on without a parent
+   */
+  fprintf(as, "bf_par_kill:\n");
+  fprintf(as, "\tlea r14d, [r13+1]\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\tcmp r14d, r12d\n");
+  fprintf(as, "\tjae 3f\n");
+  fprintf(as, "\tmov eax, 62\n");
+  fprintf(as, "\tmov edi, DWORD PTR bf_par_pids[r14*4]\n");
+  fprintf(as, "\tmov esi, 9\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\tmov eax, 61\n");
+  fprintf(as, "\tmov edi, DWORD PTR bf_par_pids[r14*4]\n");
+  fprintf(as, "\txor esi, esi\n");
+  fprintf(as, "\txor edx, edx\n");
+  fprintf(as, "\txor r10d, r10d\n");
+  fprintf(as, "\tsyscall\n");
+  fprintf(as, "\tcmp rax, -4\n");
+  fprintf(as, "\tje 2b\n");
+  fprintf(as, "\tinc r14d\n");
+  fprintf(as, "\tjmp 1b\n");
+  fprintf(as, "3:\n");
+  fprintf(as, "\tret\n");
+
+  fprintf(as, "bf_par_exit:\n");
+  fprintf(as, "\tcall bf_flush\n");
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\txor ebx, ebx\n");
+  fprintf(as, "\tint 0x80\n");
+
+  write_fatal(as, "bf_par_error", "Could not start the phases of the program", "");
+}
+
+/*
+ * Checks whether loops that copy input to output are run by bf_copy,
+ * which does not count their steps or iterations
+ */
+int use_copy_loops(const info_t *info)
+{
+  return info->opt_level > 0 && !info->count_steps && info->profile_generate == NULL;
+}
+
+/*
+ * Writes bf_copy, which runs a copy loop whose cell at EDI is between 1
+ * and 255 on entry. Its body adds BL to the low byte of the cell, writes
+ * it, clears the cell if EDX is nonzero and otherwise undoes the
+ * addition, and reads the next byte into it; the cell then stays below
+ * 256. Runs of 16 nonzero input bytes are transformed and copied at once
+ * while the buffers have room. bf_copy returns when a zero byte ends the
+ * loop, or at EOF with the cell as the loop leaves it for its next test.
+ * It returns at once for other cells, which the loop itself handles.
+ */
+static void write_copy(FILE *as)
+{
+  fprintf(as, "bf_copy:\n");
+  fprintf(as, "\tmov eax, DWORD PTR [edi]\n");
+  fprintf(as, "\tdec eax\n");
+  fprintf(as, "\tcmp eax, 254\n");
+  fprintf(as, "\tja 9f\n");
+  fprintf(as, "\tmovd xmm7, ebx\n");
+  fprintf(as, "\tpunpcklbw xmm7, xmm7\n");
+  fprintf(as, "\tpshuflw xmm7, xmm7, 0\n");
+  fprintf(as, "\tpunpcklqdq xmm7, xmm7\n");
+  fprintf(as, "\tpxor xmm6, xmm6\n");
+
+  /* Write the transformed cell and finish the body */
+  fprintf(as, "1:\n");
+  fprintf(as, "\tmov eax, DWORD PTR [edi]\n");
+  fprintf(as, "\tadd al, bl\n");
+  fprintf(as, "\tmov BYTE PTR [esi], al\n");
+  fprintf(as, "\tinc esi\n");
+  fprintf(as, "\tcmp esi, OFFSET bf_out_buf+%d\n", OUT_BUF_SIZE);
+  fprintf(as, "\tjne 2f\n");
+  fprintf(as, "\tpush rbx\n");
+  fprintf(as, "\tpush rdx\n");
+  fprintf(as, "\tcall bf_flush\n");
+  fprintf(as, "\tpop rdx\n");
+  fprintf(as, "\tpop rbx\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\ttest edx, edx\n");
+  fprintf(as, "\tjz 3f\n");
+  fprintf(as, "\tmov DWORD PTR [edi], 0\n");
+
+  /* Copy 16 bytes at a time while none of them ends the loop */
+  fprintf(as, "3:\n");
+  fprintf(as, "\tmov eax, DWORD PTR bf_in_pos\n");
+  fprintf(as, "\tmov ecx, DWORD PTR bf_in_end\n");
+  fprintf(as, "\tsub ecx, eax\n");
+  fprintf(as, "\tcmp ecx, 16\n");
+  fprintf(as, "\tjb 5f\n");
+  fprintf(as, "\tcmp esi, OFFSET bf_out_buf+%d\n", OUT_BUF_SIZE - 16);
+  fprintf(as, "\tja 5f\n");
+  fprintf(as, "\tmovdqu xmm0, XMMWORD PTR [eax]\n");
+  fprintf(as, "\tmovdqa xmm1, xmm0\n");
+  fprintf(as, "\tpcmpeqb xmm1, xmm6\n");
+  fprintf(as, "\tpmovmskb ecx, xmm1\n");
+  fprintf(as, "\ttest ecx, ecx\n");
+  fprintf(as, "\tjnz 5f\n");
+  fprintf(as, "\tpaddb xmm0, xmm7\n");
+  fprintf(as, "\tmovdqu XMMWORD PTR [esi], xmm0\n");
+  fprintf(as, "\tadd esi, 16\n");
+  fprintf(as, "\tadd eax, 16\n");
+  fprintf(as, "\tmov DWORD PTR bf_in_pos, eax\n");
+  fprintf(as, "\ttest edx, edx\n");
+  fprintf(as, "\tjnz 3b\n");
+  fprintf(as, "\tmovzx ecx, BYTE PTR [eax-1]\n");
+  fprintf(as, "\tmov DWORD PTR [edi], ecx\n");
+  fprintf(as, "\tjmp 3b\n");
+
+  /* Read the next byte; at EOF the cell keeps its value */
+  fprintf(as, "5:\n");
+  fprintf(as, "\tmov eax, DWORD PTR bf_in_pos\n");
+  fprintf(as, "\tcmp eax, DWORD PTR bf_in_end\n");
+  fprintf(as, "\tjne 6f\n");
+  fprintf(as, "\tpush rbx\n");
+  fprintf(as, "\tpush rdx\n");
+  fprintf(as, "\tcall bf_refill\n");
+  fprintf(as, "\tpop rdx\n");
+  fprintf(as, "\tpop rbx\n");
+  fprintf(as, "\tjz 9f\n");
+  fprintf(as, "6:\n");
+  fprintf(as, "\tmovzx ecx, BYTE PTR [eax]\n");
+  fprintf(as, "\tinc eax\n");
+  fprintf(as, "\tmov DWORD PTR bf_in_pos, eax\n");
+  fprintf(as, "\tmov DWORD PTR [edi], ecx\n");
+  fprintf(as, "\ttest ecx, ecx\n");
+  fprintf(as, "\tjnz 1b\n");
+  fprintf(as, "9:\n");
+  fprintf(as, "\tret\n");
+}
+
+/* Checks whether loops that only compute may be cached by bf_memo_find */
+int use_memo_loops(const info_t *info)
+{
+  return info->opt_level > 0 && !info->count_steps && info->profile_generate == NULL &&
+         (info->memo_loops || info->profile != NULL);
+}
+
+/*
+ * Writes bf_memo_find and bf_memo_save, which cache the results of
+ * loops. Both take the address of the window of cells of the loop in
+ * EAX, its number of cells in ECX and the number of the loop in EDX.
+ * bf_memo_find hashes the window and looks it up in the direct mapped
+ * table bf_memo. It sets ZF and replaces the window by the cached result
+ * on a hit; otherwise it stores the window as the key of its entry and
+ * clears ZF, and bf_memo_save stores the window as the result of that
+ * entry after the loop. An entry holds the loop number, which is zero
+ * while the entry is empty, the key and the result.
+ */
+static void write_memo(FILE *as)
+{
+  const int entry = 4 + 8 * MEMO_CELLS;
+  int bits;
+
+  for (bits = 0; (1 << bits) < MEMO_SLOTS; bits++) {
+  }
+
+  fprintf(as, ".section .bss\n");
+  fprintf(as, "\t.lcomm bf_memo, %d\n", entry * MEMO_SLOTS);
+  fprintf(as, "\t.lcomm bf_memo_entry, 4\n");
+  fprintf(as, ".section .text\n");
+
+  /* Hash the loop number and the cells (FNV-1a) and find the entry */
+  fprintf(as, "bf_memo_find:\n");
+  fprintf(as, "\tpush rsi\n");
+  fprintf(as, "\tpush rdi\n");
+  fprintf(as, "\tmov ebx, 2166136261\n");
+  fprintf(as, "\txor ebx, edx\n");
+  fprintf(as, "\timul ebx, ebx, 16777619\n");
+  fprintf(as, "\txor edi, edi\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\txor ebx, DWORD PTR [eax+edi*4]\n");
+  fprintf(as, "\timul ebx, ebx, 16777619\n");
+  fprintf(as, "\tinc edi\n");
+  fprintf(as, "\tcmp edi, ecx\n");
+  fprintf(as, "\tjne 1b\n");
+  fprintf(as, "\tshr ebx, %d\n", 32 - bits);
+  fprintf(as, "\timul ebx, ebx, %d\n", entry);
+  fprintf(as, "\tadd ebx, OFFSET bf_memo\n");
+  fprintf(as, "\tmov DWORD PTR bf_memo_entry, ebx\n");
+
+  /* Compare the loop number and the key */
+  fprintf(as, "\tcmp DWORD PTR [ebx], edx\n");
+  fprintf(as, "\tjne 2f\n");
+  fprintf(as, "\tmov esi, eax\n");
+  fprintf(as, "\tlea edi, [ebx+4]\n");
+  fprintf(as, "\tpush rcx\n");
+  fprintf(as, "\trepe cmpsd\n");
+  fprintf(as, "\tpop rcx\n");
+  fprintf(as, "\tjne 2f\n");
+
+  /* Hit: copy the result into the window */
+  fprintf(as, "\tlea esi, [ebx+%d]\n", 4 + 4 * MEMO_CELLS);
+  fprintf(as, "\tmov edi, eax\n");
+  fprintf(as, "\trep movsd\n");
+  fprintf(as, "\tpop rdi\n");
+  fprintf(as, "\tpop rsi\n");
+  fprintf(as, "\tcmp eax, eax\n");
+  fprintf(as, "\tret\n");
+
+  /* Miss: empty the entry and store the key */
+  fprintf(as, "2:\n");
+  fprintf(as, "\tmov DWORD PTR [ebx], 0\n");
+  fprintf(as, "\tmov esi, eax\n");
+  fprintf(as, "\tlea edi, [ebx+4]\n");
+  fprintf(as, "\trep movsd\n");
+  fprintf(as, "\tpop rdi\n");
+  fprintf(as, "\tpop rsi\n");
+  fprintf(as, "\ttest ebx, ebx\n");
+  fprintf(as, "\tret\n");
+
+  fprintf(as, "bf_memo_save:\n");
+  fprintf(as, "\tpush rsi\n");
+  fprintf(as, "\tpush rdi\n");
+  fprintf(as, "\tmov ebx, DWORD PTR bf_memo_entry\n");
+  fprintf(as, "\tmov DWORD PTR [ebx], edx\n");
+  fprintf(as, "\tmov esi, eax\n");
+  fprintf(as, "\tlea edi, [ebx+%d]\n", 4 + 4 * MEMO_CELLS);
+  fprintf(as, "\trep movsd\n");
+  fprintf(as, "\tpop rdi\n");
+  fprintf(as, "\tpop rsi\n");
+  fprintf(as, "\tret\n");
+}
+
+/*
+ * Writes bf_endless, which writes the buffered output and ends the
+ * program with status ENDLESS_EXIT when it enters a loop that would
+ * never terminate
+ */
+static void write_endless(FILE *as)
+{
+  fprintf(as, ".section .rodata\n");
+  fprintf(as, "bf_endless_text:\n");
+  fprintf(as, "\t.ascii \"Stopped in a loop that never terminates\\n\"\n");
+  fprintf(as, "\t.set bf_endless_len, . - bf_endless_text\n");
+  fprintf(as, ".section .text\n");
+  fprintf(as, "bf_endless:\n");
+  fprintf(as, "\tcall bf_flush\n");
+  fprintf(as, "\tmov eax, 4\n");
+  fprintf(as, "\tmov ebx, 2\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_endless_text\n");
+  fprintf(as, "\tmov edx, OFFSET bf_endless_len\n");
+  fprintf(as, "\tint 0x80\n");
+  fprintf(as, "\tmov eax, 1\n");
+  fprintf(as, "\tmov ebx, %d\n", ENDLESS_EXIT);
+  fprintf(as, "\tint 0x80\n");
+}
+
+/*
+ * Writes the data and the code of the run-time support routines;
+ * bf_cpu_features is only needed for run time dispatch and the other
+ * routines only for the options that use them.
+ */
+void write_runtime(FILE *as, const info_t *info)
+{
+  int limits = info->cpu_limit != 0 || info->time_limit != 0;
+
+  fprintf(as, ".section .bss\n");
+  fprintf(as, "\t.lcomm bf_out_buf, %d\n", OUT_BUF_SIZE);
+  fprintf(as, "\t.lcomm bf_in_buf, %d\n", IN_BUF_SIZE);
+  fprintf(as, "\t.lcomm bf_in_pos, 4\n");
+  fprintf(as, "\t.lcomm bf_in_end, 4\n");
+  if (info->sample || info->profile_generate != NULL || info->count_steps) {
+    fprintf(as, "\t.lcomm bf_digits, 24\n");
+  }
+  if (info->parallel) {
+    fprintf(as, ".section .data\n");
+    fprintf(as, "bf_out_fd:\n");
+    fprintf(as, "\t.long 1\n");
+  }
+
+  fprintf(as, ".section .text\n");
+
+  /* Write the buffered output with as many calls to sys_write as it takes */
+  fprintf(as, "bf_flush:\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_out_buf\n");
+  fprintf(as, "\tmov edx, esi\n");
+  fprintf(as, "\tsub edx, ecx\n");
+  fprintf(as, "\tjz 2f\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\tmov eax, 4\n");
+  if (info->parallel) {
+    fprintf(as, "\tmov ebx, DWORD PTR bf_out_fd\n");
+  } else {
+    fprintf(as, "\tmov ebx, 1\n");
+  }
+  fprintf(as, "\tint 0x80\n");
+  if (limits) {
+    /* Write again when a limit signal interrupts the call (EINTR) */
+    fprintf(as, "\tcmp eax, -4\n");
+    fprintf(as, "\tje 1b\n");
+  }
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjle 2f\n");
+  fprintf(as, "\tadd ecx, eax\n");
+  fprintf(as, "\tsub edx, eax\n");
+  fprintf(as, "\tjnz 1b\n");
+  fprintf(as, "2:\n");
+  fprintf(as, "\tmov esi, OFFSET bf_out_buf\n");
+  if (limits) {
+    fprintf(as, "\tcmp BYTE PTR bf_limit_hit, 0\n");
+    fprintf(as, "\tjne bf_limit_exit\n");
+  }
+  fprintf(as, "\tret\n");
+
+  /*
+   * Flush the output and read the next block of input. On success EAX
+   * points to the first byte and ZF is clear; at EOF or on error ZF is set.
+   */
+  fprintf(as, "bf_refill:\n");
+  fprintf(as, "\tcall bf_flush\n");
+  fprintf(as, "\tmov eax, 3\n");
+  fprintf(as, "\tmov ebx, 0\n");
+  fprintf(as, "\tmov ecx, OFFSET bf_in_buf\n");
+  fprintf(as, "\tmov edx, %d\n", IN_BUF_SIZE);
+  fprintf(as, "\tint 0x80\n");
+  if (limits) {
+    fprintf(as, "\tcmp BYTE PTR bf_limit_hit, 0\n");
+    fprintf(as, "\tjne bf_limit_exit\n");
+  }
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tjle 1f\n");
+  fprintf(as, "\tadd eax, ecx\n");
+  fprintf(as, "\tmov DWORD PTR bf_in_end, eax\n");
+  fprintf(as, "\tmov DWORD PTR bf_in_pos, ecx\n");
+  fprintf(as, "\tmov eax, ecx\n");
+  fprintf(as, "\ttest eax, eax\n");
+  fprintf(as, "\tret\n");
+  fprintf(as, "1:\n");
+  fprintf(as, "\txor eax, eax\n");
+  fprintf(as, "\tret\n");
+  fprintf(as, "bf_io_end:\n");
+
+  if (info->dispatch) {
+    write_cpu_features(as);
+  }
+  if (info->sample || info->profile_generate != NULL || info->count_steps) {
+    write_format(as);
+  }
+  if (info->count_steps) {
+    write_step_counter(as, info);
+  }
+  if (info->cpu_limit != 0 || info->time_limit != 0 || info->memory_limit != 0) {
+    write_limits(as, info);
+  }
+  if (info->checkpoint != NULL) {
+    write_checkpoint_runtime(as, info->checkpoint);
+  }
+  if (info->sparse_tape) {
+    write_sparse_tape(as, info);
+  }
+  if (info->tape_dump != NULL) {
+    write_tape_dump(as, info);
+  }
+  if (info->parallel) {
+    write_phases(as);
+  }
+  if (info->trap_loops) {
+    write_endless(as);
+  }
+  if (use_copy_loops(info)) {
+    write_copy(as);
+  }
+  if (use_memo_loops(info)) {
+    write_memo(as);
+  }
+}
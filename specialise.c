@@ -0,0 +1,170 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Specialisation of programs for the start of their input. With
+ * -fspecialise-input, the program is run at compile time on the bytes
+ * of the file until it reads past them, ends or has run SPEC_STEPS
+ * operations. Everything up to there depends on nothing but those
+ * bytes, so the residual program writes the output produced so far,
+ * sets the cells to their values and moves the pointer, and continues
+ * with the operation where the run stopped. The compiled program then
+ * reads the input that follows the file.
+ *
+ * The run may stop inside loops. Running the rest of the body of the
+ * innermost one and then the whole loop, since the test of ']' is that
+ * of '[', continues it; the same goes for the loops around it, so the
+ * residual program needs no jumps into loops.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "bfc.h"
+
+#define SPEC_STEPS 100000000UL  /* Maximum number of operations run at compile time */
+
+/* Appends the operations of prog from begin up to end to out */
+static void append_ops(program_t *out, const program_t *prog, size_t begin, size_t end)
+{
+  size_t i;
+
+  for (i = begin; i < end; i++) {
+    *append_op(out, prog->ops[i].op, 0, 0) = prog->ops[i];
+  }
+}
+
+/*
+ * Replaces the program by its residual program for the input in the
+ * file info->specialise_input. The program must not be optimised yet.
+ */
+void specialise(program_t *prog, const info_t *info)
+{
+  program_t out;
+  const ir_t *ir;
+  unsigned char *input, *output = NULL;
+  uint32_t *cells;
+  size_t ncells = info->cells_size / 4, len, used = 0, nout = 0, size = 0;
+  size_t pc, i, loop, end = 0;  /* Cells from end on are still zero */
+  unsigned long steps = 0;
+  long pos = 0, cell;
+
+  input = read_file(info->specialise_input, &len);
+  cells = calloc(ncells, sizeof(*cells));
+  if (cells == NULL) {
+    error("Out of memory while specialising the program");
+  }
+
+  /* Run the program as far as the input is known */
+  for (pc = 0; pc < prog->len; pc++) {
+    ir = &prog->ops[pc];
+    cell = pos + ir->offset;
+    if (++steps > SPEC_STEPS || (ir->op != IR_MOVE && (cell < 0 || (size_t)cell >= ncells))) {
+      break;
+    }
+
+    switch (ir->op) {
+    case IR_ADD:
+      cells[cell] += (uint32_t)ir->value;
+      end = (size_t)cell >= end ? (size_t)cell + 1 : end;
+      break;
+    case IR_SET:
+      cells[cell] = (uint32_t)ir->value;
+      end = (size_t)cell >= end ? (size_t)cell + 1 : end;
+      break;
+    case IR_MOVE:
+      pos += ir->value;
+      break;
+    case IR_IN:
+      if (used == len) {
+        goto stop;
+      }
+      cells[cell] = (cells[cell] & ~0xffU) | input[used++];
+      end = (size_t)cell >= end ? (size_t)cell + 1 : end;
+      break;
+    case IR_OUT:
+      if (nout == size) {
+        size = size == 0 ? 4096 : 2 * size;
+        output = realloc(output, size);
+        if (output == NULL) {
+          error("Out of memory while specialising the program");
+        }
+      }
+      output[nout++] = (unsigned char)cells[cell];
+      break;
+    case IR_LOOP:
+      if (cells[cell] == 0) {
+        pc = ir->match;
+      }
+      break;
+    case IR_END:
+      if (cells[cell] != 0) {
+        pc = ir->match;
+      }
+      break;
+    default:
+      error("Only unoptimised programs can be specialised");
+    }
+  }
+
+ stop:
+  /* The residual program cannot supply the rest of the file */
+  if (pc < prog->len && used < len) {
+    error("The program did not read all of %s within %lu operations",
+          info->specialise_input, SPEC_STEPS);
+  }
+
+  /* Write the output, set the cells and move the pointer */
+  program_init(&out);
+  if (pc < prog->len) {
+    out.line = prog->ops[pc].line;
+    out.column = prog->ops[pc].column;
+  }
+  for (i = 0; i < nout; i++) {
+    append_op(&out, IR_SET, 0, output[i]);
+    append_op(&out, IR_OUT, 0, 0);
+  }
+  for (i = 0; i < end || (i == 0 && nout > 0); i++) {
+    if (cells[i] != 0 || (i == 0 && nout > 0)) {
+      append_op(&out, IR_SET, (long)i, (int32_t)cells[i]);
+    }
+  }
+  if (pos != 0) {
+    append_op(&out, IR_MOVE, 0, pos);
+  }
+
+  /* Finish the loops around the operation where the run stopped, innermost first */
+  for (loop = pc; pc < prog->len && loop-- > 0;) {
+    if (prog->ops[loop].op == IR_LOOP && prog->ops[loop].match >= pc) {
+      append_ops(&out, prog, pc, prog->ops[loop].match);
+      append_ops(&out, prog, loop, prog->ops[loop].match + 1);
+      pc = prog->ops[loop].match + 1;
+    }
+  }
+  if (pc < prog->len) {
+    append_ops(&out, prog, pc, prog->len);
+  }
+
+  free(input);
+  free(output);
+  free(cells);
+  program_free(prog);
+  *prog = out;
+  match_loops(prog);
+}
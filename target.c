@@ -0,0 +1,259 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "bfc.h"
+
+/* Processor families that -march accepts and their instruction sets */
+typedef struct arch_t arch_t;
+struct arch_t
+{
+  const char *name;
+  unsigned int features;
+  const char *tune;
+};
+
+#define SSE4_1_FEATURES (FEATURE_SSE2 | FEATURE_SSE4_1)
+#define AVX2_FEATURES   (SSE4_1_FEATURES | FEATURE_AVX2 | FEATURE_BMI | FEATURE_BMI2)
+#define AVX512_FEATURES (AVX2_FEATURES | FEATURE_AVX512F)
+
+static const arch_t archs[] = {
+  { "i686",           0,               "i686" },
+  { "pentium4",       FEATURE_SSE2,    "generic" },
+  { "core2",          FEATURE_SSE2,    "core2" },
+  { "nehalem",        SSE4_1_FEATURES, "nehalem" },
+  { "sandybridge",    SSE4_1_FEATURES, "sandybridge" },
+  { "haswell",        AVX2_FEATURES,   "haswell" },
+  { "skylake",        AVX2_FEATURES,   "skylake" },
+  { "skylake-avx512", AVX512_FEATURES, "skylake" },
+  { "zen",            AVX2_FEATURES,   "zen" },
+  { NULL,             0,               NULL }
+};
+
+/*
+ * Instruction set extensions that -m<name> and -mno-<name> switch on and
+ * off. Switching on a feature switches on the features it builds on;
+ * switching it off switches off the features that build on it.
+ */
+typedef struct feature_t feature_t;
+struct feature_t
+{
+  const char *name;
+  unsigned int feature;
+  unsigned int implies;
+};
+
+static const feature_t features[] = {
+  { "sse2",    FEATURE_SSE2,    FEATURE_SSE2 },
+  { "sse4.1",  FEATURE_SSE4_1,  SSE4_1_FEATURES },
+  { "avx2",    FEATURE_AVX2,    SSE4_1_FEATURES | FEATURE_AVX2 },
+  { "avx512f", FEATURE_AVX512F, SSE4_1_FEATURES | FEATURE_AVX2 | FEATURE_AVX512F },
+  { "bmi",     FEATURE_BMI,     FEATURE_BMI },
+  { "bmi2",    FEATURE_BMI2,    FEATURE_BMI | FEATURE_BMI2 },
+  { NULL,      0,               0 }
+};
+
+/* Feature levels of the code variants that -mdispatch generates, best first */
+static const unsigned int levels[] = {
+  AVX512_FEATURES,
+  AVX2_FEATURES,
+  SSE4_1_FEATURES,
+  FEATURE_SSE2
+};
+
+/*
+ * Tuning profiles. Processors with a decoded instruction cache that is
+ * organised in 32 byte windows (Sandy Bridge and later, Zen) prefer loop
+ * heads on 32 byte boundaries; older cores fetch 16 bytes at a time.
+ */
+static const tune_t tunes[] = {
+  /* name           loop_align  loop_skip */
+  { "generic",      16,         10 },
+  { "i686",         16,          7 },
+  { "atom",         16,          7 },
+  { "core2",        16,         10 },
+  { "nehalem",      16,         10 },
+  { "sandybridge",  32,         15 },
+  { "haswell",      32,         15 },
+  { "skylake",      32,         15 },
+  { "zen",          32,         15 },
+  { NULL,            0,          0 }
+};
+
+const tune_t *default_tune = &tunes[0];
+
+/* Returns the tuning profile with the given name or NULL if there is none */
+const tune_t *find_tune(const char *name)
+{
+  const tune_t *tune;
+
+  for (tune = tunes; tune->name != NULL; tune++) {
+    if (strcmp(tune->name, name) == 0) {
+      return tune;
+    }
+  }
+
+  return NULL;
+}
+
+/* Returns the features of the processor that runs the compiler */
+static unsigned int native_features(void)
+{
+  unsigned int features = 0;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    features |= FEATURE_SSE2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    features |= FEATURE_SSE4_1;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    features |= FEATURE_AVX2;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    features |= FEATURE_AVX512F;
+  }
+  if (__builtin_cpu_supports("bmi")) {
+    features |= FEATURE_BMI;
+  }
+  if (__builtin_cpu_supports("bmi2")) {
+    features |= FEATURE_BMI2;
+  }
+
+  return features;
+}
+
+/*
+ * Applies a machine option given as -m<option>: tune=<cpu>, arch=<cpu>,
+ * dispatch, <feature> or no-<feature>. Returns zero if the option is
+ * invalid.
+ */
+int set_machine_option(info_t *info, const char *option)
+{
+  const arch_t *arch;
+  const feature_t *feature, *other;
+  int enable = 1;
+
+  if (strncmp(option, "tune=", 5) == 0) {
+    info->tune = find_tune(option + 5);
+    return info->tune != NULL;
+  }
+
+  if (strcmp(option, "arch=native") == 0) {
+    info->features = native_features();
+    info->arch_tune = default_tune;
+    return 1;
+  }
+
+  if (strncmp(option, "arch=", 5) == 0) {
+    for (arch = archs; arch->name != NULL; arch++) {
+      if (strcmp(arch->name, option + 5) == 0) {
+        info->features = arch->features;
+        info->arch_tune = find_tune(arch->tune);
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  if (strcmp(option, "dispatch") == 0) {
+    info->dispatch = 1;
+    return 1;
+  }
+
+  if (strncmp(option, "no-", 3) == 0) {
+    enable = 0;
+    option += 3;
+  }
+
+  for (feature = features; feature->name != NULL; feature++) {
+    if (strcmp(feature->name, option) != 0) {
+      continue;
+    }
+    if (enable) {
+      info->features |= feature->implies;
+      return 1;
+    }
+    for (other = features; other->name != NULL; other++) {
+      if (other->implies & feature->feature) {
+        info->features &= ~other->feature;
+      }
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Checks whether a level in levels up to n has the name of the features */
+static int has_level_name(const unsigned int *levels, size_t n, unsigned int features)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (strcmp(level_name(levels[i]), level_name(features)) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Stores the feature levels of the code variants to generate for run
+ * time dispatch in levels, best first, and returns their number. Every
+ * level includes the given features, and the last level is just those.
+ * The variants are named after their levels, so a level is left out if
+ * the features are only part of it, such as AVX2 without BMI2, and it
+ * would take the name of another.
+ */
+size_t dispatch_levels(unsigned int features, unsigned int *out)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i < sizeof(levels) / sizeof(*levels); i++) {
+    if ((levels[i] | features) != features &&
+        !has_level_name(out, n, levels[i] | features) &&
+        strcmp(level_name(levels[i] | features), level_name(features)) != 0) {
+      out[n++] = levels[i] | features;
+    }
+  }
+  out[n++] = features;
+
+  return n;
+}
+
+/* Returns a name for code generated for the features */
+const char *level_name(unsigned int features)
+{
+  if (features & FEATURE_AVX512F) {
+    return "avx512";
+  }
+  if (features & FEATURE_AVX2) {
+    return "avx2";
+  }
+  if (features & FEATURE_SSE4_1) {
+    return "sse4_1";
+  }
+  if (features & FEATURE_SSE2) {
+    return "sse2";
+  }
+  return "i686";
+}
@@ -0,0 +1,304 @@
+/*
+ * BF compiler
+ * Copyright 2008 S. Pal
+ * Copyright 2011 A. Horn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Detection of loops that never terminate. If the body of a balanced
+ * loop changes its cell only by adding a constant step s, the cell runs
+ * through x, x + s, x + 2s, ... modulo 2^32. It reaches zero if and only
+ * if x is a multiple of the largest power of two that divides s; so the
+ * loop never ends if x has a bit set below the lowest set bit of s. For
+ * s = 0, such as in "[]", that is any x other than zero.
+ *
+ * Where the value of the cell on entry is known at compile time, which
+ * is the case for top-level loops that the tape contents before them
+ * determine, such as "+[--]", the loop is reported. With
+ * -ftrap-endless-loops every such loop is guarded by an IR_TRAP, which
+ * ends the program with status ENDLESS_EXIT instead of letting it spin.
+ * Loops that write output, such as "+[.]", do useful work while they
+ * run, so they are only reported.
+ */
+
+#include <stdlib.h>
+
+#include "bfc.h"
+
+#define KNOWN_MAX 64  /* Maximum number of cells with known values */
+
+/* Cell values known at the top level of the program */
+typedef struct known_t known_t;
+struct known_t
+{
+  long pos[KNOWN_MAX];
+  long value[KNOWN_MAX];
+  char valid[KNOWN_MAX];   /* Zero for listed cells of unknown value */
+  size_t n;
+  int rest_zero;           /* Cells that are not listed are zero, otherwise unknown */
+};
+
+/* Stores the value of the cell at pos in *value if it is known */
+static int get_known(const known_t *known, long pos, long *value)
+{
+  size_t i;
+
+  for (i = 0; i < known->n; i++) {
+    if (known->pos[i] == pos) {
+      *value = known->value[i];
+      return known->valid[i];
+    }
+  }
+  *value = 0;
+  return known->rest_zero;
+}
+
+/*
+ * Records the value of the cell at pos, or that it is unknown. Without
+ * room for the cell, every cell becomes unknown.
+ */
+static void record(known_t *known, long pos, long value, int valid)
+{
+  size_t i;
+
+  for (i = 0; i < known->n && known->pos[i] != pos; i++) {
+  }
+  if (i == known->n && known->n == KNOWN_MAX) {
+    known->n = 0;
+    known->rest_zero = 0;
+    return;
+  }
+  known->pos[i] = pos;
+  known->value[i] = cell_value(value);
+  known->valid[i] = valid;
+  known->n += i == known->n;
+}
+
+static void set_known(known_t *known, long pos, long value)
+{
+  record(known, pos, value, 1);
+}
+
+static void forget(known_t *known, long pos)
+{
+  record(known, pos, 0, 0);
+}
+
+/*
+ * Returns the mask of the values of the cell on entry for which the loop
+ * at prog->ops[loop] never terminates, or zero if it always does or
+ * its body is not a sequence of copies of straight-line code that only
+ * adds to the cell. The copies of unrolled loops test the cell in
+ * between; each copy must add the same step.
+ */
+static unsigned long endless_mask(const program_t *prog, size_t loop)
+{
+  const ir_t *ir;
+  long pos = 0, step = 0, copy = 0;
+  int copies = 0;
+  size_t i;
+
+  for (i = loop + 1; i < prog->ops[loop].match; i++) {
+    ir = &prog->ops[i];
+    switch (ir->op) {
+    case IR_ADD:
+      if (pos + ir->offset == 0) {
+        step = cell_value(step + ir->value);
+      }
+      break;
+    case IR_SET:
+    case IR_MUL:
+    case IR_IN:
+      if (pos + ir->offset == 0) {
+        return 0;
+      }
+      break;
+    case IR_OUT:
+      break;
+    case IR_MOVE:
+      pos += ir->value;
+      break;
+    case IR_BREAK:
+      if (ir->offset != 0 || pos != 0 || (copies++ > 0 && step != copy)) {
+        return 0;
+      }
+      copy = step;
+      step = 0;
+      break;
+    default:
+      return 0;
+    }
+  }
+  if (pos != 0 || (copies > 0 && step != copy)) {
+    return 0;
+  }
+
+  if (step == 0) {
+    return 0xffffffffUL;
+  }
+  return (unsigned long)((step & -step) - 1) & 0xffffffffUL;
+}
+
+/* Checks whether the loop at prog->ops[loop] leaves the pointer where it found it */
+static int is_balanced(const program_t *prog, size_t loop)
+{
+  long pos = 0, lo = 1, hi = 0;
+
+  return find_window(prog, loop, prog->ops[loop].match + 1, &pos, &lo, &hi);
+}
+
+/* Checks whether the body of the loop at prog->ops[loop] writes output */
+static int writes_output(const program_t *prog, size_t loop)
+{
+  size_t i;
+
+  for (i = loop + 1; i < prog->ops[loop].match; i++) {
+    if (prog->ops[i].op == IR_OUT) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Reports the loops that never terminate, reached from the top level
+ * with known values, and the loops that never terminate once entered.
+ * Returns the number of loops that may never terminate.
+ */
+static size_t report_loops(const program_t *prog, const info_t *info, unsigned long *masks)
+{
+  known_t known;
+  const ir_t *ir;
+  long pos = 0, value, src;
+  size_t n = 0, i;
+  int top = 1;
+
+  known.n = 0;
+  known.rest_zero = info->tape_load == NULL;
+
+  for (i = 0; i < prog->len; i++) {
+    ir = &prog->ops[i];
+    masks[i] = ir->op == IR_LOOP ? endless_mask(prog, i) : 0;
+    if (masks[i] != 0) {
+      n++;
+      if (masks[i] == 0xffffffffUL) {
+        fprintf(stderr, "bfc: %s:%u:%u: warning: loop never terminates once entered\n",
+                info->in_filename, ir->line, ir->column);
+      }
+    }
+  }
+
+  /* Follow the values of the cells at the top level */
+  for (i = 0; top && i < prog->len; i++) {
+    ir = &prog->ops[i];
+    switch (ir->op) {
+    case IR_ADD:
+      if (get_known(&known, pos + ir->offset, &value)) {
+        set_known(&known, pos + ir->offset, value + ir->value);
+      }
+      break;
+    case IR_SET:
+      set_known(&known, pos + ir->offset, ir->value);
+      break;
+    case IR_MUL:
+      if (get_known(&known, pos + ir->src, &src) &&
+          get_known(&known, pos + ir->offset, &value)) {
+        set_known(&known, pos + ir->offset, value + src * ir->value);
+      } else {
+        forget(&known, pos + ir->offset);
+      }
+      break;
+    case IR_IN:
+      forget(&known, pos + ir->offset);
+      break;
+    case IR_OUT:
+      break;
+    case IR_MOVE:
+      pos += ir->value;
+      break;
+    case IR_LOOP:
+      if (get_known(&known, pos, &value) && value == 0) {
+        i = ir->match;
+        break;
+      }
+      if (masks[i] != 0 && masks[i] != 0xffffffffUL &&
+          get_known(&known, pos, &value) && (value & masks[i]) != 0) {
+        fprintf(stderr, "bfc: %s:%u:%u: warning: loop never terminates\n",
+                info->in_filename, ir->line, ir->column);
+        top = 0;
+        break;
+      }
+
+      /* The loop may change any cell, but leaves its own cell zero */
+      top = is_balanced(prog, i);
+      known.n = 0;
+      known.rest_zero = 0;
+      set_known(&known, pos, 0);
+      i = ir->match;
+      break;
+    case IR_COUNT:
+      /* Counted loops are innermost loops and always terminate */
+      while (prog->ops[i].op != IR_NEXT) {
+        i++;
+      }
+      known.n = 0;
+      known.rest_zero = 0;
+      set_known(&known, pos, 0);
+      break;
+    default:
+      top = 0;
+      break;
+    }
+  }
+
+  return n;
+}
+
+/*
+ * Reports the loops that never terminate and, with -ftrap-endless-loops,
+ * guards each loop that may not and writes no output with an IR_TRAP
+ */
+void check_loops(program_t *prog, const info_t *info)
+{
+  program_t out;
+  unsigned long *masks;
+  size_t i;
+
+  masks = malloc((prog->len + 1) * sizeof(*masks));
+  if (masks == NULL) {
+    error("Out of memory while checking the loops");
+  }
+
+  if (report_loops(prog, info, masks) == 0 || !info->trap_loops) {
+    free(masks);
+    return;
+  }
+
+  program_init(&out);
+  for (i = 0; i < prog->len; i++) {
+    if (masks[i] != 0 && !writes_output(prog, i)) {
+      out.line = prog->ops[i].line;
+      out.column = prog->ops[i].column;
+      append_op(&out, IR_TRAP, 0, (long)masks[i]);
+    }
+    *append_op(&out, prog->ops[i].op, 0, 0) = prog->ops[i];
+  }
+
+  free(masks);
+  program_free(prog);
+  *prog = out;
+  match_loops(prog);
+}